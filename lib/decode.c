@@ -19,6 +19,14 @@
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef QUIRC_HAVE_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(QUIRC_HAVE_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define QUIRC_HAVE_NEON_TBL
+#endif
+
 #define MAX_POLY       64
 
 /************************************************************************
@@ -31,9 +39,14 @@ struct galois_field {
 	const uint8_t *exp;
 };
 
-static const uint8_t gf16_exp[16] = {
+/* The exponent tables cover two periods, so that the sum of two
+ * logarithms can be looked up without reducing it modulo p.
+ */
+static const uint8_t gf16_exp[32] = {
 	0x01, 0x02, 0x04, 0x08, 0x03, 0x06, 0x0c, 0x0b,
-	0x05, 0x0a, 0x07, 0x0e, 0x0f, 0x0d, 0x09, 0x01
+	0x05, 0x0a, 0x07, 0x0e, 0x0f, 0x0d, 0x09, 0x01,
+	0x02, 0x04, 0x08, 0x03, 0x06, 0x0c, 0x0b, 0x05,
+	0x0a, 0x07, 0x0e, 0x0f, 0x0d, 0x09, 0x01, 0x02
 };
 
 static const uint8_t gf16_log[16] = {
@@ -47,7 +60,7 @@ static const struct galois_field gf16 = {
 	.exp = gf16_exp
 };
 
-static const uint8_t gf256_exp[256] = {
+static const uint8_t gf256_exp[512] = {
 	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
 	0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
 	0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9,
@@ -79,7 +92,39 @@ static const uint8_t gf256_exp[256] = {
 	0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5,
 	0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
 	0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83,
-	0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01
+	0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01,
+	0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d,
+	0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26, 0x4c,
+	0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f,
+	0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0, 0x9d,
+	0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a,
+	0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23, 0x46,
+	0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d,
+	0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1, 0x5f,
+	0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65,
+	0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0, 0xfd,
+	0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe,
+	0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2, 0xd9,
+	0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d,
+	0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce, 0x81,
+	0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b,
+	0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc, 0x85,
+	0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f,
+	0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54, 0xa8,
+	0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49,
+	0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73, 0xe6,
+	0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc,
+	0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff, 0xe3,
+	0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95,
+	0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41, 0x82,
+	0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c,
+	0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6, 0x51,
+	0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3,
+	0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09, 0x12,
+	0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7,
+	0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16, 0x2c,
+	0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b,
+	0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01, 0x02
 };
 
 static const uint8_t gf256_log[256] = {
@@ -125,10 +170,22 @@ static const struct galois_field gf256 = {
 
 /************************************************************************
  * Polynomial operations
+ *
+ * Polynomials are stored lowest-order coefficient first, and the
+ * number of coefficients in use is passed explicitly.
  */
 
-static void poly_add(uint8_t *dst, const uint8_t *src, uint8_t c,
-		     int shift, const struct galois_field *gf)
+static inline uint8_t gf_mul(const struct galois_field *gf,
+			     uint8_t a, uint8_t b)
+{
+	if (!a || !b)
+		return 0;
+
+	return gf->exp[gf->log[a] + gf->log[b]];
+}
+
+static void poly_add(uint8_t *dst, const uint8_t *src, int len,
+		     uint8_t c, int shift, const struct galois_field *gf)
 {
 	int i;
 	int log_c = gf->log[c];
@@ -136,36 +193,31 @@ static void poly_add(uint8_t *dst, const uint8_t *src, uint8_t c,
 	if (!c)
 		return;
 
-	for (i = 0; i < MAX_POLY; i++) {
-		int p = i + shift;
-		uint8_t v = src[i];
+	if (len > MAX_POLY - shift)
+		len = MAX_POLY - shift;
 
-		if (p < 0 || p >= MAX_POLY)
-			continue;
-		if (!v)
-			continue;
+	for (i = 0; i < len; i++) {
+		uint8_t v = src[i];
 
-		dst[p] ^= gf->exp[(gf->log[v] + log_c) % gf->p];
+		if (v)
+			dst[i + shift] ^= gf->exp[gf->log[v] + log_c];
 	}
 }
 
-static uint8_t poly_eval(const uint8_t *s, uint8_t x,
+static uint8_t poly_eval(const uint8_t *s, int len, uint8_t x,
 			 const struct galois_field *gf)
 {
-	int i;
 	uint8_t sum = 0;
-	uint8_t log_x = gf->log[x];
+	int log_x = gf->log[x];
+	int i;
 
 	if (!x)
 		return s[0];
 
-	for (i = 0; i < MAX_POLY; i++) {
-		uint8_t c = s[i];
-
-		if (!c)
-			continue;
-
-		sum ^= gf->exp[(gf->log[c] + log_x * i) % gf->p];
+	for (i = len - 1; i >= 0; i--) {
+		if (sum)
+			sum = gf->exp[gf->log[sum] + log_x];
+		sum ^= s[i];
 	}
 
 	return sum;
@@ -173,11 +225,13 @@ static uint8_t poly_eval(const uint8_t *s, uint8_t x,
 
 /************************************************************************
  * Berlekamp-Massey algorithm for finding error locator polynomials.
+ *
+ * Returns the degree of the polynomial.
  */
 
-static void berlekamp_massey(const uint8_t *s, int N,
-			     const struct galois_field *gf,
-			     uint8_t *sigma)
+static int berlekamp_massey(const uint8_t *s, int N,
+			    const struct galois_field *gf,
+			    uint8_t *sigma)
 {
 	uint8_t C[MAX_POLY];
 	uint8_t B[MAX_POLY];
@@ -196,35 +250,34 @@ static void berlekamp_massey(const uint8_t *s, int N,
 		uint8_t mult;
 		int i;
 
-		for (i = 1; i <= L; i++) {
-			if (!(C[i] && s[n - i]))
-				continue;
+		for (i = 1; i <= L; i++)
+			d ^= gf_mul(gf, C[i], s[n - i]);
 
-			d ^= gf->exp[(gf->log[C[i]] +
-				      gf->log[s[n - i]]) %
-				     gf->p];
+		if (!d) {
+			m++;
+			continue;
 		}
 
-		mult = gf->exp[(gf->p - gf->log[b] + gf->log[d]) % gf->p];
+		mult = gf->exp[gf->p - gf->log[b] + gf->log[d]];
 
-		if (!d) {
-			m++;
-		} else if (L * 2 <= n) {
+		/* Neither polynomial has more than N + 1 coefficients */
+		if (L * 2 <= n) {
 			uint8_t T[MAX_POLY];
 
 			memcpy(T, C, sizeof(T));
-			poly_add(C, B, mult, m, gf);
+			poly_add(C, B, N + 1, mult, m, gf);
 			memcpy(B, T, sizeof(B));
 			L = n + 1 - L;
 			b = d;
 			m = 1;
 		} else {
-			poly_add(C, B, mult, m, gf);
+			poly_add(C, B, N + 1, mult, m, gf);
 			m++;
 		}
 	}
 
 	memcpy(sigma, C, MAX_POLY);
+	return L;
 }
 
 /************************************************************************
@@ -233,42 +286,370 @@ static void berlekamp_massey(const uint8_t *s, int N,
  * Generator polynomial for GF(2^8) is x^8 + x^4 + x^3 + x^2 + 1
  */
 
-static int block_syndromes(const uint8_t *data, int bs, int npar, uint8_t *s)
+/* Syndrome i is the received polynomial evaluated at alpha^i. The first
+ * byte of the block is the highest-order coefficient, so the bytes are
+ * taken in order by Horner's rule. All syndromes are advanced together,
+ * so that the steps for each are independent of each other.
+ */
+static void syndromes_scalar(const uint8_t *data, int bs, int npar,
+			     uint8_t *s)
 {
-	int nonzero = 0;
-	int i;
+	int i, j;
 
-	memset(s, 0, MAX_POLY);
+	for (j = 0; j < bs; j++) {
+		const uint8_t c = data[j];
+
+		for (i = 0; i < npar; i++) {
+			uint8_t sum = s[i];
+
+			if (sum)
+				sum = gf256_exp[gf256_log[sum] + i];
+			s[i] = sum ^ c;
+		}
+	}
+}
+
+#if defined(QUIRC_HAVE_SSSE3) || defined(QUIRC_HAVE_NEON_TBL)
+/* Vector syndromes. The block is split into 16 interleaved streams
+ * (byte j goes to stream j mod 16), each evaluated at alpha^(16i) by
+ * Horner's rule. Every lane is then multiplied by the same constant, so
+ * the multiplication is two table lookups, one for each nibble. The
+ * streams are combined at the end with their own powers of alpha^i.
+ *
+ * The block is padded with zeroes at the front to a multiple of 16,
+ * which doesn't change the result.
+ */
+#define SYNDROME_LANES		16
+#define SYNDROME_MAX_BLOCK	256
+
+/* Products of alpha^(16i) with each value of the low and high nibble */
+#define SYNDROME_TABLES		32
+
+static const uint8_t syndrome_tables[SYNDROME_TABLES][2][16] = {
+	{
+		{0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f},
+		{0x00, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70,
+		 0x80, 0x90, 0xa0, 0xb0, 0xc0, 0xd0, 0xe0, 0xf0}
+	},
+	{
+		{0x00, 0x4c, 0x98, 0xd4, 0x2d, 0x61, 0xb5, 0xf9,
+		 0x5a, 0x16, 0xc2, 0x8e, 0x77, 0x3b, 0xef, 0xa3},
+		{0x00, 0xb4, 0x75, 0xc1, 0xea, 0x5e, 0x9f, 0x2b,
+		 0xc9, 0x7d, 0xbc, 0x08, 0x23, 0x97, 0x56, 0xe2}
+	},
+	{
+		{0x00, 0x9d, 0x27, 0xba, 0x4e, 0xd3, 0x69, 0xf4,
+		 0x9c, 0x01, 0xbb, 0x26, 0xd2, 0x4f, 0xf5, 0x68},
+		{0x00, 0x25, 0x4a, 0x6f, 0x94, 0xb1, 0xde, 0xfb,
+		 0x35, 0x10, 0x7f, 0x5a, 0xa1, 0x84, 0xeb, 0xce}
+	},
+	{
+		{0x00, 0x46, 0x8c, 0xca, 0x05, 0x43, 0x89, 0xcf,
+		 0x0a, 0x4c, 0x86, 0xc0, 0x0f, 0x49, 0x83, 0xc5},
+		{0x00, 0x14, 0x28, 0x3c, 0x50, 0x44, 0x78, 0x6c,
+		 0xa0, 0xb4, 0x88, 0x9c, 0xf0, 0xe4, 0xd8, 0xcc}
+	},
+	{
+		{0x00, 0x5f, 0xbe, 0xe1, 0x61, 0x3e, 0xdf, 0x80,
+		 0xc2, 0x9d, 0x7c, 0x23, 0xa3, 0xfc, 0x1d, 0x42},
+		{0x00, 0x99, 0x2f, 0xb6, 0x5e, 0xc7, 0x71, 0xe8,
+		 0xbc, 0x25, 0x93, 0x0a, 0xe2, 0x7b, 0xcd, 0x54}
+	},
+	{
+		{0x00, 0xfd, 0xe7, 0x1a, 0xd3, 0x2e, 0x34, 0xc9,
+		 0xbb, 0x46, 0x5c, 0xa1, 0x68, 0x95, 0x8f, 0x72},
+		{0x00, 0x6b, 0xd6, 0xbd, 0xb1, 0xda, 0x67, 0x0c,
+		 0x7f, 0x14, 0xa9, 0xc2, 0xce, 0xa5, 0x18, 0x73}
+	},
+	{
+		{0x00, 0xd9, 0xaf, 0x76, 0x43, 0x9a, 0xec, 0x35,
+		 0x86, 0x5f, 0x29, 0xf0, 0xc5, 0x1c, 0x6a, 0xb3},
+		{0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff}
+	},
+	{
+		{0x00, 0x81, 0x1f, 0x9e, 0x3e, 0xbf, 0x21, 0xa0,
+		 0x7c, 0xfd, 0x63, 0xe2, 0x42, 0xc3, 0x5d, 0xdc},
+		{0x00, 0xf8, 0xed, 0x15, 0xc7, 0x3f, 0x2a, 0xd2,
+		 0x93, 0x6b, 0x7e, 0x86, 0x54, 0xac, 0xb9, 0x41}
+	},
+	{
+		{0x00, 0x85, 0x17, 0x92, 0x2e, 0xab, 0x39, 0xbc,
+		 0x5c, 0xd9, 0x4b, 0xce, 0x72, 0xf7, 0x65, 0xe0},
+		{0x00, 0xb8, 0x6d, 0xd5, 0xda, 0x62, 0xb7, 0x0f,
+		 0xa9, 0x11, 0xc4, 0x7c, 0x73, 0xcb, 0x1e, 0xa6}
+	},
+	{
+		{0x00, 0xa8, 0x4d, 0xe5, 0x9a, 0x32, 0xd7, 0x7f,
+		 0x29, 0x81, 0x64, 0xcc, 0xb3, 0x1b, 0xfe, 0x56},
+		{0x00, 0x52, 0xa4, 0xf6, 0x55, 0x07, 0xf1, 0xa3,
+		 0xaa, 0xf8, 0x0e, 0x5c, 0xff, 0xad, 0x5b, 0x09}
+	},
+	{
+		{0x00, 0xe6, 0xd1, 0x37, 0xbf, 0x59, 0x6e, 0x88,
+		 0x63, 0x85, 0xb2, 0x54, 0xdc, 0x3a, 0x0d, 0xeb},
+		{0x00, 0xc6, 0x91, 0x57, 0x3f, 0xf9, 0xae, 0x68,
+		 0x7e, 0xb8, 0xef, 0x29, 0x41, 0x87, 0xd0, 0x16}
+	},
+	{
+		{0x00, 0xe3, 0xdb, 0x38, 0xab, 0x48, 0x70, 0x93,
+		 0x4b, 0xa8, 0x90, 0x73, 0xe0, 0x03, 0x3b, 0xd8},
+		{0x00, 0x96, 0x31, 0xa7, 0x62, 0xf4, 0x53, 0xc5,
+		 0xc4, 0x52, 0xf5, 0x63, 0xa6, 0x30, 0x97, 0x01}
+	},
+	{
+		{0x00, 0x82, 0x19, 0x9b, 0x32, 0xb0, 0x2b, 0xa9,
+		 0x64, 0xe6, 0x7d, 0xff, 0x56, 0xd4, 0x4f, 0xcd},
+		{0x00, 0xc8, 0x8d, 0x45, 0x07, 0xcf, 0x8a, 0x42,
+		 0x0e, 0xc6, 0x83, 0x4b, 0x09, 0xc1, 0x84, 0x4c}
+	},
+	{
+		{0x00, 0x51, 0xa2, 0xf3, 0x59, 0x08, 0xfb, 0xaa,
+		 0xb2, 0xe3, 0x10, 0x41, 0xeb, 0xba, 0x49, 0x18},
+		{0x00, 0x79, 0xf2, 0x8b, 0xf9, 0x80, 0x0b, 0x72,
+		 0xef, 0x96, 0x1d, 0x64, 0x16, 0x6f, 0xe4, 0x9d}
+	},
+	{
+		{0x00, 0x12, 0x24, 0x36, 0x48, 0x5a, 0x6c, 0x7e,
+		 0x90, 0x82, 0xb4, 0xa6, 0xd8, 0xca, 0xfc, 0xee},
+		{0x00, 0x3d, 0x7a, 0x47, 0xf4, 0xc9, 0x8e, 0xb3,
+		 0xf5, 0xc8, 0x8f, 0xb2, 0x01, 0x3c, 0x7b, 0x46}
+	},
+	{
+		{0x00, 0x2c, 0x58, 0x74, 0xb0, 0x9c, 0xe8, 0xc4,
+		 0x7d, 0x51, 0x25, 0x09, 0xcd, 0xe1, 0x95, 0xb9},
+		{0x00, 0xfa, 0xe9, 0x13, 0xcf, 0x35, 0x26, 0xdc,
+		 0x83, 0x79, 0x6a, 0x90, 0x4c, 0xb6, 0xa5, 0x5f}
+	},
+	{
+		{0x00, 0x02, 0x04, 0x06, 0x08, 0x0a, 0x0c, 0x0e,
+		 0x10, 0x12, 0x14, 0x16, 0x18, 0x1a, 0x1c, 0x1e},
+		{0x00, 0x20, 0x40, 0x60, 0x80, 0xa0, 0xc0, 0xe0,
+		 0x1d, 0x3d, 0x5d, 0x7d, 0x9d, 0xbd, 0xdd, 0xfd}
+	},
+	{
+		{0x00, 0x98, 0x2d, 0xb5, 0x5a, 0xc2, 0x77, 0xef,
+		 0xb4, 0x2c, 0x99, 0x01, 0xee, 0x76, 0xc3, 0x5b},
+		{0x00, 0x75, 0xea, 0x9f, 0xc9, 0xbc, 0x23, 0x56,
+		 0x8f, 0xfa, 0x65, 0x10, 0x46, 0x33, 0xac, 0xd9}
+	},
+	{
+		{0x00, 0x27, 0x4e, 0x69, 0x9c, 0xbb, 0xd2, 0xf5,
+		 0x25, 0x02, 0x6b, 0x4c, 0xb9, 0x9e, 0xf7, 0xd0},
+		{0x00, 0x4a, 0x94, 0xde, 0x35, 0x7f, 0xa1, 0xeb,
+		 0x6a, 0x20, 0xfe, 0xb4, 0x5f, 0x15, 0xcb, 0x81}
+	},
+	{
+		{0x00, 0x8c, 0x05, 0x89, 0x0a, 0x86, 0x0f, 0x83,
+		 0x14, 0x98, 0x11, 0x9d, 0x1e, 0x92, 0x1b, 0x97},
+		{0x00, 0x28, 0x50, 0x78, 0xa0, 0x88, 0xf0, 0xd8,
+		 0x5d, 0x75, 0x0d, 0x25, 0xfd, 0xd5, 0xad, 0x85}
+	},
+	{
+		{0x00, 0xbe, 0x61, 0xdf, 0xc2, 0x7c, 0xa3, 0x1d,
+		 0x99, 0x27, 0xf8, 0x46, 0x5b, 0xe5, 0x3a, 0x84},
+		{0x00, 0x2f, 0x5e, 0x71, 0xbc, 0x93, 0xe2, 0xcd,
+		 0x65, 0x4a, 0x3b, 0x14, 0xd9, 0xf6, 0x87, 0xa8}
+	},
+	{
+		{0x00, 0xe7, 0xd3, 0x34, 0xbb, 0x5c, 0x68, 0x8f,
+		 0x6b, 0x8c, 0xb8, 0x5f, 0xd0, 0x37, 0x03, 0xe4},
+		{0x00, 0xd6, 0xb1, 0x67, 0x7f, 0xa9, 0xce, 0x18,
+		 0xfe, 0x28, 0x4f, 0x99, 0x81, 0x57, 0x30, 0xe6}
+	},
+	{
+		{0x00, 0xaf, 0x43, 0xec, 0x86, 0x29, 0xc5, 0x6a,
+		 0x11, 0xbe, 0x52, 0xfd, 0x97, 0x38, 0xd4, 0x7b},
+		{0x00, 0x22, 0x44, 0x66, 0x88, 0xaa, 0xcc, 0xee,
+		 0x0d, 0x2f, 0x49, 0x6b, 0x85, 0xa7, 0xc1, 0xe3}
+	},
+	{
+		{0x00, 0x1f, 0x3e, 0x21, 0x7c, 0x63, 0x42, 0x5d,
+		 0xf8, 0xe7, 0xc6, 0xd9, 0x84, 0x9b, 0xba, 0xa5},
+		{0x00, 0xed, 0xc7, 0x2a, 0x93, 0x7e, 0x54, 0xb9,
+		 0x3b, 0xd6, 0xfc, 0x11, 0xa8, 0x45, 0x6f, 0x82}
+	},
+	{
+		{0x00, 0x17, 0x2e, 0x39, 0x5c, 0x4b, 0x72, 0x65,
+		 0xb8, 0xaf, 0x96, 0x81, 0xe4, 0xf3, 0xca, 0xdd},
+		{0x00, 0x6d, 0xda, 0xb7, 0xa9, 0xc4, 0x73, 0x1e,
+		 0x4f, 0x22, 0x95, 0xf8, 0xe6, 0x8b, 0x3c, 0x51}
+	},
+	{
+		{0x00, 0x4d, 0x9a, 0xd7, 0x29, 0x64, 0xb3, 0xfe,
+		 0x52, 0x1f, 0xc8, 0x85, 0x7b, 0x36, 0xe1, 0xac},
+		{0x00, 0xa4, 0x55, 0xf1, 0xaa, 0x0e, 0xff, 0x5b,
+		 0x49, 0xed, 0x1c, 0xb8, 0xe3, 0x47, 0xb6, 0x12}
+	},
+	{
+		{0x00, 0xd1, 0xbf, 0x6e, 0x63, 0xb2, 0xdc, 0x0d,
+		 0xc6, 0x17, 0x79, 0xa8, 0xa5, 0x74, 0x1a, 0xcb},
+		{0x00, 0x91, 0x3f, 0xae, 0x7e, 0xef, 0x41, 0xd0,
+		 0xfc, 0x6d, 0xc3, 0x52, 0x82, 0x13, 0xbd, 0x2c}
+	},
+	{
+		{0x00, 0xdb, 0xab, 0x70, 0x4b, 0x90, 0xe0, 0x3b,
+		 0x96, 0x4d, 0x3d, 0xe6, 0xdd, 0x06, 0x76, 0xad},
+		{0x00, 0x31, 0x62, 0x53, 0xc4, 0xf5, 0xa6, 0x97,
+		 0x95, 0xa4, 0xf7, 0xc6, 0x51, 0x60, 0x33, 0x02}
+	},
+	{
+		{0x00, 0x19, 0x32, 0x2b, 0x64, 0x7d, 0x56, 0x4f,
+		 0xc8, 0xd1, 0xfa, 0xe3, 0xac, 0xb5, 0x9e, 0x87},
+		{0x00, 0x8d, 0x07, 0x8a, 0x0e, 0x83, 0x09, 0x84,
+		 0x1c, 0x91, 0x1b, 0x96, 0x12, 0x9f, 0x15, 0x98}
+	},
+	{
+		{0x00, 0xa2, 0x59, 0xfb, 0xb2, 0x10, 0xeb, 0x49,
+		 0x79, 0xdb, 0x20, 0x82, 0xcb, 0x69, 0x92, 0x30},
+		{0x00, 0xf2, 0xf9, 0x0b, 0xef, 0x1d, 0x16, 0xe4,
+		 0xc3, 0x31, 0x3a, 0xc8, 0x2c, 0xde, 0xd5, 0x27}
+	},
+	{
+		{0x00, 0x24, 0x48, 0x6c, 0x90, 0xb4, 0xd8, 0xfc,
+		 0x3d, 0x19, 0x75, 0x51, 0xad, 0x89, 0xe5, 0xc1},
+		{0x00, 0x7a, 0xf4, 0x8e, 0xf5, 0x8f, 0x01, 0x7b,
+		 0xf7, 0x8d, 0x03, 0x79, 0x02, 0x78, 0xf6, 0x8c}
+	},
+	{
+		{0x00, 0x58, 0xb0, 0xe8, 0x7d, 0x25, 0xcd, 0x95,
+		 0xfa, 0xa2, 0x4a, 0x12, 0x87, 0xdf, 0x37, 0x6f},
+		{0x00, 0xe9, 0xcf, 0x26, 0x83, 0x6a, 0x4c, 0xa5,
+		 0x1b, 0xf2, 0xd4, 0x3d, 0x98, 0x71, 0x57, 0xbe}
+	}
+};
+
+static int syndromes_pad(const uint8_t *data, int bs, uint8_t *padded)
+{
+	const int len = (bs + SYNDROME_LANES - 1) & ~(SYNDROME_LANES - 1);
+
+	memset(padded, 0, len - bs);
+	memcpy(padded + len - bs, data, bs);
+
+	return len;
+}
+
+static void syndromes_combine(const uint8_t *lanes, int i, uint8_t *s)
+{
+	uint8_t sum = 0;
+	int e = 0;
+	int l;
+
+	/* Lane l holds the terms of order 15 - l (mod 16) */
+	for (l = SYNDROME_LANES - 1; l >= 0; l--) {
+		if (lanes[l])
+			sum ^= gf256_exp[gf256_log[lanes[l]] + e];
+
+		e += i;
+		if (e >= 255)
+			e -= 255;
+	}
+
+	*s = sum;
+}
+#endif
+
+#ifdef QUIRC_HAVE_SSSE3
+__attribute__((target("ssse3")))
+static void syndromes_ssse3(const uint8_t *data, int bs, int npar,
+			    uint8_t *s)
+{
+	uint8_t padded[SYNDROME_MAX_BLOCK];
+	const int len = syndromes_pad(data, bs, padded);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	int i;
 
 	for (i = 0; i < npar; i++) {
+		const __m128i tlo =
+			_mm_loadu_si128((const __m128i *)syndrome_tables[i][0]);
+		const __m128i thi =
+			_mm_loadu_si128((const __m128i *)syndrome_tables[i][1]);
+		uint8_t lanes[SYNDROME_LANES];
+		__m128i sum = _mm_setzero_si128();
 		int j;
 
-		for (j = 0; j < bs; j++) {
-			uint8_t c = data[bs - j - 1];
+		for (j = 0; j < len; j += SYNDROME_LANES) {
+			__m128i l = _mm_and_si128(sum, mask);
+			__m128i h = _mm_and_si128(_mm_srli_epi16(sum, 4), mask);
 
-			if (!c)
-				continue;
+			sum = _mm_xor_si128(_mm_shuffle_epi8(tlo, l),
+					    _mm_shuffle_epi8(thi, h));
+			sum = _mm_xor_si128(sum, _mm_loadu_si128(
+					(const __m128i *)(padded + j)));
+		}
+
+		_mm_storeu_si128((__m128i *)lanes, sum);
+		syndromes_combine(lanes, i, &s[i]);
+	}
+}
+#endif
+
+#ifdef QUIRC_HAVE_NEON_TBL
+static void syndromes_neon(const uint8_t *data, int bs, int npar,
+			   uint8_t *s)
+{
+	uint8_t padded[SYNDROME_MAX_BLOCK];
+	const int len = syndromes_pad(data, bs, padded);
+	const uint8x16_t mask = vdupq_n_u8(0x0f);
+	int i;
 
-			s[i] ^= gf256_exp[((int)gf256_log[c] +
-				    i * j) % 255];
+	for (i = 0; i < npar; i++) {
+		const uint8x16_t tlo = vld1q_u8(syndrome_tables[i][0]);
+		const uint8x16_t thi = vld1q_u8(syndrome_tables[i][1]);
+		uint8_t lanes[SYNDROME_LANES];
+		uint8x16_t sum = vdupq_n_u8(0);
+		int j;
+
+		for (j = 0; j < len; j += SYNDROME_LANES) {
+			sum = veorq_u8(vqtbl1q_u8(tlo, vandq_u8(sum, mask)),
+				       vqtbl1q_u8(thi, vshrq_n_u8(sum, 4)));
+			sum = veorq_u8(sum, vld1q_u8(padded + j));
 		}
 
-		if (s[i])
-			nonzero = 1;
+		vst1q_u8(lanes, sum);
+		syndromes_combine(lanes, i, &s[i]);
 	}
+}
+#endif
 
-	return nonzero;
+static int block_syndromes(const uint8_t *data, int bs, int npar, uint8_t *s)
+{
+	int i;
+
+	memset(s, 0, MAX_POLY);
+
+#ifdef QUIRC_HAVE_SSSE3
+	if (npar <= SYNDROME_TABLES && bs <= SYNDROME_MAX_BLOCK &&
+	    __builtin_cpu_supports("ssse3"))
+		syndromes_ssse3(data, bs, npar, s);
+	else
+		syndromes_scalar(data, bs, npar, s);
+#elif defined(QUIRC_HAVE_NEON_TBL)
+	if (npar <= SYNDROME_TABLES && bs <= SYNDROME_MAX_BLOCK)
+		syndromes_neon(data, bs, npar, s);
+	else
+		syndromes_scalar(data, bs, npar, s);
+#else
+	syndromes_scalar(data, bs, npar, s);
+#endif
+
+	for (i = 0; i < npar; i++)
+		if (s[i])
+			return 1;
+
+	return 0;
 }
 
 static void eloc_poly(uint8_t *omega,
 		      const uint8_t *s, const uint8_t *sigma,
-		      int npar)
+		      int sigma_len, int npar)
 {
 	int i;
 
 	memset(omega, 0, MAX_POLY);
 
-	for (i = 0; i < npar; i++) {
+	for (i = 0; i < npar && i < sigma_len; i++) {
 		const uint8_t a = sigma[i];
 		const uint8_t log_a = gf256_log[a];
 		int j;
@@ -276,17 +657,12 @@ static void eloc_poly(uint8_t *omega,
 		if (!a)
 			continue;
 
-		for (j = 0; j + 1 < MAX_POLY; j++) {
+		for (j = 0; i + j < npar; j++) {
 			const uint8_t b = s[j + 1];
 
-			if (i + j >= npar)
-				break;
-
-			if (!b)
-				continue;
-
-			omega[i + j] ^=
-			    gf256_exp[(log_a + gf256_log[b]) % 255];
+			if (b)
+				omega[i + j] ^=
+				    gf256_exp[log_a + gf256_log[b]];
 		}
 	}
 }
@@ -299,37 +675,77 @@ static quirc_decode_error_t correct_block(uint8_t *data,
 	uint8_t sigma[MAX_POLY];
 	uint8_t sigma_deriv[MAX_POLY];
 	uint8_t omega[MAX_POLY];
+	int terms[MAX_POLY];
+	int steps[MAX_POLY];
+	int num_terms = 0;
+	int sigma_len;
+	int roots = 0;
+	int degenerate = 0;
 	int i;
 
 	/* Compute syndrome vector */
 	if (!block_syndromes(data, ecc->bs, npar, s))
 		return QUIRC_SUCCESS;
 
-	berlekamp_massey(s, npar, &gf256, sigma);
+	sigma_len = berlekamp_massey(s, npar, &gf256, sigma) + 1;
 
 	/* Compute derivative of sigma */
 	memset(sigma_deriv, 0, MAX_POLY);
-	for (i = 0; i + 1 < MAX_POLY; i += 2)
+	for (i = 0; i + 1 < sigma_len; i += 2)
 		sigma_deriv[i] = sigma[i + 1];
 
 	/* Compute error evaluator polynomial */
-	eloc_poly(omega, s, sigma, npar - 1);
+	eloc_poly(omega, s, sigma, sigma_len, npar - 1);
+
+	/* Find error locations by Chien search. Each non-zero term
+	 * sigma_k x^k, evaluated at alpha^-i, is kept as a logarithm and
+	 * stepped by alpha^-k for each position.
+	 */
+	for (i = 0; i < sigma_len; i++)
+		if (sigma[i]) {
+			terms[num_terms] = gf256_log[sigma[i]];
+			steps[num_terms] = 255 - i;
+			num_terms++;
+		}
 
-	/* Find error locations and magnitudes */
-	for (i = 0; i < ecc->bs; i++) {
-		uint8_t xinv = gf256_exp[255 - i];
+	for (i = 0; i < ecc->bs && roots < sigma_len - 1; i++) {
+		uint8_t sum = 0;
+		int k;
 
-		if (!poly_eval(sigma, xinv, &gf256)) {
-			uint8_t sd_x = poly_eval(sigma_deriv, xinv, &gf256);
-			uint8_t omega_x = poly_eval(omega, xinv, &gf256);
-			uint8_t error = gf256_exp[(255 - gf256_log[sd_x] +
-						   gf256_log[omega_x]) % 255];
+		for (k = 0; k < num_terms; k++) {
+			int t = terms[k];
+
+			sum ^= gf256_exp[t];
+			t += steps[k];
+			terms[k] = (t >= 255) ? t - 255 : t;
+		}
+
+		if (!sum) {
+			uint8_t xinv = gf256_exp[255 - i];
+			uint8_t sd_x = poly_eval(sigma_deriv, sigma_len - 1,
+						 xinv, &gf256);
+			uint8_t omega_x = poly_eval(omega, npar - 1,
+						    xinv, &gf256);
+			uint8_t error = gf256_exp[255 - gf256_log[sd_x] +
+						  gf256_log[omega_x]];
+
+			if (!sd_x || !omega_x)
+				degenerate = 1;
 
 			data[ecc->bs - i - 1] ^= error;
+			roots++;
 		}
 	}
 
-	if (block_syndromes(data, ecc->bs, npar, s))
+	/* A locator of degree L needs L roots within the block. If it has
+	 * them and L is within the correction capacity, the corrected
+	 * block is a codeword, and needn't be checked again.
+	 */
+	if (roots != sigma_len - 1)
+		return QUIRC_ERROR_DATA_ECC;
+
+	if ((roots * 2 > npar || degenerate) &&
+	    block_syndromes(data, ecc->bs, npar, s))
 		return QUIRC_ERROR_DATA_ECC;
 
 	return QUIRC_SUCCESS;
@@ -373,6 +789,7 @@ static quirc_decode_error_t correct_format(uint16_t *f_ret)
 	int i;
 	uint8_t s[MAX_POLY];
 	uint8_t sigma[MAX_POLY];
+	int sigma_len;
 
 	/* Evaluate U (received codeword) at each of alpha_1 .. alpha_6
 	 * to get S_1 .. S_6 (but we index them from 0).
@@ -380,11 +797,11 @@ static quirc_decode_error_t correct_format(uint16_t *f_ret)
 	if (!format_syndromes(u, s))
 		return QUIRC_SUCCESS;
 
-	berlekamp_massey(s, FORMAT_SYNDROMES, &gf16, sigma);
+	sigma_len = berlekamp_massey(s, FORMAT_SYNDROMES, &gf16, sigma) + 1;
 
 	/* Now, find the roots of the polynomial */
 	for (i = 0; i < 15; i++)
-		if (!poly_eval(sigma, gf16_exp[15 - i], &gf16))
+		if (!poly_eval(sigma, sigma_len, gf16_exp[15 - i], &gf16))
 			u ^= (1 << i);
 
 	if (format_syndromes(u, s))
@@ -452,91 +869,99 @@ static quirc_decode_error_t read_format(const struct quirc_code *code,
 	return QUIRC_SUCCESS;
 }
 
-static int mask_bit(int mask, int i, int j)
+/* Mask patterns. Each one repeats every 12 modules in both directions,
+ * so bit (j % 12) of mask_table[mask][i % 12] is set where the mask
+ * inverts module (i, j).
+ */
+static const uint16_t mask_table[8][12] = {
+	{0x555, 0xaaa, 0x555, 0xaaa, 0x555, 0xaaa,
+	 0x555, 0xaaa, 0x555, 0xaaa, 0x555, 0xaaa},
+	{0xfff, 0x000, 0xfff, 0x000, 0xfff, 0x000,
+	 0xfff, 0x000, 0xfff, 0x000, 0xfff, 0x000},
+	{0x249, 0x249, 0x249, 0x249, 0x249, 0x249,
+	 0x249, 0x249, 0x249, 0x249, 0x249, 0x249},
+	{0x249, 0x924, 0x492, 0x249, 0x924, 0x492,
+	 0x249, 0x924, 0x492, 0x249, 0x924, 0x492},
+	{0x1c7, 0x1c7, 0xe38, 0xe38, 0x1c7, 0x1c7,
+	 0xe38, 0xe38, 0x1c7, 0x1c7, 0xe38, 0xe38},
+	{0xfff, 0x041, 0x249, 0x555, 0x249, 0x041,
+	 0xfff, 0x041, 0x249, 0x555, 0x249, 0x041},
+	{0xfff, 0x1c7, 0x6db, 0x555, 0xb6d, 0xc71,
+	 0xfff, 0x1c7, 0x6db, 0x555, 0xb6d, 0xc71},
+	{0x555, 0xe38, 0xc71, 0xaaa, 0x1c7, 0x38e,
+	 0x555, 0xe38, 0xc71, 0xaaa, 0x1c7, 0x38e}
+};
+
+static void reserve_rect(uint8_t *map, int size, int i, int j, int h, int w)
 {
-	switch (mask) {
-	case 0: return !((i + j) % 2);
-	case 1: return !(i % 2);
-	case 2: return !(j % 3);
-	case 3: return !((i + j) % 3);
-	case 4: return !(((i / 2) + (j / 3)) % 2);
-	case 5: return !((i * j) % 2 + (i * j) % 3);
-	case 6: return !(((i * j) % 2 + (i * j) % 3) % 2);
-	case 7: return !(((i * j) % 3 + (i + j) % 2) % 2);
-	}
+	int y, x;
 
-	return 0;
+	for (y = i; y < i + h; y++)
+		for (x = j; x < j + w; x++) {
+			int p = y * size + x;
+
+			map[p >> 3] |= 1 << (p & 7);
+		}
 }
 
-static int reserved_cell(int version, int i, int j)
+/* Build a bitmap, laid out like cell_bitmap, of the modules which hold
+ * function patterns rather than data.
+ */
+static void reserved_cells(int version, uint8_t *map)
 {
 	const struct quirc_version_info *ver = &quirc_version_db[version];
 	int size = version * 4 + 17;
-	int ai = -1, aj = -1, a;
-
-	/* Finder + format: top left */
-	if (i < 9 && j < 9)
-		return 1;
+	int last, a, b;
 
-	/* Finder + format: bottom left */
-	if (i + 8 >= size && j < 9)
-		return 1;
+	memset(map, 0, (size * size + 7) >> 3);
 
-	/* Finder + format: top right */
-	if (i < 9 && j + 8 >= size)
-		return 1;
+	/* Finders + format */
+	reserve_rect(map, size, 0, 0, 9, 9);
+	reserve_rect(map, size, size - 8, 0, 8, 9);
+	reserve_rect(map, size, 0, size - 8, 9, 8);
 
-	/* Exclude timing patterns */
-	if (i == 6 || j == 6)
-		return 1;
+	/* Timing patterns */
+	reserve_rect(map, size, 6, 0, 1, size);
+	reserve_rect(map, size, 0, 6, size, 1);
 
-	/* Exclude version info, if it exists. Version info sits adjacent to
+	/* Version info, if it exists. Version info sits adjacent to
 	 * the top-right and bottom-left finders in three rows, bounded by
 	 * the timing pattern.
 	 */
 	if (version >= 7) {
-		if (i < 6 && j + 11 >= size)
-			return 1;
-		if (i + 11 >= size && j < 6)
-			return 1;
+		reserve_rect(map, size, 0, size - 11, 6, 3);
+		reserve_rect(map, size, size - 11, 0, 3, 6);
 	}
 
-	/* Exclude alignment patterns */
-	for (a = 0; a < QUIRC_MAX_ALIGNMENT && ver->apat[a]; a++) {
-		int p = ver->apat[a];
-
-		if (abs(p - i) < 3)
-			ai = a;
-		if (abs(p - j) < 3)
-			aj = a;
-	}
+	/* Alignment patterns, except for those which would overlap the
+	 * finders.
+	 */
+	for (last = 0; last < QUIRC_MAX_ALIGNMENT && ver->apat[last]; last++);
+	last--;
 
-	if (ai >= 0 && aj >= 0) {
-		a--;
-		if (ai > 0 && ai < a)
-			return 1;
-		if (aj > 0 && aj < a)
-			return 1;
-		if (aj == a && ai == a)
-			return 1;
-	}
+	for (a = 0; a <= last; a++)
+		for (b = 0; b <= last; b++) {
+			if ((a == 0 || a == last) && (b == 0 || b == last) &&
+			    !(a == last && b == last))
+				continue;
 
-	return 0;
+			reserve_rect(map, size, ver->apat[a] - 2,
+				     ver->apat[b] - 2, 5, 5);
+		}
 }
 
-static void read_bit(const struct quirc_code *code,
-		     struct quirc_data *data,
-		     struct datastream *ds, int i, int j)
+static inline void read_bit(const struct quirc_code *code,
+			    const uint8_t *reserved, struct datastream *ds,
+			    int p, int mask)
 {
-	int bitpos = ds->data_bits & 7;
-	int bytepos = ds->data_bits >> 3;
-	int v = grid_bit(code, j, i);
+	int v;
 
-	if (mask_bit(data->mask, i, j))
-		v ^= 1;
+	if ((reserved[p >> 3] >> (p & 7)) & 1)
+		return;
 
+	v = ((code->cell_bitmap[p >> 3] >> (p & 7)) & 1) ^ mask;
 	if (v)
-		ds->raw[bytepos] |= (0x80 >> bitpos);
+		ds->raw[ds->data_bits >> 3] |= 0x80 >> (ds->data_bits & 7);
 
 	ds->data_bits++;
 }
@@ -545,26 +970,46 @@ static void read_data(const struct quirc_code *code,
 		      struct quirc_data *data,
 		      struct datastream *ds)
 {
-	int y = code->size - 1;
-	int x = code->size - 1;
+	const uint16_t *mask = mask_table[data->mask];
+	uint8_t reserved[QUIRC_MAX_BITMAP];
+	int size = code->size;
 	int dir = -1;
+	int x;
+
+	reserved_cells(data->version, reserved);
+
+	/* Data is read in pairs of columns, from right to left, moving
+	 * up and down alternately and skipping the vertical timing
+	 * pattern.
+	 */
+	for (x = size - 1; x > 0; x -= 2) {
+		int y = dir < 0 ? size - 1 : 0;
+		int ym, m0, m1;
+		int n;
 
-	while (x > 0) {
 		if (x == 6)
 			x--;
 
-		if (!reserved_cell(data->version, y, x))
-			read_bit(code, data, ds, y, x);
+		ym = y % 12;
+		m0 = x % 12;
+		m1 = (x - 1) % 12;
+
+		for (n = 0; n < size; n++) {
+			int p = y * size + x;
 
-		if (!reserved_cell(data->version, y, x - 1))
-			read_bit(code, data, ds, y, x - 1);
+			read_bit(code, reserved, ds, p, (mask[ym] >> m0) & 1);
+			read_bit(code, reserved, ds, p - 1,
+				 (mask[ym] >> m1) & 1);
 
-		y += dir;
-		if (y < 0 || y >= code->size) {
-			dir = -dir;
-			x -= 2;
 			y += dir;
+			ym += dir;
+			if (ym < 0)
+				ym = 11;
+			else if (ym > 11)
+				ym = 0;
 		}
+
+		dir = -dir;
 	}
 }
 
@@ -606,6 +1051,8 @@ static quirc_decode_error_t codestream_ecc(struct quirc_data *data,
 		dst_offset += ecc->dw;
 	}
 
+	/* take_bits() loads up to three bytes past the end */
+	memset(ds->data + dst_offset, 0, 3);
 	ds->data_bits = dst_offset * 8;
 
 	return QUIRC_SUCCESS;
@@ -616,40 +1063,64 @@ static inline int bits_remaining(const struct datastream *ds)
 	return ds->data_bits - ds->ptr;
 }
 
+/* Read up to 16 bits. If the stream runs out, only the remaining bits
+ * are returned.
+ *
+ * struct datastream's buffer is always at least three bytes larger than
+ * the codewords it holds, so a 32-bit window can be loaded from any
+ * position in the stream.
+ */
 static int take_bits(struct datastream *ds, int len)
 {
-	int ret = 0;
+	const uint8_t *p = ds->data + (ds->ptr >> 3);
+	uint32_t window;
 
-	while (len && (ds->ptr < ds->data_bits)) {
-		uint8_t b = ds->data[ds->ptr >> 3];
-		int bitpos = ds->ptr & 7;
+	if (len > bits_remaining(ds))
+		len = bits_remaining(ds);
+	if (len <= 0)
+		return 0;
 
-		ret <<= 1;
-		if ((b << bitpos) & 0x80)
-			ret |= 1;
+	window = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		 ((uint32_t)p[2] << 8) | p[3];
+	window <<= ds->ptr & 7;
 
-		ds->ptr++;
-		len--;
-	}
-
-	return ret;
+	ds->ptr += len;
+	return window >> (32 - len);
 }
 
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
 static int numeric_tuple(struct quirc_data *data,
 			 struct datastream *ds,
 			 int bits, int digits)
 {
+	uint8_t *out = data->payload + data->payload_len;
 	int tuple;
-	int i;
 
 	if (bits_remaining(ds) < bits)
 		return -1;
 
 	tuple = take_bits(ds, bits);
 
-	for (i = digits - 1; i >= 0; i--) {
-		data->payload[data->payload_len + i] = tuple % 10 + '0';
-		tuple /= 10;
+	/* Tuples may exceed the digit count (up to 1023 for three digits),
+	 * in which case only the low digits are kept.
+	 */
+	switch (digits) {
+	case 3:
+		out[0] = (tuple / 100) % 10 + '0';
+		out++;
+		/* fall through */
+	case 2:
+		out[0] = digit_pairs[(tuple % 100) * 2];
+		out[1] = digit_pairs[(tuple % 100) * 2 + 1];
+		break;
+	default:
+		out[0] = tuple % 10 + '0';
+		break;
 	}
 
 	data->payload_len += digits;
@@ -696,21 +1167,23 @@ static int alpha_tuple(struct quirc_data *data,
 		       struct datastream *ds,
 		       int bits, int digits)
 {
+	static const char alpha_map[] =
+		"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+	uint8_t *out = data->payload + data->payload_len;
 	int tuple;
-	int i;
 
 	if (bits_remaining(ds) < bits)
 		return -1;
 
 	tuple = take_bits(ds, bits);
 
-	for (i = 0; i < digits; i++) {
-		static const char *alpha_map =
-			"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+	if (digits == 2) {
+		int hi = tuple / 45;
 
-		data->payload[data->payload_len + digits - i - 1] =
-			alpha_map[tuple % 45];
-		tuple /= 45;
+		out[1] = alpha_map[tuple - hi * 45];
+		out[0] = alpha_map[hi % 45];
+	} else {
+		out[0] = alpha_map[tuple % 45];
 	}
 
 	data->payload_len += digits;
@@ -750,7 +1223,10 @@ static quirc_decode_error_t decode_alpha(struct quirc_data *data,
 static quirc_decode_error_t decode_byte(struct quirc_data *data,
 					struct datastream *ds)
 {
+	const uint8_t *src;
+	uint8_t *dst;
 	int bits = 16;
+	int shift;
 	int count;
 	int i;
 
@@ -763,8 +1239,22 @@ static quirc_decode_error_t decode_byte(struct quirc_data *data,
 	if (bits_remaining(ds) < count * 8)
 		return QUIRC_ERROR_DATA_UNDERFLOW;
 
-	for (i = 0; i < count; i++)
-		data->payload[data->payload_len++] = take_bits(ds, 8);
+	/* Segments usually start on a nibble boundary, so copy whole
+	 * bytes when aligned and otherwise splice each byte from two.
+	 */
+	src = ds->data + (ds->ptr >> 3);
+	shift = ds->ptr & 7;
+	dst = data->payload + data->payload_len;
+
+	if (!shift) {
+		memcpy(dst, src, count);
+	} else {
+		for (i = 0; i < count; i++)
+			dst[i] = (src[i] << shift) | (src[i + 1] >> (8 - shift));
+	}
+
+	ds->ptr += count * 8;
+	data->payload_len += count;
 
 	return QUIRC_SUCCESS;
 }
@@ -892,10 +1382,16 @@ quirc_decode_error_t quirc_decode(const struct quirc_code *code,
 	if ((code->size - 17) % 4)
 		return QUIRC_ERROR_INVALID_GRID_SIZE;
 
-	memset(data, 0, sizeof(*data));
-	memset(&ds, 0, sizeof(ds));
-
+	/* Neither structure is cleared as a whole: only the fields and
+	 * the parts of the buffers which are used are initialized.
+	 */
 	data->version = (code->size - 17) / 4;
+	data->ecc_level = 0;
+	data->mask = 0;
+	data->data_type = 0;
+	data->payload_len = 0;
+	data->payload[0] = 0;
+	data->eci = 0;
 
 	if (data->version < 1 ||
 	    data->version > QUIRC_MAX_VERSION)
@@ -917,6 +1413,11 @@ quirc_decode_error_t quirc_decode(const struct quirc_code *code,
 	 */
 
 	ds.raw = data->payload;
+	ds.data_bits = 0;
+	ds.ptr = 0;
+
+	/* The codewords may be followed by up to 7 remainder bits. */
+	memset(ds.raw, 0, quirc_version_db[data->version].data_bytes + 1);
 
 	read_data(code, data, &ds);
 	err = codestream_ecc(data, &ds);
@@ -934,15 +1435,85 @@ quirc_decode_error_t quirc_decode(const struct quirc_code *code,
 
 void quirc_flip(struct quirc_code *code)
 {
-	struct quirc_code flipped = {0};
+	uint8_t flipped[QUIRC_MAX_BITMAP];
 	unsigned int offset = 0;
+	int len;
+
+	if (code->size < 0 || code->size > QUIRC_MAX_GRID_SIZE)
+		return;
+
+	len = (code->size * code->size + 7) >> 3;
+	memset(flipped, 0, len);
+
 	for (int y = 0; y < code->size; y++) {
 		for (int x = 0; x < code->size; x++) {
 			if (grid_bit(code, y, x)) {
-				flipped.cell_bitmap[offset >> 3u] |= (1u << (offset & 7u));
+				flipped[offset >> 3u] |= (1u << (offset & 7u));
 			}
 			offset++;
 		}
 	}
-	memcpy(&code->cell_bitmap, &flipped.cell_bitmap, sizeof(flipped.cell_bitmap));
+	memcpy(code->cell_bitmap, flipped, len);
+}
+
+int quirc_decode_all(const struct quirc *q, void *arena, size_t size)
+{
+	struct quirc_result *results = arena;
+	const int count = quirc_count(q);
+	uint8_t *out;
+	size_t avail;
+	int i;
+
+	if (size < count * sizeof(results[0]))
+		return -1;
+
+	out = (uint8_t *)(results + count);
+	avail = size - count * sizeof(results[0]);
+
+	for (i = 0; i < count; i++) {
+		struct quirc_result *r = &results[i];
+		struct quirc_code code;
+		struct quirc_data data;
+		quirc_decode_error_t err;
+
+		quirc_extract(q, i, &code);
+		memcpy(r->corners, code.corners, sizeof(r->corners));
+
+		err = quirc_decode(&code, &data);
+		if (err == QUIRC_ERROR_DATA_ECC) {
+			quirc_flip(&code);
+			err = quirc_decode(&code, &data);
+		}
+
+		if (!err && (size_t)data.payload_len + 1 > avail)
+			err = QUIRC_ERROR_DATA_OVERFLOW;
+
+		r->err = err;
+		if (err) {
+			r->version = 0;
+			r->ecc_level = 0;
+			r->mask = 0;
+			r->data_type = 0;
+			r->eci = 0;
+			r->payload = NULL;
+			r->payload_len = 0;
+			continue;
+		}
+
+		r->version = data.version;
+		r->ecc_level = data.ecc_level;
+		r->mask = data.mask;
+		r->data_type = data.data_type;
+		r->eci = data.eci;
+
+		/* Copy the nul terminator too */
+		memcpy(out, data.payload, data.payload_len + 1);
+		r->payload = out;
+		r->payload_len = data.payload_len;
+
+		out += data.payload_len + 1;
+		avail -= data.payload_len + 1;
+	}
+
+	return count;
 }
@@ -25,6 +25,20 @@
 #endif // QUIRC_USE_TGMATH
 #include "quirc_internal.h"
 
+#ifdef QUIRC_USE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef QUIRC_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef QUIRC_HAVE_AVX2
+#include <immintrin.h>
+#endif
+#ifdef QUIRC_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
 /************************************************************************
  * Linear algebra routines
  */
@@ -123,6 +137,157 @@ static void perspective_unmap(const quirc_float_t *c,
 		den;
 }
 
+/************************************************************************
+ * Perspective mapping kernels
+ *
+ * These map a list of grid coordinates at once. The vector versions
+ * evaluate the same expressions as perspective_map() for 2 or 4 points
+ * per instruction, without fusing multiplies and adds, and round with
+ * the CPU's conversion instructions (to nearest-even, as rint() does),
+ * so the results are identical to the scalar version.
+ */
+
+typedef void (*map_points_func_t)(const quirc_float_t *c,
+				  const quirc_float_t *u,
+				  const quirc_float_t *v,
+				  int start, int len, int *px, int *py);
+
+static void map_points_scalar(const quirc_float_t *c,
+			      const quirc_float_t *u, const quirc_float_t *v,
+			      int start, int len, int *px, int *py)
+{
+	int i;
+
+	for (i = start; i < len; i++) {
+		struct quirc_point p;
+
+		perspective_map(c, u[i], v[i], &p);
+		px[i] = p.x;
+		py[i] = p.y;
+	}
+}
+
+#if defined(QUIRC_HAVE_SSE2) && !defined(QUIRC_FLOAT_TYPE)
+static void map_points_sse2(const quirc_float_t *c,
+			    const quirc_float_t *u, const quirc_float_t *v,
+			    int start, int len, int *px, int *py)
+{
+	const __m128d one = _mm_set1_pd(1.0);
+	const __m128d c0 = _mm_set1_pd(c[0]);
+	const __m128d c1 = _mm_set1_pd(c[1]);
+	const __m128d c2 = _mm_set1_pd(c[2]);
+	const __m128d c3 = _mm_set1_pd(c[3]);
+	const __m128d c4 = _mm_set1_pd(c[4]);
+	const __m128d c5 = _mm_set1_pd(c[5]);
+	const __m128d c6 = _mm_set1_pd(c[6]);
+	const __m128d c7 = _mm_set1_pd(c[7]);
+	int i;
+
+	for (i = start; i + 2 <= len; i += 2) {
+		__m128d pu = _mm_loadu_pd(u + i);
+		__m128d pv = _mm_loadu_pd(v + i);
+		__m128d den = _mm_div_pd(one, _mm_add_pd(_mm_add_pd(
+			_mm_mul_pd(c6, pu), _mm_mul_pd(c7, pv)), one));
+		__m128d x = _mm_mul_pd(_mm_add_pd(_mm_add_pd(
+			_mm_mul_pd(c0, pu), _mm_mul_pd(c1, pv)), c2), den);
+		__m128d y = _mm_mul_pd(_mm_add_pd(_mm_add_pd(
+			_mm_mul_pd(c3, pu), _mm_mul_pd(c4, pv)), c5), den);
+
+		_mm_storel_epi64((__m128i *)(px + i), _mm_cvtpd_epi32(x));
+		_mm_storel_epi64((__m128i *)(py + i), _mm_cvtpd_epi32(y));
+	}
+
+	map_points_scalar(c, u, v, i, len, px, py);
+}
+#endif
+
+#if defined(QUIRC_HAVE_AVX2) && !defined(QUIRC_FLOAT_TYPE)
+__attribute__((target("avx2")))
+static void map_points_avx2(const quirc_float_t *c,
+			    const quirc_float_t *u, const quirc_float_t *v,
+			    int start, int len, int *px, int *py)
+{
+	const __m256d one = _mm256_set1_pd(1.0);
+	const __m256d c0 = _mm256_set1_pd(c[0]);
+	const __m256d c1 = _mm256_set1_pd(c[1]);
+	const __m256d c2 = _mm256_set1_pd(c[2]);
+	const __m256d c3 = _mm256_set1_pd(c[3]);
+	const __m256d c4 = _mm256_set1_pd(c[4]);
+	const __m256d c5 = _mm256_set1_pd(c[5]);
+	const __m256d c6 = _mm256_set1_pd(c[6]);
+	const __m256d c7 = _mm256_set1_pd(c[7]);
+	int i;
+
+	for (i = start; i + 4 <= len; i += 4) {
+		__m256d pu = _mm256_loadu_pd(u + i);
+		__m256d pv = _mm256_loadu_pd(v + i);
+		__m256d den = _mm256_div_pd(one, _mm256_add_pd(_mm256_add_pd(
+			_mm256_mul_pd(c6, pu), _mm256_mul_pd(c7, pv)), one));
+		__m256d x = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(
+			_mm256_mul_pd(c0, pu), _mm256_mul_pd(c1, pv)), c2), den);
+		__m256d y = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(
+			_mm256_mul_pd(c3, pu), _mm256_mul_pd(c4, pv)), c5), den);
+
+		_mm_storeu_si128((__m128i *)(px + i), _mm256_cvtpd_epi32(x));
+		_mm_storeu_si128((__m128i *)(py + i), _mm256_cvtpd_epi32(y));
+	}
+
+	map_points_scalar(c, u, v, i, len, px, py);
+}
+#endif
+
+#if defined(QUIRC_HAVE_NEON) && defined(__aarch64__) && \
+    !defined(QUIRC_FLOAT_TYPE)
+static void map_points_neon(const quirc_float_t *c,
+			    const quirc_float_t *u, const quirc_float_t *v,
+			    int start, int len, int *px, int *py)
+{
+	const float64x2_t one = vdupq_n_f64(1.0);
+	const float64x2_t c0 = vdupq_n_f64(c[0]);
+	const float64x2_t c1 = vdupq_n_f64(c[1]);
+	const float64x2_t c2 = vdupq_n_f64(c[2]);
+	const float64x2_t c3 = vdupq_n_f64(c[3]);
+	const float64x2_t c4 = vdupq_n_f64(c[4]);
+	const float64x2_t c5 = vdupq_n_f64(c[5]);
+	const float64x2_t c6 = vdupq_n_f64(c[6]);
+	const float64x2_t c7 = vdupq_n_f64(c[7]);
+	int i;
+
+	for (i = start; i + 2 <= len; i += 2) {
+		float64x2_t pu = vld1q_f64(u + i);
+		float64x2_t pv = vld1q_f64(v + i);
+		float64x2_t den = vdivq_f64(one, vaddq_f64(vaddq_f64(
+			vmulq_f64(c6, pu), vmulq_f64(c7, pv)), one));
+		float64x2_t x = vmulq_f64(vaddq_f64(vaddq_f64(
+			vmulq_f64(c0, pu), vmulq_f64(c1, pv)), c2), den);
+		float64x2_t y = vmulq_f64(vaddq_f64(vaddq_f64(
+			vmulq_f64(c3, pu), vmulq_f64(c4, pv)), c5), den);
+
+		/* Saturate, so that far out of range points stay out */
+		vst1_s32(px + i, vqmovn_s64(vcvtnq_s64_f64(x)));
+		vst1_s32(py + i, vqmovn_s64(vcvtnq_s64_f64(y)));
+	}
+
+	map_points_scalar(c, u, v, i, len, px, py);
+}
+#endif
+
+static map_points_func_t map_points_kernel(void)
+{
+#ifndef QUIRC_FLOAT_TYPE
+#ifdef QUIRC_HAVE_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return map_points_avx2;
+#endif
+#if defined(QUIRC_HAVE_SSE2)
+	return map_points_sse2;
+#elif defined(QUIRC_HAVE_NEON) && defined(__aarch64__)
+	return map_points_neon;
+#endif
+#endif
+	return map_points_scalar;
+}
+
 /************************************************************************
  * Span-based floodfill routine
  */
@@ -158,6 +323,7 @@ static void flood_fill_line(struct quirc *q, int x, int y,
 	/* Return the processed range */
 	*leftp = left;
 	*rightp = right;
+	QUIRC_STATS_ADD(q, flood_fill_spans, 1);
 
 	if (func)
 		func(user_data, y, left, right);
@@ -237,6 +403,7 @@ static void flood_fill_seed(struct quirc *q,
 		struct quirc_flood_fill_vars * const vars = next_vars;
 		quirc_pixel_t *row;
 
+		QUIRC_STATS_MAX(q, flood_fill_max_depth, vars - stack + 1);
 		if (vars == last_vars) {
 			/*
 			 * "Stack overflow".
@@ -245,6 +412,7 @@ static void flood_fill_seed(struct quirc *q,
 			 * the image, which is not likely a part of
 			 * a valid QR code anyway.
 			 */
+			QUIRC_STATS_ADD(q, flood_fill_overflows, 1);
 			break;
 		}
 
@@ -285,847 +453,4112 @@ static void flood_fill_seed(struct quirc *q,
 }
 
 /************************************************************************
- * Adaptive thresholding
+ * Packed pixels
+ *
+ * With QUIRC_BITPLANE, each row is thresholded into q->pixels, which
+ * only holds a single row, and then packed into q->bits. Otherwise rows
+ * are thresholded in place.
  */
 
-static uint8_t otsu(const struct quirc *q)
+#ifdef QUIRC_BITPLANE
+/* Set the bits for the dark pixels from x to x + len - 1 of a
+ * thresholded row. The bits must have been cleared beforehand.
+ */
+static void bits_pack(uint64_t *dst, const quirc_pixel_t *src,
+		      int x, int len)
 {
-	unsigned int numPixels = q->w * q->h;
+	const int end = x + len;
 
-	// Calculate histogram
-	unsigned int histogram[UINT8_MAX + 1];
-	(void)memset(histogram, 0, sizeof(histogram));
-	uint8_t* ptr = q->image;
-	unsigned int length = numPixels;
-	while (length--) {
-		uint8_t value = *ptr++;
-		histogram[value]++;
+	for (; x < end && (x & 63); x++)
+		if (src[x])
+			dst[x >> 6] |= UINT64_C(1) << (x & 63);
+
+	for (; x + 64 <= end; x += 64) {
+		uint64_t word = 0;
+		int i;
+
+#ifdef QUIRC_HAVE_SSE2
+		for (i = 0; i < 4; i++) {
+			const __m128i v = _mm_loadu_si128(
+				(const __m128i *)(src + x + i * 16));
+			const int mask = _mm_movemask_epi8(
+				_mm_cmpgt_epi8(v, _mm_setzero_si128()));
+
+			word |= (uint64_t)(uint16_t)mask << (i * 16);
+		}
+#else
+		for (i = 0; i < 64; i++)
+			word |= (uint64_t)(src[x + i] != 0) << i;
+#endif
+
+		dst[x >> 6] = word;
 	}
 
-	// Calculate weighted sum of histogram values
-	quirc_float_t sum = (quirc_float_t)0;
-	unsigned int i = 0;
-	for (i = 0; i <= UINT8_MAX; ++i) {
-		sum += i * histogram[i];
+	for (; x < end; x++)
+		if (src[x])
+			dst[x >> 6] |= UINT64_C(1) << (x & 63);
+}
+
+static inline int ctz64(uint64_t v)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(v);
+#else
+	int n = 0;
+
+	while (!(v & 1)) {
+		v >>= 1;
+		n++;
 	}
 
-	// Compute threshold
-	quirc_float_t sumB = (quirc_float_t)0;
-	unsigned int q1 = 0;
-	quirc_float_t max = (quirc_float_t)0;
-	uint8_t threshold = 0;
-	for (i = 0; i <= UINT8_MAX; ++i) {
-		// Weighted background
-		q1 += histogram[i];
-		if (q1 == 0)
-			continue;
+	return n;
+#endif
+}
 
-		// Weighted foreground
-		const unsigned int q2 = numPixels - q1;
-		if (q2 == 0)
-			break;
+/* Find the first bit at or after x which differs from the bits of
+ * flip, so a flip of 0 finds a dark pixel and all ones finds a light
+ * one. Returns the row width in bits if there is none.
+ */
+static inline int bits_next(const uint64_t *row, int words, int x,
+			    uint64_t flip)
+{
+	int i = x >> 6;
+	uint64_t word;
 
-		sumB += i * histogram[i];
-		const quirc_float_t m1 = sumB / q1;
-		const quirc_float_t m2 = (sum - sumB) / q2;
-		const quirc_float_t m1m2 = m1 - m2;
-		const quirc_float_t variance = m1m2 * m1m2 * q1 * q2;
-		if (variance >= max) {
-			threshold = i;
-			max = variance;
-		}
+	if (i >= words)
+		return words * 64;
+
+	word = (row[i] ^ flip) & (~UINT64_C(0) << (x & 63));
+	while (!word) {
+		if (++i >= words)
+			return words * 64;
+		word = row[i] ^ flip;
 	}
 
-	return threshold;
+	return i * 64 + ctz64(word);
 }
+#endif
 
-static void area_count(void *user_data, int y, int left, int right)
+/* Called before a frame is thresholded */
+static inline void pixels_begin(struct quirc *q)
 {
-	((struct quirc_region *)user_data)->count += right - left + 1;
+#ifdef QUIRC_BITPLANE
+	memset(q->bits, 0, sizeof(q->bits[0]) * q->bits_stride * q->h);
+#else
+	if (QUIRC_PIXEL_ALIAS_IMAGE) {
+		q->pixels = (quirc_pixel_t *)q->image;
+	}
+#endif
 }
 
-static int region_code(struct quirc *q, int x, int y)
+/* Where to store the thresholded pixels of row y */
+static inline quirc_pixel_t *pixels_row(const struct quirc *q, int y)
 {
-	int pixel;
-	struct quirc_region *box;
-	int region;
+#ifdef QUIRC_BITPLANE
+	(void)y;
+	return q->pixels;
+#else
+	return q->pixels + y * q->w;
+#endif
+}
 
-	if (x < 0 || y < 0 || x >= q->w || y >= q->h)
-		return -1;
+/* Called when pixels x to x + len - 1 of row y have been thresholded */
+static inline void pixels_done(struct quirc *q, int y, int x, int len)
+{
+#ifdef QUIRC_BITPLANE
+	bits_pack(q->bits + y * q->bits_stride, q->pixels, x, len);
+#else
+	(void)q;
+	(void)y;
+	(void)x;
+	(void)len;
+#endif
+}
 
-	pixel = q->pixels[y * q->w + x];
+/* Test whether a thresholded pixel is dark */
+static inline int pixel_at(const struct quirc *q, int x, int y)
+{
+#ifdef QUIRC_BITPLANE
+	return (q->bits[y * q->bits_stride + (x >> 6)] >> (x & 63)) & 1;
+#else
+	return q->pixels[y * q->w + x] != QUIRC_PIXEL_WHITE;
+#endif
+}
 
-	if (pixel >= QUIRC_PIXEL_REGION)
-		return pixel;
+/************************************************************************
+ * Run-length regions
+ *
+ * With QUIRC_REGIONS_RUNS, each thresholded row is converted to a list
+ * of dark runs, and runs which overlap in adjacent rows are joined into
+ * components. Region records are only made for the components which
+ * the finder pattern search touches, and the pixels are left as they
+ * are.
+ */
 
-	if (pixel == QUIRC_PIXEL_WHITE)
-		return -1;
+/* With QUIRC_BITPLANE, there are no labelled pixels to flood fill */
+#ifdef QUIRC_BITPLANE
+#define USE_RUNS(q)	1
+#else
+#define USE_RUNS(q)	((q)->runs_valid)
+#endif
 
-	if (q->num_regions >= QUIRC_MAX_REGIONS)
-		return -1;
+/* Count work done towards the budget of quirc_step(), and check
+ * whether it has run out.
+ */
+static void budget_spend(struct quirc *q, long work)
+{
+	q->work_done += work;
+}
 
-	region = q->num_regions;
-	box = &q->regions[q->num_regions++];
+static int budget_out(const struct quirc *q)
+{
+	return q->work_budget && q->work_done >= q->work_budget;
+}
 
-	memset(box, 0, sizeof(*box));
+#ifdef QUIRC_BITPLANE
+/* Find the dark runs of the rows from y0 onwards in the bitplane, for as
+ * many whole rows as there is room for. The rows found are the window
+ * from run_y0 to run_y1, and the other rows are left without runs.
+ */
+static void runs_extract(struct quirc *q, int y0)
+{
+	struct quirc_run *runs = q->runs;
+	int n = 0;
+	int y;
 
-	box->seed.x = x;
-	box->seed.y = y;
-	box->capstone = -1;
+	for (y = 0; y < y0; y++)
+		q->row_runs[y] = 0;
 
-	flood_fill_seed(q, x, y, pixel, region, area_count, box);
+	for (; y < q->h; y++) {
+		const uint64_t *row = q->bits + y * q->bits_stride;
+		int x = 0;
 
-	return region;
-}
+		q->row_runs[y] = n;
 
-struct polygon_score_data {
-	struct quirc_point	ref;
+		for (;;) {
+			int start = bits_next(row, q->bits_stride, x, 0);
 
-	int			scores[4];
-	struct quirc_point	*corners;
-};
+			if (start >= q->w)
+				break;
 
-static void find_one_corner(void *user_data, int y, int left, int right)
+			x = bits_next(row, q->bits_stride, start,
+				      ~UINT64_C(0));
+			if (x > q->w)
+				x = q->w;
+
+			if (n >= q->run_capacity)
+				break;
+
+			runs[n].x0 = start;
+			runs[n].x1 = x - 1;
+			runs[n].label = n;
+			n++;
+		}
+
+		if (x < q->w && n >= q->run_capacity) {
+			n = q->row_runs[y];
+			break;
+		}
+	}
+
+	q->run_y0 = y0;
+	q->run_y1 = y;
+	for (; y <= q->h; y++)
+		q->row_runs[y] = n;
+}
+#else
+/* Find the dark runs of each row, skipping a word of pixels at a time
+ * where they are all the same. Returns -1 if there are too many runs.
+ */
+static int runs_extract(struct quirc *q)
 {
-	struct polygon_score_data *psd =
-		(struct polygon_score_data *)user_data;
-	int xs[2] = {left, right};
-	int dy = y - psd->ref.y;
-	int i;
+	const int per_word = sizeof(uint64_t) / sizeof(quirc_pixel_t);
+	const uint64_t black = UINT64_MAX /
+		((UINT64_C(1) << (8 * sizeof(quirc_pixel_t))) - 1) *
+		QUIRC_PIXEL_BLACK;
+	struct quirc_run *runs = q->runs;
+	int n = 0;
+	int y;
 
-	for (i = 0; i < 2; i++) {
-		int dx = xs[i] - psd->ref.x;
-		int d = dx * dx + dy * dy;
+	for (y = 0; y < q->h; y++) {
+		const quirc_pixel_t *row = q->pixels + y * q->w;
+		int x = 0;
 
-		if (d > psd->scores[0]) {
-			psd->scores[0] = d;
-			psd->corners[0].x = xs[i];
-			psd->corners[0].y = y;
+		q->row_runs[y] = n;
+
+		for (;;) {
+			uint64_t word;
+			int start;
+
+			while (x + per_word <= q->w) {
+				memcpy(&word, row + x, sizeof(word));
+				if (word)
+					break;
+				x += per_word;
+			}
+			while (x < q->w && !row[x])
+				x++;
+			if (x >= q->w)
+				break;
+
+			start = x;
+			while (x + per_word <= q->w) {
+				memcpy(&word, row + x, sizeof(word));
+				if (word != black)
+					break;
+				x += per_word;
+			}
+			while (x < q->w && row[x])
+				x++;
+
+			if (n >= q->run_capacity)
+				return -1;
+
+			runs[n].x0 = start;
+			runs[n].x1 = x - 1;
+			runs[n].label = n;
+			n++;
 		}
 	}
+
+	q->row_runs[q->h] = n;
+	return 0;
 }
+#endif
 
-static void find_other_corners(void *user_data, int y, int left, int right)
+static int run_root(struct quirc_run *runs, int i)
 {
-	struct polygon_score_data *psd =
-		(struct polygon_score_data *)user_data;
-	int xs[2] = {left, right};
-	int i;
+	while (runs[i].label != i) {
+		runs[i].label = runs[runs[i].label].label;
+		i = runs[i].label;
+	}
 
-	for (i = 0; i < 2; i++) {
-		int up = xs[i] * psd->ref.x + y * psd->ref.y;
-		int right = xs[i] * -psd->ref.y + y * psd->ref.x;
-		int scores[4] = {up, right, -up, -right};
-		int j;
+	return i;
+}
 
-		for (j = 0; j < 4; j++) {
-			if (scores[j] > psd->scores[j]) {
-				psd->scores[j] = scores[j];
-				psd->corners[j].x = xs[i];
-				psd->corners[j].y = y;
+/* Join runs which share a column with a run on the row above. The
+ * lower index always becomes the root, so every run's label points to
+ * an earlier run until it reaches the first run of its component.
+ */
+static void runs_join(struct quirc *q)
+{
+	struct quirc_run *runs = q->runs;
+	int y;
+
+	for (y = 1; y < q->h; y++) {
+		int a = q->row_runs[y - 1];
+		int a_end = q->row_runs[y];
+		int b = a_end;
+		int b_end = q->row_runs[y + 1];
+
+		while (a < a_end && b < b_end) {
+			if (runs[a].x1 < runs[b].x0) {
+				a++;
+			} else if (runs[b].x1 < runs[a].x0) {
+				b++;
+			} else {
+				int ra = run_root(runs, a);
+				int rb = run_root(runs, b);
+
+				if (ra < rb)
+					runs[rb].label = ra;
+				else if (rb < ra)
+					runs[ra].label = rb;
+
+				if (runs[a].x1 < runs[b].x1)
+					a++;
+				else
+					b++;
 			}
 		}
 	}
 }
 
-static void find_region_corners(struct quirc *q,
-				int rcode, const struct quirc_point *ref,
-				struct quirc_point *corners)
+/* Number the components in order of their first run, and measure them */
+static void runs_label(struct quirc *q)
 {
-	struct quirc_region *region = &q->regions[rcode];
-	struct polygon_score_data psd;
-	int i;
+	struct quirc_run *runs = q->runs;
+	int num_components = 0;
+	int y;
 
-	memset(&psd, 0, sizeof(psd));
-	psd.corners = corners;
+	for (y = 0; y < q->h; y++) {
+		int i;
 
-	memcpy(&psd.ref, ref, sizeof(psd.ref));
-	psd.scores[0] = -1;
-	flood_fill_seed(q, region->seed.x, region->seed.y,
-			rcode, QUIRC_PIXEL_BLACK,
-			find_one_corner, &psd);
+		for (i = q->row_runs[y]; i < q->row_runs[y + 1]; i++) {
+			struct quirc_component *c;
+
+			if (runs[i].label == i) {
+				c = &q->components[num_components];
+				c->area = 0;
+				c->region = -1;
+				c->y0 = y;
+				runs[i].label = num_components++;
+			} else {
+				runs[i].label = runs[runs[i].label].label;
+				c = &q->components[runs[i].label];
+			}
 
-	psd.ref.x = psd.corners[0].x - psd.ref.x;
-	psd.ref.y = psd.corners[0].y - psd.ref.y;
+			c->area += runs[i].x1 - runs[i].x0 + 1;
+			c->y1 = y;
+		}
+	}
+}
 
-	for (i = 0; i < 4; i++)
-		memcpy(&psd.corners[i], &region->seed,
-		       sizeof(psd.corners[i]));
+/* Convert the thresholded image to runs. Returns -1 if it has more
+ * runs than there is room for, in which case regions must be flood
+ * filled.
+ */
+#ifndef QUIRC_BITPLANE
+static int runs_setup(struct quirc *q)
+{
+	if (runs_extract(q) < 0)
+		return -1;
 
-	i = region->seed.x * psd.ref.x + region->seed.y * psd.ref.y;
-	psd.scores[0] = i;
-	psd.scores[2] = -i;
-	i = region->seed.x * -psd.ref.y + region->seed.y * psd.ref.x;
-	psd.scores[1] = i;
-	psd.scores[3] = -i;
+	runs_join(q);
+	runs_label(q);
+	return 0;
+}
+#endif
 
-	flood_fill_seed(q, region->seed.x, region->seed.y,
-			QUIRC_PIXEL_BLACK, rcode,
-			find_other_corners, &psd);
+/* Find the run which covers a pixel, or return -1 if it is white */
+static int run_at(const struct quirc *q, int x, int y)
+{
+	const struct quirc_run *runs = q->runs;
+	int lo = q->row_runs[y];
+	int hi = q->row_runs[y + 1];
+	int end = hi;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (runs[mid].x1 < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < end && runs[lo].x0 <= x)
+		return lo;
+
+	return -1;
 }
 
-static void record_capstone(struct quirc *q, int ring, int stone)
+#ifdef QUIRC_BITPLANE
+/* With QUIRC_BITPLANE, there is no other way to find regions, so if the
+ * runs of the whole image don't fit, they are found for a window of
+ * rows at a time. The window is moved to the rows needed as the finder
+ * scan goes down the image and as regions are looked up, and regions
+ * already recorded are given back their components when it moves.
+ */
+static void runs_window(struct quirc *q, int y0)
 {
-	struct quirc_region *stone_reg = &q->regions[stone];
-	struct quirc_region *ring_reg = &q->regions[ring];
-	struct quirc_capstone *capstone;
-	int cs_index;
+	int i;
 
-	if (q->num_capstones >= QUIRC_MAX_CAPSTONES)
-		return;
+	runs_extract(q, y0);
+	runs_join(q);
+	runs_label(q);
+	q->run_moves++;
 
-	cs_index = q->num_capstones;
-	capstone = &q->capstones[q->num_capstones++];
+	for (i = QUIRC_PIXEL_REGION; i < q->num_regions; i++) {
+		const struct quirc_point *seed = &q->regions[i].seed;
+		int run;
 
-	memset(capstone, 0, sizeof(*capstone));
+		if (seed->y < q->run_y0 || seed->y >= q->run_y1)
+			continue;
 
-	capstone->qr_grid = -1;
-	capstone->ring = ring;
-	capstone->stone = stone;
-	stone_reg->capstone = cs_index;
-	ring_reg->capstone = cs_index;
+		run = run_at(q, seed->x, seed->y);
+		if (run >= 0 && q->components[q->runs[run].label].region < 0)
+			q->components[q->runs[run].label].region = i;
+	}
+}
 
-	/* Find the corners of the ring */
-	find_region_corners(q, ring, &stone_reg->seed, capstone->corners);
+static int runs_setup(struct quirc *q)
+{
+	runs_window(q, 0);
+	if (q->run_y1 < q->h)
+		q->limits_reached |= QUIRC_LIMIT_RUNS;
 
-	/* Set up the perspective transform and find the center */
-	perspective_setup(capstone->c, capstone->corners, 7.0, 7.0);
-	perspective_map(capstone->c, 3.5, 3.5, &capstone->center);
+	return 0;
 }
 
-static void test_capstone(struct quirc *q, unsigned int x, unsigned int y,
-			  unsigned int *pb)
+/* Move the window so that it is centred on row y, or starts at row y if
+ * that doesn't reach it.
+ */
+static void runs_move(struct quirc *q, int y)
 {
-	int ring_right = region_code(q, x - pb[4], y);
-	int stone = region_code(q, x - pb[4] - pb[3] - pb[2], y);
-	int ring_left = region_code(q, x - pb[4] - pb[3] -
+	const int y0 = q->run_y0;
+
+	int start = y - (q->run_y1 - q->run_y0) / 2;
+
+	runs_window(q, start < 0 ? 0 : start);
+	if (y >= q->run_y1)
+		runs_window(q, y);
+
+	budget_spend(q, (long)(q->run_y1 - y0) * q->w);
+}
+
+/* Make sure that row y has its runs */
+static void runs_need(struct quirc *q, int y)
+{
+	if (y < q->run_y0 || y >= q->run_y1)
+		runs_move(q, y);
+}
+
+/* Find the run which covers a pixel, moving the window if its component
+ * is cut off by the window's edges. If the pixel is already in the middle
+ * half of the window, the component is most likely too tall to fit, and
+ * is left as it is.
+ */
+static int run_whole(struct quirc *q, int x, int y)
+{
+	const struct quirc_component *c;
+	int quarter;
+	int run;
+
+	runs_need(q, y);
+	run = run_at(q, x, y);
+	if (run < 0)
+		return -1;
+
+	c = &q->components[q->runs[run].label];
+	if ((c->y0 > q->run_y0 || !q->run_y0) &&
+	    (c->y1 < q->run_y1 - 1 || q->run_y1 == q->h))
+		return run;
+
+	quarter = (q->run_y1 - q->run_y0) / 4;
+	if ((y - q->run_y0 >= quarter || !q->run_y0) &&
+	    (q->run_y1 - y > quarter || q->run_y1 == q->h))
+		return run;
+
+	runs_move(q, y);
+	return run_at(q, x, y);
+}
+/* The threaded scan reads the runs from several threads, so it can only
+ * be used when the window covers the whole image and won't move.
+ */
+#define runs_complete(q)	(!(q)->run_y0 && (q)->run_y1 == (q)->h)
+#else
+#define runs_need(q, y)		((void)0)
+#define run_whole(q, x, y)	run_at(q, x, y)
+#define runs_complete(q)	1
+#endif
+
+/* Call func for each run of a region, in the same way as a flood fill */
+static void region_runs(struct quirc *q, int rcode,
+			span_func_t func, void *user_data)
+{
+	const struct quirc_region *region = &q->regions[rcode];
+	const struct quirc_run *runs = q->runs;
+	const struct quirc_component *c;
+	int run = run_whole(q, region->seed.x, region->seed.y);
+	int label;
+	int y;
+
+	if (run < 0)
+		return;
+
+	label = runs[run].label;
+	c = &q->components[label];
+
+	for (y = c->y0; y <= c->y1; y++) {
+		int i;
+
+		for (i = q->row_runs[y]; i < q->row_runs[y + 1]; i++)
+			if (runs[i].label == label)
+				func(user_data, y, runs[i].x0, runs[i].x1);
+	}
+}
+
+/************************************************************************
+ * Adaptive thresholding
+ */
+
+/* Consecutive pixels are counted in separate histogram banks, so that
+ * runs of equal values (typical of flat backgrounds) don't serialize on
+ * a store-to-load dependency through a single counter.
+ */
+#define HISTOGRAM_BANKS		4
+
+typedef unsigned int histogram_banks_t[HISTOGRAM_BANKS][UINT8_MAX + 1];
+
+static void histogram_add(histogram_banks_t banks,
+			  const uint8_t *src, int len)
+{
+	while (len >= 8) {
+		uint64_t word;
+
+		memcpy(&word, src, sizeof(word));
+		banks[0][word & 0xff]++;
+		banks[1][(word >> 8) & 0xff]++;
+		banks[2][(word >> 16) & 0xff]++;
+		banks[3][(word >> 24) & 0xff]++;
+		banks[0][(word >> 32) & 0xff]++;
+		banks[1][(word >> 40) & 0xff]++;
+		banks[2][(word >> 48) & 0xff]++;
+		banks[3][word >> 56]++;
+
+		src += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		banks[0][*src++]++;
+}
+
+static void histogram_merge(unsigned int *histogram,
+			    histogram_banks_t banks)
+{
+	int i;
+
+	for (i = 0; i <= UINT8_MAX; i++)
+		histogram[i] = banks[0][i] + banks[1][i] +
+			banks[2][i] + banks[3][i];
+}
+
+/* Choose a threshold by Otsu's method. If separation is not NULL, the
+ * difference between the mean values of the two classes is stored in it,
+ * which tells how much contrast there is to separate.
+ */
+static uint8_t otsu_threshold(const unsigned int *histogram,
+			      unsigned int numPixels,
+			      quirc_float_t *separation)
+{
+	// Calculate weighted sum of histogram values
+	quirc_float_t sum = (quirc_float_t)0;
+	unsigned int i = 0;
+	for (i = 0; i <= UINT8_MAX; ++i) {
+		sum += i * histogram[i];
+	}
+
+	// Compute threshold
+	quirc_float_t sumB = (quirc_float_t)0;
+	unsigned int q1 = 0;
+	quirc_float_t max = (quirc_float_t)0;
+	quirc_float_t best_m1m2 = (quirc_float_t)0;
+	uint8_t threshold = 0;
+	for (i = 0; i <= UINT8_MAX; ++i) {
+		// Weighted background
+		q1 += histogram[i];
+		if (q1 == 0)
+			continue;
+
+		// Weighted foreground
+		const unsigned int q2 = numPixels - q1;
+		if (q2 == 0)
+			break;
+
+		sumB += i * histogram[i];
+		const quirc_float_t m1 = sumB / q1;
+		const quirc_float_t m2 = (sum - sumB) / q2;
+		const quirc_float_t m1m2 = m1 - m2;
+		const quirc_float_t variance = m1m2 * m1m2 * q1 * q2;
+		if (variance >= max) {
+			threshold = i;
+			max = variance;
+			best_m1m2 = m1m2;
+		}
+	}
+
+	if (separation)
+		*separation = fabs(best_m1m2);
+
+	return threshold;
+}
+
+/* Return a row of the input image, which is either the internal buffer
+ * or the one given to quirc_set_image().
+ */
+static inline const uint8_t *image_row(const struct quirc *q, int y)
+{
+	if (q->source)
+		return q->source + (size_t)y * q->source_stride;
+
+	return q->image + (size_t)y * q->w;
+}
+
+static uint8_t otsu(const struct quirc *q)
+{
+	unsigned int numPixels = q->w * q->h;
+	unsigned int histogram[UINT8_MAX + 1];
+	histogram_banks_t banks;
+	int y;
+
+	(void)memset(banks, 0, sizeof(banks));
+	for (y = 0; y < q->h; y++)
+		histogram_add(banks, image_row(q, y), q->w);
+	histogram_merge(histogram, banks);
+
+	return otsu_threshold(histogram, numPixels, NULL);
+}
+
+static void area_count(void *user_data, int y, int left, int right)
+{
+	((struct quirc_region *)user_data)->count += right - left + 1;
+}
+
+/* Area and extreme points of a region, gathered from its spans. The
+ * corner searches below can often be answered from the extremes,
+ * without visiting the region again.
+ *
+ * The extremes are kept here while the region is visited, laid out so
+ * that each span can be tested in all directions at once.
+ */
+struct region_stats {
+	struct quirc_region	*region;
+	int			scores[QUIRC_REGION_EXTREMES];
+	int			x[QUIRC_REGION_EXTREMES];
+	int			y[QUIRC_REGION_EXTREMES];
+};
+
+static const int extreme_dx[QUIRC_REGION_EXTREMES] = {
+	1, 2, 1, 1, 0, -1, -1, -2, -1, -2, -1, -1, 0, 1, 1, 2
+};
+static const int extreme_dy[QUIRC_REGION_EXTREMES] = {
+	0, 1, 1, 2, 1, 2, 1, 1, 0, -1, -1, -2, -1, -2, -1, -1
+};
+
+static void region_stats_begin(struct region_stats *rs,
+			       struct quirc_region *region)
+{
+	int i;
+
+	rs->region = region;
+	region->count = 0;
+	for (i = 0; i < QUIRC_REGION_EXTREMES; i++) {
+		rs->scores[i] = extreme_dx[i] * region->seed.x +
+			extreme_dy[i] * region->seed.y;
+		rs->x[i] = region->seed.x;
+		rs->y[i] = region->seed.y;
+	}
+}
+
+static void region_stats_add(void *user_data, int y, int left, int right)
+{
+	struct region_stats *rs = (struct region_stats *)user_data;
+	const int xs[5] = {-2 * left, -left, 0, right, 2 * right};
+	const int ys[5] = {-2 * y, -y, 0, y, 2 * y};
+	int i;
+
+	rs->region->count += right - left + 1;
+
+	/* Only one end of the span can be extreme in each direction */
+	for (i = 0; i < QUIRC_REGION_EXTREMES; i++) {
+		const int score = xs[extreme_dx[i] + 2] + ys[extreme_dy[i] + 2];
+
+		if (score > rs->scores[i]) {
+			rs->scores[i] = score;
+			rs->x[i] = (extreme_dx[i] > 0) ? right : left;
+			rs->y[i] = y;
+		}
+	}
+}
+
+static void region_stats_end(const struct region_stats *rs)
+{
+	struct quirc_region *region = rs->region;
+	int i;
+
+	for (i = 0; i < QUIRC_REGION_EXTREMES; i++) {
+		region->extremes[i].x = rs->x[i];
+		region->extremes[i].y = rs->y[i];
+	}
+	region->has_extremes = 1;
+}
+
+/* Visit every span of a region. Flood filled regions are filled twice,
+ * so that they are left labelled as they were.
+ */
+static void region_visit(struct quirc *q, int rcode,
+			 span_func_t func, void *user_data)
+{
+	const struct quirc_region *region = &q->regions[rcode];
+
+	if (USE_RUNS(q)) {
+		region_runs(q, rcode, func, user_data);
+		return;
+	}
+
+	flood_fill_seed(q, region->seed.x, region->seed.y,
+			rcode, QUIRC_PIXEL_BLACK, NULL, NULL);
+	flood_fill_seed(q, region->seed.x, region->seed.y,
+			QUIRC_PIXEL_BLACK, rcode, func, user_data);
+}
+
+/* The corner searches look for the point of a region furthest from a
+ * reference point, or furthest along a direction. A region lies within
+ * the polygon bounded by the lines through its extremes, and each pair
+ * of neighbouring directions has a cross product of 1, so the corners
+ * of that polygon are whole pixels.
+ *
+ * The functions below answer a search from the extremes when they show
+ * the answer to be the same point that visiting every span would find.
+ * Otherwise they return -1, and the region must be visited.
+ */
+static struct quirc_point extremes_crossing(const struct quirc_region *region,
+					    int i)
+{
+	const int j = (i + 1) % QUIRC_REGION_EXTREMES;
+	const int si = extreme_dx[i] * region->extremes[i].x +
+		extreme_dy[i] * region->extremes[i].y;
+	const int sj = extreme_dx[j] * region->extremes[j].x +
+		extreme_dy[j] * region->extremes[j].y;
+	struct quirc_point p;
+
+	p.x = si * extreme_dy[j] - sj * extreme_dy[i];
+	p.y = sj * extreme_dx[i] - si * extreme_dx[j];
+	return p;
+}
+
+static int same_point(const struct quirc_point *a, const struct quirc_point *b)
+{
+	return a->x == b->x && a->y == b->y;
+}
+
+/* The furthest point from ref is known if one extreme is further than
+ * any other point of the polygon, since the region's points at that
+ * distance can then only be that extreme.
+ */
+static int region_furthest_from(const struct quirc_region *region,
+				const struct quirc_point *ref,
+				struct quirc_point *p)
+{
+	int best = -1;
+	int tied = 0;
+	int i;
+
+	if (!region->has_extremes)
+		return -1;
+
+	for (i = 0; i < QUIRC_REGION_EXTREMES; i++) {
+		const struct quirc_point *e = &region->extremes[i];
+		const int dx = e->x - ref->x;
+		const int dy = e->y - ref->y;
+		const int d = dx * dx + dy * dy;
+
+		if (d > best) {
+			best = d;
+			tied = 0;
+			*p = *e;
+		} else if (d == best && !same_point(e, p)) {
+			tied = 1;
+		}
+	}
+
+	if (tied)
+		return -1;
+
+	for (i = 0; i < QUIRC_REGION_EXTREMES; i++) {
+		const int j = (i + 1) % QUIRC_REGION_EXTREMES;
+		struct quirc_point v;
+		int dx, dy;
+
+		if (same_point(&region->extremes[i], &region->extremes[j]))
+			continue;
+
+		v = extremes_crossing(region, i);
+		dx = v.x - ref->x;
+		dy = v.y - ref->y;
+		if (dx * dx + dy * dy >= best)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* The furthest point along (dx, dy) is known if it is the direction of
+ * an extreme, which was found in the same order as a visit would, or
+ * if the extremes of the directions either side of it are one point.
+ */
+static int region_furthest_along(const struct quirc_region *region,
+				 int dx, int dy, struct quirc_point *p)
+{
+	int i;
+
+	if (!region->has_extremes)
+		return -1;
+
+	for (i = 0; i < QUIRC_REGION_EXTREMES; i++) {
+		const int j = (i + 1) % QUIRC_REGION_EXTREMES;
+		const int before = extreme_dx[i] * dy - extreme_dy[i] * dx;
+		const int after = dx * extreme_dy[j] - dy * extreme_dx[j];
+
+		if (before < 0 || after <= 0)
+			continue;
+
+		if (before &&
+		    !same_point(&region->extremes[i], &region->extremes[j]))
+			return -1;
+
+		*p = region->extremes[i];
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Return the region of a component from the run-length labelling,
+ * recording it if this is the first time it has been seen.
+ */
+static int region_code_runs(struct quirc *q, int x, int y)
+{
+	struct quirc_component *c;
+	struct quirc_region *box;
+	int run;
+
+	runs_need(q, y);
+	run = run_at(q, x, y);
+	if (run < 0)
+		return -1;
+
+	c = &q->components[q->runs[run].label];
+	if (c->region >= 0)
+		return c->region;
+
+#ifdef QUIRC_BITPLANE
+	/* A component cut off by the window may be a region seen before */
+	run = run_whole(q, x, y);
+	c = &q->components[q->runs[run].label];
+	if (c->region >= 0)
+		return c->region;
+#endif
+
+	if (q->num_regions >= q->max_regions) {
+		q->limits_reached |= QUIRC_LIMIT_REGIONS;
+		QUIRC_STATS_ADD(q, region_exhaustions, 1);
+		return -1;
+	}
+
+	QUIRC_STATS_ADD(q, regions, 1);
+	c->region = q->num_regions;
+	box = &q->regions[q->num_regions++];
+
+	box->seed.x = x;
+	box->seed.y = y;
+	box->count = c->area;
+	box->capstone = -1;
+	box->has_extremes = 0;
+
+	return c->region;
+}
+
+/* Return the region containing a pixel, labelling it if this is the
+ * first time it has been seen. If the region is likely to be asked for
+ * its extremes, they can be found at the same time.
+ */
+static int region_code(struct quirc *q, int x, int y, int extremes)
+{
+	int pixel;
+	struct quirc_region *box;
+	int region;
+
+	if (x < 0 || y < 0 || x >= q->w || y >= q->h)
+		return -1;
+
+	if (USE_RUNS(q))
+		return region_code_runs(q, x, y);
+
+	pixel = q->pixels[y * q->w + x];
+
+	if (pixel >= QUIRC_PIXEL_REGION)
+		return pixel;
+
+	if (pixel == QUIRC_PIXEL_WHITE)
+		return -1;
+
+	if (q->num_regions >= q->max_regions) {
+		q->limits_reached |= QUIRC_LIMIT_REGIONS;
+		QUIRC_STATS_ADD(q, region_exhaustions, 1);
+		return -1;
+	}
+
+	if (q->num_regions >= QUIRC_MAX_LABELS) {
+		q->limits_reached |= QUIRC_LIMIT_LABELS;
+		QUIRC_STATS_ADD(q, region_exhaustions, 1);
+		return -1;
+	}
+
+	QUIRC_STATS_ADD(q, regions, 1);
+	region = q->num_regions;
+	box = &q->regions[q->num_regions++];
+
+	box->seed.x = x;
+	box->seed.y = y;
+	box->capstone = -1;
+
+	if (extremes) {
+		struct region_stats rs;
+
+		region_stats_begin(&rs, box);
+		flood_fill_seed(q, x, y, pixel, region, region_stats_add, &rs);
+		region_stats_end(&rs);
+	} else {
+		box->count = 0;
+		box->has_extremes = 0;
+		flood_fill_seed(q, x, y, pixel, region, area_count, box);
+	}
+
+	budget_spend(q, box->count);
+	return region;
+}
+
+struct polygon_score_data {
+	struct quirc_point	ref;
+
+	int			scores[4];
+	struct quirc_point	*corners;
+};
+
+static void find_one_corner(void *user_data, int y, int left, int right)
+{
+	struct polygon_score_data *psd =
+		(struct polygon_score_data *)user_data;
+	int xs[2] = {left, right};
+	int dy = y - psd->ref.y;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		int dx = xs[i] - psd->ref.x;
+		int d = dx * dx + dy * dy;
+
+		if (d > psd->scores[0]) {
+			psd->scores[0] = d;
+			psd->corners[0].x = xs[i];
+			psd->corners[0].y = y;
+		}
+	}
+}
+
+static void find_other_corners(void *user_data, int y, int left, int right)
+{
+	struct polygon_score_data *psd =
+		(struct polygon_score_data *)user_data;
+	int xs[2] = {left, right};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		int up = xs[i] * psd->ref.x + y * psd->ref.y;
+		int right = xs[i] * -psd->ref.y + y * psd->ref.x;
+		int scores[4] = {up, right, -up, -right};
+		int j;
+
+		for (j = 0; j < 4; j++) {
+			if (scores[j] > psd->scores[j]) {
+				psd->scores[j] = scores[j];
+				psd->corners[j].x = xs[i];
+				psd->corners[j].y = y;
+			}
+		}
+	}
+}
+
+static void find_region_corners(struct quirc *q,
+				int rcode, const struct quirc_point *ref,
+				struct quirc_point *corners)
+{
+	struct quirc_region *region = &q->regions[rcode];
+	struct polygon_score_data psd;
+	int filled = 0;
+	int i;
+
+	memset(&psd, 0, sizeof(psd));
+	psd.corners = corners;
+
+	memcpy(&psd.ref, ref, sizeof(psd.ref));
+	psd.scores[0] = -1;
+	if (region_furthest_from(region, ref, &corners[0]) < 0) {
+		if (USE_RUNS(q)) {
+			region_runs(q, rcode, find_one_corner, &psd);
+		} else {
+			flood_fill_seed(q, region->seed.x, region->seed.y,
+					rcode, QUIRC_PIXEL_BLACK,
+					find_one_corner, &psd);
+			filled = 1;
+		}
+	}
+
+	psd.ref.x = psd.corners[0].x - psd.ref.x;
+	psd.ref.y = psd.corners[0].y - psd.ref.y;
+
+	if (!region_furthest_along(region, psd.ref.x, psd.ref.y,
+				   &corners[0]) &&
+	    !region_furthest_along(region, -psd.ref.y, psd.ref.x,
+				   &corners[1]) &&
+	    !region_furthest_along(region, -psd.ref.x, -psd.ref.y,
+				   &corners[2]) &&
+	    !region_furthest_along(region, psd.ref.y, -psd.ref.x,
+				   &corners[3])) {
+		if (filled)
+			flood_fill_seed(q, region->seed.x, region->seed.y,
+					QUIRC_PIXEL_BLACK, rcode, NULL, NULL);
+		return;
+	}
+
+	for (i = 0; i < 4; i++)
+		memcpy(&psd.corners[i], &region->seed,
+		       sizeof(psd.corners[i]));
+
+	i = region->seed.x * psd.ref.x + region->seed.y * psd.ref.y;
+	psd.scores[0] = i;
+	psd.scores[2] = -i;
+	i = region->seed.x * -psd.ref.y + region->seed.y * psd.ref.x;
+	psd.scores[1] = i;
+	psd.scores[3] = -i;
+
+	if (filled)
+		flood_fill_seed(q, region->seed.x, region->seed.y,
+				QUIRC_PIXEL_BLACK, rcode,
+				find_other_corners, &psd);
+	else
+		region_visit(q, rcode, find_other_corners, &psd);
+}
+
+static void record_capstone(struct quirc *q, int ring, int stone)
+{
+	struct quirc_region *stone_reg = &q->regions[stone];
+	struct quirc_region *ring_reg = &q->regions[ring];
+	struct quirc_capstone *capstone;
+	int cs_index;
+
+	if (q->num_capstones >= q->max_capstones) {
+		q->limits_reached |= QUIRC_LIMIT_CAPSTONES;
+		return;
+	}
+
+	QUIRC_STATS_ADD(q, capstones, 1);
+	cs_index = q->num_capstones;
+	capstone = &q->capstones[q->num_capstones++];
+
+	memset(capstone, 0, sizeof(*capstone));
+
+	capstone->qr_grid = -1;
+	capstone->ring = ring;
+	capstone->stone = stone;
+	stone_reg->capstone = cs_index;
+	ring_reg->capstone = cs_index;
+
+	/* Find the corners of the ring */
+	find_region_corners(q, ring, &stone_reg->seed, capstone->corners);
+
+	/* Set up the perspective transform and find the center */
+	perspective_setup(capstone->c, capstone->corners, 7.0, 7.0);
+	perspective_map(capstone->c, 3.5, 3.5, &capstone->center);
+}
+
+static void test_capstone(struct quirc *q, unsigned int x, unsigned int y,
+			  unsigned int *pb)
+{
+	int ring_right = region_code(q, x - pb[4], y, 1);
+	int stone = region_code(q, x - pb[4] - pb[3] - pb[2], y, 0);
+	int ring_left = region_code(q, x - pb[4] - pb[3] -
 				    pb[2] - pb[1] - pb[0],
-				    y);
+				    y, 0);
 	struct quirc_region *stone_reg;
 	struct quirc_region *ring_reg;
 	unsigned int ratio;
 
-	if (ring_left < 0 || ring_right < 0 || stone < 0)
-		return;
+	if (ring_left < 0 || ring_right < 0 || stone < 0)
+		return;
+
+	/* Left and ring of ring should be connected */
+	if (ring_left != ring_right)
+		return;
+
+	/* Ring should be disconnected from stone */
+	if (ring_left == stone)
+		return;
+
+	stone_reg = &q->regions[stone];
+	ring_reg = &q->regions[ring_left];
+
+	/* Already detected */
+	if (stone_reg->capstone >= 0 || ring_reg->capstone >= 0)
+		return;
+
+	/* Ratio should ideally be 37.5 */
+	ratio = stone_reg->count * 100 / ring_reg->count;
+	if (ratio < 10 || ratio > 70)
+		return;
+
+	record_capstone(q, ring_left, stone);
+}
+
+/* Called for each 1:1:3:1:1 run found by finder_scan_row(). A non-zero
+ * return stops the scan of the row.
+ */
+typedef int (*finder_func_t)(void *user_data, unsigned int x,
+			     unsigned int y, unsigned int *pb);
+
+/* Test the lengths of the last five runs for a 1:1:3:1:1 ratio */
+static inline int finder_ratio_ok(const unsigned int *pb)
+{
+	const int scale = 16;
+	static const unsigned int check[5] = {1, 1, 3, 1, 1};
+	unsigned int avg, err;
+	unsigned int i;
+
+	avg = (pb[0] + pb[1] + pb[3] + pb[4]) * scale / 4;
+	err = avg * 3 / 4;
+
+	for (i = 0; i < 5; i++)
+		if (pb[i] * scale < check[i] * avg - err ||
+		    pb[i] * scale > check[i] * avg + err)
+			return 0;
+
+	return 1;
+}
+
+/* The same as finder_scan_row(), but taking the colour changes from the
+ * row's dark runs.
+ */
+static int finder_scan_runs(const struct quirc *q, unsigned int y,
+			    unsigned int x0, unsigned int x1,
+			    finder_func_t func, void *user_data)
+{
+	const struct quirc_run *run = q->runs + q->row_runs[y];
+	const struct quirc_run *end = q->runs + q->row_runs[y + 1];
+#ifdef QUIRC_BITPLANE
+	int moves = q->run_moves;
+#endif
+	unsigned int last = x0;
+	unsigned int run_count = 0;
+	unsigned int pb[5];
+
+	memset(pb, 0, sizeof(pb));
+	while (run < end && (unsigned int)run->x1 < x0)
+		run++;
+
+	for (; run < end && (unsigned int)run->x0 < x1; run++) {
+		unsigned int start = run->x0;
+		unsigned int stop = run->x1 + 1;
+
+		if (start > x0) {
+			memmove(pb, pb + 1, sizeof(pb[0]) * 4);
+			pb[4] = start - last;
+			last = start;
+			run_count++;
+		}
+
+		if (stop >= x1)
+			break;
+
+		memmove(pb, pb + 1, sizeof(pb[0]) * 4);
+		pb[4] = stop - last;
+		last = stop;
+		run_count++;
+
+		if (run_count >= 5 && finder_ratio_ok(pb) &&
+		    func(user_data, stop, y, pb))
+			return -1;
+
+#ifdef QUIRC_BITPLANE
+		/* If func moved the run window, it has put this row back in
+		 * it, with the same runs at a different place.
+		 */
+		if (q->run_moves != moves) {
+			const struct quirc_run *row =
+				q->runs + q->row_runs[y];
+
+			moves = q->run_moves;
+			end = q->runs + q->row_runs[y + 1];
+			for (run = row; run + 1 < end &&
+			     (unsigned int)run->x1 + 1 < stop; run++)
+				;
+		}
+#endif
+	}
+
+	return 0;
+}
+
+/* The row is only tested for zero and non-zero pixels. Flood fills
+ * change black pixels to region codes, which are also non-zero, so a row
+ * gives the same runs whether or not it was scanned before other rows
+ * were labelled.
+ */
+static inline int finder_scan_row(const struct quirc *q, unsigned int y,
+				  unsigned int x0, unsigned int x1,
+				  finder_func_t func, void *user_data)
+{
+	const quirc_pixel_t *row;
+	unsigned int x;
+	int last_color = 0;
+	unsigned int run_length = 0;
+	unsigned int run_count = 0;
+	unsigned int pb[5];
+
+	if (USE_RUNS(q))
+		return finder_scan_runs(q, y, x0, x1, func, user_data);
+
+	row = q->pixels + y * q->w;
+	memset(pb, 0, sizeof(pb));
+	for (x = x0; x < x1; x++) {
+		int color = row[x] ? 1 : 0;
+
+		if (x > x0 && color != last_color) {
+			memmove(pb, pb + 1, sizeof(pb[0]) * 4);
+			pb[4] = run_length;
+			run_length = 0;
+			run_count++;
+
+			if (!color && run_count >= 5 && finder_ratio_ok(pb) &&
+			    func(user_data, x, y, pb))
+				return -1;
+		}
+
+		run_length++;
+		last_color = color;
+	}
+
+	return 0;
+}
+
+static int finder_test(void *user_data, unsigned int x, unsigned int y,
+		       unsigned int *pb)
+{
+	struct quirc *q = (struct quirc *)user_data;
+
+	test_capstone(q, x, y, pb);
+	runs_need(q, y);
+	return 0;
+}
+
+static void finder_scan(struct quirc *q, unsigned int y)
+{
+	runs_need(q, y);
+	finder_scan_row(q, y, 0, q->w, finder_test, q);
+	budget_spend(q, q->w);
+}
+
+static void find_alignment_pattern(struct quirc *q, int index)
+{
+	struct quirc_grid *qr = &q->grids[index];
+	struct quirc_capstone *c0 = &q->capstones[qr->caps[0]];
+	struct quirc_capstone *c2 = &q->capstones[qr->caps[2]];
+	struct quirc_point a;
+	struct quirc_point b;
+	struct quirc_point c;
+	int size_estimate;
+	int step_size = 1;
+	int dir = 0;
+	quirc_float_t u, v;
+
+	/* Grab our previous estimate of the alignment pattern corner */
+	memcpy(&b, &qr->align, sizeof(b));
+
+	/* Guess another two corners of the alignment pattern so that we
+	 * can estimate its size.
+	 */
+	perspective_unmap(c0->c, &b, &u, &v);
+	perspective_map(c0->c, u, v + (quirc_float_t)1.0, &a);
+	perspective_unmap(c2->c, &b, &u, &v);
+	perspective_map(c2->c, u + (quirc_float_t)1.0, v, &c);
+
+	size_estimate = abs((a.x - b.x) * -(c.y - b.y) +
+			    (a.y - b.y) * (c.x - b.x));
+
+	/* Spiral outwards from the estimate point until we find something
+	 * roughly the right size. Don't look too far from the estimate
+	 * point.
+	 */
+	while (step_size * step_size < size_estimate * 100) {
+		static const int dx_map[] = {1, 0, -1, 0};
+		static const int dy_map[] = {0, -1, 0, 1};
+		int i;
+
+		for (i = 0; i < step_size; i++) {
+			int code = region_code(q, b.x, b.y, 1);
+
+			if (code >= 0) {
+				struct quirc_region *reg = &q->regions[code];
+
+				if (reg->count >= size_estimate / 2 &&
+				    reg->count <= size_estimate * 2) {
+					qr->align_region = code;
+					return;
+				}
+			}
+
+			b.x += dx_map[dir];
+			b.y += dy_map[dir];
+		}
+
+		dir = (dir + 1) % 4;
+		if (!(dir & 1))
+			step_size++;
+	}
+}
+
+static void find_leftmost_to_line(void *user_data, int y, int left, int right)
+{
+	struct polygon_score_data *psd =
+		(struct polygon_score_data *)user_data;
+	int xs[2] = {left, right};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		int d = -psd->ref.y * xs[i] + psd->ref.x * y;
+
+		if (d < psd->scores[0]) {
+			psd->scores[0] = d;
+			psd->corners[0].x = xs[i];
+			psd->corners[0].y = y;
+		}
+	}
+}
+
+static quirc_float_t length(struct quirc_point a, struct quirc_point b)
+{
+	quirc_float_t x = abs(a.x - b.x) + 1;
+	quirc_float_t y = abs(a.y - b.y) + 1;
+	return sqrt(x * x +  y * y);
+}
+/* Estimate grid size by determing distance between capstones
+ */
+static void measure_grid_size(struct quirc *q, int index)
+{
+	struct quirc_grid *qr = &q->grids[index];
+
+	struct quirc_capstone *a = &(q->capstones[qr->caps[0]]);
+	struct quirc_capstone *b = &(q->capstones[qr->caps[1]]);
+	struct quirc_capstone *c = &(q->capstones[qr->caps[2]]);
+
+	quirc_float_t ab = length(b->corners[0], a->corners[3]);
+	quirc_float_t capstone_ab_size = (length(b->corners[0], b->corners[3]) + length(a->corners[0], a->corners[3]))/2.0;
+	quirc_float_t ver_grid = (quirc_float_t)7.0 * ab / capstone_ab_size;
+
+	quirc_float_t bc = length(b->corners[0], c->corners[1]);
+	quirc_float_t capstone_bc_size = (length(b->corners[0], b->corners[1]) + length(c->corners[0], c->corners[1]))/2.0;
+	quirc_float_t hor_grid = (quirc_float_t)7.0 * bc / capstone_bc_size;
+
+	quirc_float_t grid_size_estimate = (ver_grid + hor_grid) * (quirc_float_t)(0.5);
+
+	int ver = (int)((grid_size_estimate - (quirc_float_t)(17.0 - 2.0)) * (quirc_float_t)(1./4));
+
+	qr->grid_size =  4*ver + 17;
+}
+
+/* The cells checked by fitness_all(), each with the colour expected
+ * there: 1 for black, -1 for white. The list depends only on the grid
+ * size, so it's built once for all of the transforms tried for a grid.
+ */
+#define FITNESS_MAX_CELLS \
+	(2 * (QUIRC_MAX_GRID_SIZE - 14) + 3 * 49 + \
+	 (QUIRC_MAX_ALIGNMENT * QUIRC_MAX_ALIGNMENT - 3) * 25)
+
+struct fitness_sample {
+	uint8_t			x;
+	uint8_t			y;
+	int8_t			expect;
+};
+
+struct fitness_list {
+	int			count;
+	struct fitness_sample	cells[FITNESS_MAX_CELLS];
+};
+
+static void fitness_add(struct fitness_list *list, int x, int y, int expect)
+{
+	struct fitness_sample *s = &list->cells[list->count++];
+
+	s->x = x;
+	s->y = y;
+	s->expect = expect;
+}
+
+static void fitness_add_ring(struct fitness_list *list, int cx, int cy,
+			     int radius, int expect)
+{
+	int i;
+
+	for (i = 0; i < radius * 2; i++) {
+		fitness_add(list, cx - radius + i, cy - radius, expect);
+		fitness_add(list, cx - radius, cy + radius - i, expect);
+		fitness_add(list, cx + radius, cy - radius + i, expect);
+		fitness_add(list, cx + radius - i, cy + radius, expect);
+	}
+}
+
+static void fitness_add_apat(struct fitness_list *list, int cx, int cy)
+{
+	fitness_add(list, cx, cy, 1);
+	fitness_add_ring(list, cx, cy, 1, -1);
+	fitness_add_ring(list, cx, cy, 2, 1);
+}
+
+static void fitness_add_capstone(struct fitness_list *list, int x, int y)
+{
+	x += 3;
+	y += 3;
+
+	fitness_add(list, x, y, 1);
+	fitness_add_ring(list, x, y, 1, 1);
+	fitness_add_ring(list, x, y, 2, -1);
+	fitness_add_ring(list, x, y, 3, 1);
+}
+
+/* List the features we expect to find by scanning the grid. The grid
+ * must have a valid version.
+ */
+static void fitness_setup(const struct quirc_grid *qr,
+			  struct fitness_list *list)
+{
+	int version = (qr->grid_size - 17) / 4;
+	const struct quirc_version_info *info = &quirc_version_db[version];
+	int i, j;
+	int ap_count;
+
+	list->count = 0;
+
+	/* Check the timing pattern */
+	for (i = 0; i < qr->grid_size - 14; i++) {
+		int expect = (i & 1) ? 1 : -1;
+
+		fitness_add(list, i + 7, 6, expect);
+		fitness_add(list, 6, i + 7, expect);
+	}
+
+	/* Check capstones */
+	fitness_add_capstone(list, 0, 0);
+	fitness_add_capstone(list, qr->grid_size - 7, 0);
+	fitness_add_capstone(list, 0, qr->grid_size - 7);
+
+	/* Check alignment patterns */
+	ap_count = 0;
+	while ((ap_count < QUIRC_MAX_ALIGNMENT) && info->apat[ap_count])
+		ap_count++;
+
+	for (i = 1; i + 1 < ap_count; i++) {
+		fitness_add_apat(list, 6, info->apat[i]);
+		fitness_add_apat(list, info->apat[i], 6);
+	}
+
+	for (i = 1; i < ap_count; i++)
+		for (j = 1; j < ap_count; j++)
+			fitness_add_apat(list, info->apat[i], info->apat[j]);
+}
+
+/* Compute a fitness score for the currently configured perspective
+ * transform. Each cell is sampled at 9 points, for a score between -9
+ * and 9, so the score can be abandoned as soon as the cells left can't
+ * lift it above best. The value returned is then no greater than best.
+ */
+#define FITNESS_CHUNK		16
+
+static int fitness_all(const struct quirc *q, const struct quirc_grid *qr,
+		       const struct fitness_list *list, int best)
+{
+	static const quirc_float_t offsets[] = {0.3, 0.5, 0.7};
+	const map_points_func_t map_points = map_points_kernel();
+	quirc_float_t u[FITNESS_CHUNK * 9];
+	quirc_float_t v[FITNESS_CHUNK * 9];
+	int px[FITNESS_CHUNK * 9];
+	int py[FITNESS_CHUNK * 9];
+	int remaining = list->count * 9;
+	int score = 0;
+	int i;
+
+	for (i = 0; i < list->count; i += FITNESS_CHUNK) {
+		const struct fitness_sample *cells = &list->cells[i];
+		int n = list->count - i;
+		int j, k;
+
+		if (n > FITNESS_CHUNK)
+			n = FITNESS_CHUNK;
+
+		for (j = 0; j < n; j++)
+			for (k = 0; k < 9; k++) {
+				u[j * 9 + k] = cells[j].x + offsets[k % 3];
+				v[j * 9 + k] = cells[j].y + offsets[k / 3];
+			}
+
+		map_points(qr->c, u, v, 0, n * 9, px, py);
+
+		for (k = 0; k < n * 9; k++) {
+			int expect = cells[k / 9].expect;
+
+			if (py[k] < 0 || py[k] >= q->h ||
+			    px[k] < 0 || px[k] >= q->w)
+				continue;
+
+			if (pixel_at(q, px[k], py[k]))
+				score += expect;
+			else
+				score -= expect;
+		}
+
+		remaining -= n * 9;
+		if (score + remaining <= best)
+			return score + remaining;
+	}
+
+	return score;
+}
+
+/* Least-squares fit of a perspective transform to a set of points in
+ * grid coordinates (u, v) and their positions in the image (x, y).
+ */
+#define FIT_MAX_POINTS	(12 + QUIRC_MAX_ALIGNMENT * QUIRC_MAX_ALIGNMENT)
+
+struct fit_point {
+	quirc_float_t		u;
+	quirc_float_t		v;
+	quirc_float_t		x;
+	quirc_float_t		y;
+};
+
+/* Solve the 8x8 system a.x = b by Gaussian elimination with partial
+ * pivoting. a and b are destroyed. Returns -1 if a is singular.
+ */
+static int solve_8x8(quirc_float_t *a, quirc_float_t *b, quirc_float_t *x)
+{
+	int i, j, k;
+
+	for (i = 0; i < 8; i++) {
+		int pivot = i;
+
+		for (j = i + 1; j < 8; j++)
+			if (fabs(a[j * 8 + i]) > fabs(a[pivot * 8 + i]))
+				pivot = j;
+
+		if (fabs(a[pivot * 8 + i]) < (quirc_float_t)1e-9)
+			return -1;
+
+		if (pivot != i) {
+			quirc_float_t t;
+
+			for (k = 0; k < 8; k++) {
+				t = a[i * 8 + k];
+				a[i * 8 + k] = a[pivot * 8 + k];
+				a[pivot * 8 + k] = t;
+			}
+
+			t = b[i];
+			b[i] = b[pivot];
+			b[pivot] = t;
+		}
+
+		for (j = i + 1; j < 8; j++) {
+			quirc_float_t f = a[j * 8 + i] / a[i * 8 + i];
+
+			for (k = i; k < 8; k++)
+				a[j * 8 + k] -= f * a[i * 8 + k];
+			b[j] -= f * b[i];
+		}
+	}
+
+	for (i = 7; i >= 0; i--) {
+		quirc_float_t sum = b[i];
+
+		for (k = i + 1; k < 8; k++)
+			sum -= a[i * 8 + k] * x[k];
+		x[i] = sum / a[i * 8 + i];
+	}
+
+	return 0;
+}
+
+/* Each point gives two equations, linear in the parameters:
+ *
+ *     c0 u + c1 v + c2 - c6 u x - c7 v x = x
+ *     c3 u + c4 v + c5 - c6 u y - c7 v y = y
+ *
+ * Grid coordinates are scaled by 1/size and image coordinates are taken
+ * relative to their mean and scaled to a unit spread before the normal
+ * equations are formed, to keep them well conditioned. The result is
+ * then converted back.
+ */
+static int fit_perspective(quirc_float_t *c, const struct fit_point *pts,
+			   int count, int size)
+{
+	quirc_float_t ata[64] = {0};
+	quirc_float_t atb[8] = {0};
+	quirc_float_t r[8];
+	quirc_float_t mx = 0, my = 0, s = 0;
+	quirc_float_t gs = (quirc_float_t)1.0 / size;
+	int i, j, k;
+
+	for (i = 0; i < count; i++) {
+		mx += pts[i].x;
+		my += pts[i].y;
+	}
+
+	mx /= count;
+	my /= count;
+
+	for (i = 0; i < count; i++)
+		s += fabs(pts[i].x - mx) + fabs(pts[i].y - my);
+
+	if (s <= 0)
+		return -1;
+
+	s = count / s;
+
+	for (i = 0; i < count; i++) {
+		const quirc_float_t u = pts[i].u * gs;
+		const quirc_float_t v = pts[i].v * gs;
+		const quirc_float_t x = (pts[i].x - mx) * s;
+		const quirc_float_t y = (pts[i].y - my) * s;
+		const quirc_float_t rows[2][8] = {
+			{u, v, 1, 0, 0, 0, -u * x, -v * x},
+			{0, 0, 0, u, v, 1, -u * y, -v * y}
+		};
+		const quirc_float_t rhs[2] = {x, y};
+
+		for (k = 0; k < 2; k++)
+			for (j = 0; j < 8; j++) {
+				int l;
+
+				for (l = 0; l < 8; l++)
+					ata[j * 8 + l] += rows[k][j] * rows[k][l];
+				atb[j] += rows[k][j] * rhs[k];
+			}
+	}
+
+	if (solve_8x8(ata, atb, r) < 0)
+		return -1;
+
+	/* x = mx + (r0 u' + r1 v' + r2) / (s (r6 u' + r7 v' + 1)),
+	 * with u' = u / size.
+	 */
+	c[0] = (mx * r[6] + r[0] / s) * gs;
+	c[1] = (mx * r[7] + r[1] / s) * gs;
+	c[2] = mx + r[2] / s;
+	c[3] = (my * r[6] + r[3] / s) * gs;
+	c[4] = (my * r[7] + r[4] / s) * gs;
+	c[5] = my + r[5] / s;
+	c[6] = r[6] * gs;
+	c[7] = r[7] * gs;
+
+	return 0;
+}
+
+static int pixel_black(const struct quirc *q, quirc_float_t x,
+		       quirc_float_t y)
+{
+	int px = (int)rint(x);
+	int py = (int)rint(y);
+
+	if (px < 0 || py < 0 || px >= q->w || py >= q->h)
+		return 0;
+
+	return pixel_at(q, px, py);
+}
+
+/* Measure the black run through (x, y) in direction (dx, dy), giving
+ * its midpoint. The run must be between min and max pixels long.
+ */
+static int black_run(const struct quirc *q, int x, int y, int dx, int dy,
+		     int min, int max, quirc_float_t *mid)
+{
+	int a = 0, b = 0;
+
+	while (a <= max && pixel_black(q, x - (a + 1) * dx, y - (a + 1) * dy))
+		a++;
+	while (b <= max && pixel_black(q, x + (b + 1) * dx, y + (b + 1) * dy))
+		b++;
+
+	if (a + b + 1 < min || a + b + 1 > max)
+		return -1;
+
+	*mid = (dx ? x : y) + (b - a) * (quirc_float_t)0.5;
+	return 0;
+}
+
+/* Find the centre of the alignment pattern which the transform c puts
+ * at grid cell (gx, gy). The black runs through the central module are
+ * measured across and down, and the white and black rings around it are
+ * checked.
+ */
+static int locate_alignment(const struct quirc *q, const quirc_float_t *c,
+			    int gx, int gy, struct fit_point *pt)
+{
+	quirc_float_t den, cx, cy, ux, uy, vx, vy;
+	quirc_float_t mod;
+	int min, max;
+	int i;
+
+	den = (quirc_float_t)1 /
+		(c[6] * (gx + (quirc_float_t)0.5) +
+		 c[7] * (gy + (quirc_float_t)0.5) + (quirc_float_t)1.0);
+	cx = (c[0] * (gx + (quirc_float_t)0.5) +
+	      c[1] * (gy + (quirc_float_t)0.5) + c[2]) * den;
+	cy = (c[3] * (gx + (quirc_float_t)0.5) +
+	      c[4] * (gy + (quirc_float_t)0.5) + c[5]) * den;
+
+	/* Approximate one-module steps along the grid axes */
+	ux = (c[0] - c[6] * cx) * den;
+	uy = (c[3] - c[6] * cy) * den;
+	vx = (c[1] - c[7] * cx) * den;
+	vy = (c[4] - c[7] * cy) * den;
+
+	mod = (sqrt(ux * ux + uy * uy) + sqrt(vx * vx + vy * vy)) *
+		(quirc_float_t)0.5;
+	if (!(mod >= (quirc_float_t)1.5))
+		return -1;
+
+	min = (int)(mod * (quirc_float_t)0.5);
+	max = (int)(mod * (quirc_float_t)1.6) + 1;
+
+	if (!pixel_black(q, cx, cy))
+		return -1;
+
+	/* Across, down, and across again through the new centre */
+	if (black_run(q, rint(cx), rint(cy), 1, 0, min, max, &cx) < 0 ||
+	    black_run(q, rint(cx), rint(cy), 0, 1, min, max, &cy) < 0 ||
+	    black_run(q, rint(cx), rint(cy), 1, 0, min, max, &cx) < 0)
+		return -1;
+
+	for (i = 0; i < 4; i++) {
+		const quirc_float_t dx = (i & 1) ? vx : ux;
+		const quirc_float_t dy = (i & 1) ? vy : uy;
+		const int sign = (i & 2) ? -1 : 1;
+
+		if (pixel_black(q, cx + sign * dx, cy + sign * dy) ||
+		    !pixel_black(q, cx + sign * 2 * dx, cy + sign * 2 * dy))
+			return -1;
+	}
+
+	pt->u = gx + (quirc_float_t)0.5;
+	pt->v = gy + (quirc_float_t)0.5;
+	pt->x = cx;
+	pt->y = cy;
+
+	return 0;
+}
+
+/* For versions 7 and up, look for every alignment pattern where the
+ * current transform expects it, and fit a new transform to those found
+ * and to the capstone corners. This is done twice, so that the second
+ * search benefits from the first fit. Returns -1 if fewer than half of
+ * the alignment patterns could be found.
+ */
+static int fit_alignment_patterns(const struct quirc *q,
+				  const struct quirc_grid *qr,
+				  quirc_float_t *c)
+{
+	const int version = (qr->grid_size - 17) / 4;
+	const struct quirc_version_info *info = &quirc_version_db[version];
+	struct fit_point pts[FIT_MAX_POINTS];
+	int ap_count = 0;
+	int round;
+	int i, j;
+
+	if (version < 7)
+		return -1;
+
+	while (ap_count < QUIRC_MAX_ALIGNMENT && info->apat[ap_count])
+		ap_count++;
+
+	memcpy(c, qr->c, sizeof(qr->c));
+
+	for (round = 0; round < 2; round++) {
+		int count = 0;
+		int found = 0;
+
+		/* Capstone corners: top-left, top-right, bottom-left */
+		for (i = 0; i < 3; i++) {
+			const struct quirc_capstone *cap =
+				&q->capstones[qr->caps[(i + 1) % 3]];
+			const int ou = (i == 1) ? qr->grid_size - 7 : 0;
+			const int ov = (i == 2) ? qr->grid_size - 7 : 0;
+
+			for (j = 0; j < 4; j++) {
+				struct fit_point *pt = &pts[count++];
+
+				pt->u = ou + ((j == 1 || j == 2) ? 7 : 0);
+				pt->v = ov + ((j >= 2) ? 7 : 0);
+				pt->x = cap->corners[j].x;
+				pt->y = cap->corners[j].y;
+			}
+		}
+
+		/* Alignment patterns, except those overlapping finders */
+		for (i = 0; i < ap_count; i++)
+			for (j = 0; j < ap_count; j++) {
+				if ((i == 0 && j == 0) ||
+				    (i == 0 && j == ap_count - 1) ||
+				    (i == ap_count - 1 && j == 0))
+					continue;
+
+				if (!locate_alignment(q, c, info->apat[i],
+						      info->apat[j],
+						      &pts[count])) {
+					count++;
+					found++;
+				}
+			}
+
+		if (found * 2 < ap_count * ap_count - 3)
+			return -1;
+
+		if (fit_perspective(c, pts, count, qr->grid_size) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Adjust the perspective transform to maximise fitness. A transform
+ * which scores at least this fraction (in 1/64ths) of the maximum is
+ * good enough to keep as it is, whether it's the initial transform or
+ * one fitted to the alignment patterns. Otherwise the initial transform
+ * is improved by trial and error, stopping early after a pass in which
+ * no adjustment helped. (A fitted transform which falls short is usually
+ * being thrown off by lens distortion, and makes a worse start.)
+ *
+ * Grids of an invalid size can't be decoded, so no time is spent on
+ * them. Returns the number of cells sampled, as a measure of the work
+ * done, and stores the number of transforms tested in *tests.
+ */
+#define JIGGLE_GOOD_ENOUGH	62
+
+static int jiggle_perspective(const struct quirc *q, struct quirc_grid *qr,
+			      int *tests_out)
+{
+	struct fitness_list list;
+	quirc_float_t fitted[QUIRC_PERSPECTIVE_PARAMS];
+	int best;
+	int tests = 1;
+	int pass;
+	quirc_float_t adjustments[8];
+	int i;
+
+	*tests_out = 0;
+	if (qr->grid_size < 21 || qr->grid_size > QUIRC_MAX_GRID_SIZE)
+		return 0;
+
+	fitness_setup(qr, &list);
+	best = fitness_all(q, qr, &list, INT_MIN);
+
+	if (best * 64 >= list.count * 9 * JIGGLE_GOOD_ENOUGH) {
+		*tests_out = tests;
+		return list.count;
+	}
+
+	if (!fit_alignment_patterns(q, qr, fitted)) {
+		quirc_float_t saved[QUIRC_PERSPECTIVE_PARAMS];
+		int test;
+
+		memcpy(saved, qr->c, sizeof(saved));
+		memcpy(qr->c, fitted, sizeof(qr->c));
+		test = fitness_all(q, qr, &list, best);
+		tests++;
+
+		if (test * 64 >= list.count * 9 * JIGGLE_GOOD_ENOUGH) {
+			*tests_out = tests;
+			return tests * list.count;
+		}
+
+		memcpy(qr->c, saved, sizeof(qr->c));
+	}
+
+	for (i = 0; i < 8; i++)
+		adjustments[i] = qr->c[i] * (quirc_float_t)0.02;
+
+	for (pass = 0; pass < 5; pass++) {
+		int improved = 0;
+
+		for (i = 0; i < 16; i++) {
+			int j = i >> 1;
+			int test;
+			quirc_float_t old = qr->c[j];
+			quirc_float_t step = adjustments[j];
+			quirc_float_t new;
+
+			if (i & 1)
+				new = old + step;
+			else
+				new = old - step;
+
+			qr->c[j] = new;
+			test = fitness_all(q, qr, &list, best);
+			tests++;
+
+			if (test > best) {
+				best = test;
+				improved = 1;
+			} else {
+				qr->c[j] = old;
+			}
+		}
+
+		if (!improved)
+			break;
+
+		for (i = 0; i < 8; i++)
+			adjustments[i] *= 0.5;
+	}
+
+	*tests_out = tests;
+	return tests * list.count;
+}
+
+/* Refine a grid's perspective transform, if it hasn't been already.
+ * Returns the number of cells sampled.
+ */
+static int refine_grid(struct quirc *q, int index)
+{
+	struct quirc_grid *qr = &q->grids[index];
+	int work;
+	int tests;
+#ifdef QUIRC_STATS
+	const uint64_t start = quirc_stats_clock();
+#endif
+
+	if (qr->refined)
+		return 0;
+
+	qr->refined = 1;
+	work = jiggle_perspective(q, qr, &tests);
+	QUIRC_STATS_ADD(q, fitness_evaluations, tests);
+#ifdef QUIRC_STATS
+	qr->refine_ns = quirc_stats_clock() - start;
+	qr->refine_tests = tests;
+	QUIRC_STATS_ADD(q, jiggle_ns, qr->refine_ns);
+#endif
+
+	return work;
+}
+
+/* Once the capstones are in place and an alignment point has been
+ * chosen, we call this function to set up a grid-reading perspective
+ * transform.
+ */
+static void setup_qr_perspective(struct quirc *q, int index)
+{
+	struct quirc_grid *qr = &q->grids[index];
+	struct quirc_point rect[4];
+
+	/* Set up the perspective map for reading the grid */
+	memcpy(&rect[0], &q->capstones[qr->caps[1]].corners[0],
+	       sizeof(rect[0]));
+	memcpy(&rect[1], &q->capstones[qr->caps[2]].corners[0],
+	       sizeof(rect[0]));
+	memcpy(&rect[2], &qr->align, sizeof(rect[0]));
+	memcpy(&rect[3], &q->capstones[qr->caps[0]].corners[0],
+	       sizeof(rect[0]));
+	perspective_setup(qr->c, rect, qr->grid_size - 7, qr->grid_size - 7);
+
+	qr->refined = 0;
+#ifdef QUIRC_STATS
+	qr->refine_ns = 0;
+	qr->refine_tests = 0;
+#endif
+	if (!q->lazy_refinement)
+		budget_spend(q, refine_grid(q, index));
+}
+
+/* Rotate the capstone with so that corner 0 is the leftmost with respect
+ * to the given reference line.
+ */
+static void rotate_capstone(struct quirc_capstone *cap,
+			    const struct quirc_point *h0,
+			    const struct quirc_point *hd)
+{
+	struct quirc_point copy[4];
+	int j;
+	int best = 0;
+	int best_score = INT_MAX;
+
+	for (j = 0; j < 4; j++) {
+		struct quirc_point *p = &cap->corners[j];
+		int score = (p->x - h0->x) * -hd->y +
+			(p->y - h0->y) * hd->x;
+
+		if (!j || score < best_score) {
+			best = j;
+			best_score = score;
+		}
+	}
+
+	/* Rotate the capstone */
+	for (j = 0; j < 4; j++)
+		memcpy(&copy[j], &cap->corners[(j + best) % 4],
+		       sizeof(copy[j]));
+	memcpy(cap->corners, copy, sizeof(cap->corners));
+	perspective_setup(cap->c, cap->corners, 7.0, 7.0);
+}
+
+static void record_qr_grid(struct quirc *q, int a, int b, int c)
+{
+	struct quirc_point h0, hd;
+	int i;
+	int qr_index;
+	struct quirc_grid *qr;
+
+	if (q->num_grids >= q->max_grids) {
+		q->limits_reached |= QUIRC_LIMIT_GRIDS;
+		return;
+	}
+
+	/* Construct the hypotenuse line from A to C. B should be to
+	 * the left of this line.
+	 */
+	memcpy(&h0, &q->capstones[a].center, sizeof(h0));
+	hd.x = q->capstones[c].center.x - q->capstones[a].center.x;
+	hd.y = q->capstones[c].center.y - q->capstones[a].center.y;
+
+	/* Make sure A-B-C is clockwise */
+	if ((q->capstones[b].center.x - h0.x) * -hd.y +
+	    (q->capstones[b].center.y - h0.y) * hd.x > 0) {
+		int swap = a;
+
+		a = c;
+		c = swap;
+		hd.x = -hd.x;
+		hd.y = -hd.y;
+	}
+
+	/* Record the grid and its components */
+	qr_index = q->num_grids;
+	qr = &q->grids[q->num_grids++];
+
+	memset(qr, 0, sizeof(*qr));
+	qr->caps[0] = a;
+	qr->caps[1] = b;
+	qr->caps[2] = c;
+	qr->align_region = -1;
+
+	/* Rotate each capstone so that corner 0 is top-left with respect
+	 * to the grid.
+	 */
+	for (i = 0; i < 3; i++) {
+		struct quirc_capstone *cap = &q->capstones[qr->caps[i]];
+
+		rotate_capstone(cap, &h0, &hd);
+		cap->qr_grid = qr_index;
+	}
+
+	/* Check the timing pattern by measuring grid size. This doesn't require a perspective
+	 * transform.
+	 */
+	measure_grid_size(q, qr_index);
+	/* Make an estimate based for the alignment pattern based on extending
+	 * lines from capstones A and C.
+	 */
+	if (!line_intersect(&q->capstones[a].corners[0],
+			    &q->capstones[a].corners[1],
+			    &q->capstones[c].corners[0],
+			    &q->capstones[c].corners[3],
+			    &qr->align))
+		goto fail;
+
+	/* On V2+ grids, we should use the alignment pattern. */
+	if (qr->grid_size > 21) {
+		/* Try to find the actual location of the alignment pattern. */
+		find_alignment_pattern(q, qr_index);
+
+		/* Find the point of the alignment pattern closest to the
+		 * top-left of the QR grid.
+		 */
+		if (qr->align_region >= 0) {
+			struct polygon_score_data psd;
+			struct quirc_region *reg =
+				&q->regions[qr->align_region];
+
+			/* Start from some point inside the alignment pattern */
+			memcpy(&qr->align, &reg->seed, sizeof(qr->align));
+
+			memcpy(&psd.ref, &hd, sizeof(psd.ref));
+			psd.corners = &qr->align;
+			psd.scores[0] = -hd.y * qr->align.x +
+				hd.x * qr->align.y;
+
+			if (region_furthest_along(reg, hd.y, -hd.x,
+						  &qr->align) < 0)
+				region_visit(q, qr->align_region,
+					     find_leftmost_to_line, &psd);
+		}
+	}
+
+	QUIRC_STATS_ADD(q, grids, 1);
+	setup_qr_perspective(q, qr_index);
+	return;
+
+fail:
+	/* We've been unable to complete setup for this grid. Undo what we've
+	 * recorded and pretend it never happened.
+	 */
+	for (i = 0; i < 3; i++)
+		q->capstones[qr->caps[i]].qr_grid = -1;
+	q->num_grids--;
+}
+
+/************************************************************************
+ * Capstone grouping
+ *
+ * Each capstone is tried as the corner of a grid, with the capstones
+ * aligned with it along each of its axes. Only the nearest few in each
+ * direction are kept, since the other capstones of a grid can't be
+ * behind those of another code. The possible groupings are then ranked,
+ * and each capstone is given to the best one it is part of, so that
+ * only one grid is refined for each.
+ */
+
+/* The greatest ratio between the module sizes of capstones in the same
+ * grid, and the number of cells across the image in which capstones
+ * are indexed.
+ */
+#define GROUP_SCALE		3
+#define GROUP_CELLS		16
+
+struct neighbour {
+	int		index;
+	quirc_float_t		distance;
+};
+
+/* The nearest capstones in one direction, closest first */
+struct neighbour_list {
+	struct neighbour	n[QUIRC_GROUP_NEAREST];
+	int			count;
+};
+
+static void neighbour_add(struct neighbour_list *list, int index,
+			  quirc_float_t distance)
+{
+	int i = list->count;
+
+	if (i < QUIRC_GROUP_NEAREST)
+		list->count++;
+	else if (distance < list->n[QUIRC_GROUP_NEAREST - 1].distance)
+		i--;
+	else
+		return;
+
+	while (i > 0 && list->n[i - 1].distance > distance) {
+		list->n[i] = list->n[i - 1];
+		i--;
+	}
+
+	list->n[i].index = index;
+	list->n[i].distance = distance;
+}
+
+/* Average module size of a capstone, in pixels */
+static quirc_float_t capstone_module(const struct quirc_capstone *cap)
+{
+	return (length(cap->corners[0], cap->corners[1]) +
+		length(cap->corners[1], cap->corners[2]) +
+		length(cap->corners[2], cap->corners[3]) +
+		length(cap->corners[3], cap->corners[0])) /
+		(quirc_float_t)28.0;
+}
+
+/* Count the timing pattern cells which look as expected along the five
+ * modules of an arm of a grouping nearest to one of its capstones. The
+ * grid is approximated by the capstone's module size m, the direction
+ * (dx, dy) along the arm and the direction (px, py) towards its timing
+ * pattern, which is close enough near the capstone.
+ */
+static int arm_timing(const struct quirc *q, const struct quirc_point *p,
+		      quirc_float_t m, quirc_float_t dx, quirc_float_t dy,
+		      quirc_float_t px, quirc_float_t py)
+{
+	int matches = 0;
+	int i;
+
+	/* Cells 8 to 12 of the timing pattern are 5 to 9 modules from
+	 * the capstone's centre, and 3 modules to its side.
+	 */
+	for (i = 0; i < 5; i++) {
+		const quirc_float_t d = (i + 5) * m;
+
+		if (pixel_black(q, p->x + d * dx + 3 * m * px,
+				p->y + d * dy + 3 * m * py) == !(i & 1))
+			matches++;
+	}
+
+	return matches;
+}
+
+/* Count the timing pattern cells which look as expected near each end
+ * of both arms of a grouping, out of 20. Timing patterns have at least
+ * five cells, starting and ending with a dark one.
+ */
+static int grouping_timing(const struct quirc *q, int a, int b, int c)
+{
+	const struct quirc_capstone *ca = &q->capstones[a];
+	const struct quirc_capstone *cb = &q->capstones[b];
+	const struct quirc_capstone *cc = &q->capstones[c];
+	const quirc_float_t la = hypot(ca->center.x - cb->center.x,
+				       ca->center.y - cb->center.y);
+	const quirc_float_t lc = hypot(cc->center.x - cb->center.x,
+				       cc->center.y - cb->center.y);
+	quirc_float_t ax, ay, cx, cy;
+
+	if (la <= 0 || lc <= 0)
+		return 0;
+
+	/* Unit vectors from B towards A and C */
+	ax = (ca->center.x - cb->center.x) / la;
+	ay = (ca->center.y - cb->center.y) / la;
+	cx = (cc->center.x - cb->center.x) / lc;
+	cy = (cc->center.y - cb->center.y) / lc;
+
+	return arm_timing(q, &cb->center, capstone_module(cb),
+			  ax, ay, cx, cy) +
+		arm_timing(q, &cb->center, capstone_module(cb),
+			   cx, cy, ax, ay) +
+		arm_timing(q, &ca->center, capstone_module(ca),
+			   -ax, -ay, cx, cy) +
+		arm_timing(q, &cc->center, capstone_module(cc),
+			   -cx, -cy, ax, ay);
+}
+
+static void test_neighbours(struct quirc *q, int i,
+			    const struct neighbour_list *hlist,
+			    const struct neighbour_list *vlist)
+{
+	/* Test each possible grouping */
+	for (int j = 0; j < hlist->count; j++) {
+		const struct neighbour *hn = &hlist->n[j];
+		for (int k = 0; k < vlist->count; k++) {
+			const struct neighbour *vn = &vlist->n[k];
+			quirc_float_t squareness = fabs((quirc_float_t)1.0 - hn->distance / vn->distance);
+			struct quirc_grouping *g;
+
+			if (squareness >= (quirc_float_t)0.2)
+				continue;
+
+			g = &q->groupings[q->num_groupings];
+			g->caps[0] = hn->index;
+			g->caps[1] = i;
+			g->caps[2] = vn->index;
+			g->order = q->num_groupings++;
+			g->timing = grouping_timing(q, hn->index, i,
+						    vn->index);
+			g->nearness = j + k;
+			g->squareness = squareness;
+		}
+	}
+}
+
+/* Find the cell column or row of an image coordinate, clamped */
+static int capstone_cell_x(const struct quirc *q, quirc_float_t x)
+{
+	int cx = (int)(x * GROUP_CELLS / (q->w + 1));
+
+	return cx < 0 ? 0 : (cx >= GROUP_CELLS ? GROUP_CELLS - 1 : cx);
+}
+
+static int capstone_cell_y(const struct quirc *q, quirc_float_t y)
+{
+	int cy = (int)(y * GROUP_CELLS / (q->h + 1));
+
+	return cy < 0 ? 0 : (cy >= GROUP_CELLS ? GROUP_CELLS - 1 : cy);
+}
+
+static int capstone_cell(const struct quirc *q, const struct quirc_point *p)
+{
+	return capstone_cell_y(q, p->y) * GROUP_CELLS +
+		capstone_cell_x(q, p->x);
+}
+
+/* Sort capstones by the cell their centres are in, so that those near
+ * each one can be found without visiting every other.
+ */
+static void capstone_cells_setup(struct quirc *q, int *cell_start)
+{
+	int counts[GROUP_CELLS * GROUP_CELLS] = { 0 };
+	int i;
+
+	for (i = 0; i < q->num_capstones; i++)
+		counts[capstone_cell(q, &q->capstones[i].center)]++;
+
+	cell_start[0] = 0;
+	for (i = 0; i < GROUP_CELLS * GROUP_CELLS; i++) {
+		cell_start[i + 1] = cell_start[i] + counts[i];
+		counts[i] = cell_start[i];
+	}
+
+	for (i = 0; i < q->num_capstones; i++) {
+		const int cell = capstone_cell(q, &q->capstones[i].center);
+
+		q->capstone_order[counts[cell]++] = i;
+	}
+}
+
+static void test_grouping(struct quirc *q, int i, const int *cell_start)
+{
+	const struct quirc_capstone *c1 = &q->capstones[i];
+	const quirc_float_t m1 = capstone_module(c1);
+	const quirc_float_t reach = m1 * QUIRC_MAX_GRID_SIZE;
+	const int cx0 = capstone_cell_x(q, c1->center.x - reach);
+	const int cx1 = capstone_cell_x(q, c1->center.x + reach);
+	const int cy0 = capstone_cell_y(q, c1->center.y - reach);
+	const int cy1 = capstone_cell_y(q, c1->center.y + reach);
+	struct neighbour_list hlist[2];
+	struct neighbour_list vlist[2];
+	int cx, cy, k;
+
+	memset(hlist, 0, sizeof(hlist));
+	memset(vlist, 0, sizeof(vlist));
+
+	/* Look for potential neighbours in each direction, by examining
+	 * the relative gradients from this capstone to others within
+	 * reach of the largest grid at its module size, and with a similar
+	 * module size.
+	 */
+	for (cy = cy0; cy <= cy1; cy++)
+		for (cx = cx0; cx <= cx1; cx++) {
+			const int cell = cy * GROUP_CELLS + cx;
+
+			for (k = cell_start[cell]; k < cell_start[cell + 1];
+			     k++) {
+				const int j = q->capstone_order[k];
+				const struct quirc_capstone *c2 =
+					&q->capstones[j];
+				quirc_float_t m2, u, v;
+
+				if (i == j)
+					continue;
+
+				m2 = capstone_module(c2);
+				if (m2 > m1 * GROUP_SCALE ||
+				    m1 > m2 * GROUP_SCALE)
+					continue;
+
+				perspective_unmap(c1->c, &c2->center, &u, &v);
+
+				u -= (quirc_float_t)3.5;
+				v -= (quirc_float_t)3.5;
+
+				if (fabs(u) < (quirc_float_t)0.2 * fabs(v))
+					neighbour_add(&hlist[v > 0], j,
+						      fabs(v));
+
+				if (fabs(v) < (quirc_float_t)0.2 * fabs(u))
+					neighbour_add(&vlist[u > 0], j,
+						      fabs(u));
+			}
+		}
+
+	for (k = 0; k < 4; k++)
+		test_neighbours(q, i, &hlist[k >> 1], &vlist[k & 1]);
+}
+
+/* Rank groupings by their timing patterns, then by whether they are
+ * made of the nearest capstones, and then by how square they are.
+ * Otherwise, keep the order in which they were found.
+ */
+static int grouping_rank(const void *a, const void *b)
+{
+	const struct quirc_grouping *ga = a;
+	const struct quirc_grouping *gb = b;
+
+	if (ga->timing != gb->timing)
+		return gb->timing - ga->timing;
+	if (ga->nearness != gb->nearness)
+		return ga->nearness - gb->nearness;
+	if (ga->squareness != gb->squareness)
+		return ga->squareness < gb->squareness ? -1 : 1;
+	return ga->order - gb->order;
+}
+
+static int grouping_order(const void *a, const void *b)
+{
+	return ((const struct quirc_grouping *)a)->order -
+		((const struct quirc_grouping *)b)->order;
+}
+
+/* Check whether none of the capstones of a grouping have been taken */
+static int grouping_free(const struct quirc *q, const struct quirc_grouping *g)
+{
+	int k;
+
+	for (k = 0; k < 3; k++)
+		if (q->capstones[g->caps[k]].qr_grid != -1)
+			return 0;
+
+	return 1;
+}
+
+/* Taken capstones have a qr_grid of -2 until their grids are recorded */
+static void group_take(struct quirc *q, struct quirc_grouping *g)
+{
+	int k;
+
+	g->taken = 1;
+	for (k = 0; k < 3; k++)
+		q->capstones[g->caps[k]].qr_grid = -2;
+}
+
+/* Give back the capstones of a grouping whose grid won't be recorded */
+static void group_release(struct quirc *q, const struct quirc_grouping *g)
+{
+	int k;
+
+	for (k = 0; k < 3; k++)
+		q->capstones[g->caps[k]].qr_grid = -1;
+}
+
+/* After a grid couldn't be recorded, give its capstones to the best of
+ * the remaining groupings which can now have all of theirs. Any of
+ * those which have already been passed over are recorded next.
+ */
+static void group_retake(struct quirc *q)
+{
+	for (;;) {
+		struct quirc_grouping *best = NULL;
+		int i;
+
+		for (i = 0; i < q->num_groupings; i++) {
+			struct quirc_grouping *g = &q->groupings[i];
+
+			if (!g->done && !g->taken && grouping_free(q, g) &&
+			    (!best || g->rank < best->rank))
+				best = g;
+		}
+
+		if (!best)
+			return;
+
+		group_take(q, best);
+		if (best - q->groupings < q->step_grouping)
+			q->step_grouping = best - q->groupings;
+	}
+}
+
+/* Check whether a recorded grid can be decoded, mirrored or not */
+static int grid_decodes(struct quirc *q, int index)
+{
+	struct quirc_code code;
+	struct quirc_data data;
+	quirc_decode_error_t err;
+
+	budget_spend(q, refine_grid(q, index));
+	quirc_extract(q, index, &code);
+	err = quirc_decode(&code, &data);
+	if (err == QUIRC_ERROR_DATA_ECC) {
+		quirc_flip(&code);
+		err = quirc_decode(&code, &data);
+	}
+
+	return err == QUIRC_SUCCESS;
+}
+
+/* Rank the possible groupings of the capstones found, and choose the
+ * ones whose grids will be recorded.
+ */
+static void group_capstones(struct quirc *q)
+{
+	int cell_start[GROUP_CELLS * GROUP_CELLS + 1];
+	int i;
+
+	q->num_groupings = 0;
+	capstone_cells_setup(q, cell_start);
+	for (i = 0; i < q->num_capstones; i++)
+		test_grouping(q, i, cell_start);
+
+	/* Give each capstone to the best grouping it's part of */
+	qsort(q->groupings, q->num_groupings, sizeof(q->groupings[0]),
+	      grouping_rank);
+	for (i = 0; i < q->num_groupings; i++) {
+		struct quirc_grouping *g = &q->groupings[i];
+
+		g->rank = i;
+		g->taken = 0;
+		g->done = 0;
+		if (grouping_free(q, g))
+			group_take(q, g);
+	}
+
+	/* The grids are refined in the order their groupings were found */
+	qsort(q->groupings, q->num_groupings, sizeof(q->groupings[0]),
+	      grouping_order);
+	q->step_grouping = 0;
+	q->step_decoded = 0;
+}
+
+/* Record the grid of the next chosen grouping, if there are any left.
+ * Once enough grids have been decoded, the capstones of the rest are
+ * given back instead. Returns non-zero if there were none left.
+ */
+static int group_record_next(struct quirc *q)
+{
+	while (q->step_grouping < q->num_groupings) {
+		struct quirc_grouping *g = &q->groupings[q->step_grouping++];
+		int num_grids = q->num_grids;
+
+		if (!g->taken || g->done)
+			continue;
+
+		g->done = 1;
+		if (q->max_codes && q->step_decoded >= q->max_codes) {
+			group_release(q, g);
+			continue;
+		}
+
+		record_qr_grid(q, g->caps[0], g->caps[1], g->caps[2]);
+		if (q->num_grids == num_grids) {
+			group_release(q, g);
+			if (num_grids < q->max_grids)
+				group_retake(q);
+		} else if (q->max_codes && grid_decodes(q, num_grids)) {
+			q->step_decoded++;
+		}
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/************************************************************************
+ * Binarization kernels
+ *
+ * Each kernel stores QUIRC_PIXEL_BLACK for every source pixel darker
+ * than the threshold, and QUIRC_PIXEL_WHITE otherwise. The source and
+ * destination may be the same buffer when the pixels alias the image.
+ * The vector kernels rely on QUIRC_PIXEL_BLACK being 1, and must give
+ * exactly the same output as the scalar loop.
+ */
+
+typedef void (*binarize_func_t)(const uint8_t *src, quirc_pixel_t *dst,
+				int len, uint8_t threshold);
+
+static void binarize_scalar(const uint8_t *src, quirc_pixel_t *dst,
+			    int len, uint8_t threshold)
+{
+	while (len--) {
+		uint8_t value = *src++;
+		*dst++ = (value < threshold) ? QUIRC_PIXEL_BLACK : QUIRC_PIXEL_WHITE;
+	}
+}
+
+#ifdef QUIRC_HAVE_SSE2
+static void binarize_sse2(const uint8_t *src, quirc_pixel_t *dst,
+			  int len, uint8_t threshold)
+{
+	/* SSE2 only has signed byte comparisons, so bias both sides */
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	const __m128i t = _mm_set1_epi8((char)(threshold ^ 0x80));
+	const __m128i one = _mm_set1_epi8(QUIRC_PIXEL_BLACK);
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_and_si128(
+			_mm_cmplt_epi8(_mm_xor_si128(v, bias), t), one);
+
+#if !QUIRC_PIXEL_WIDE
+		_mm_storeu_si128((__m128i *)(dst + i), b);
+#else
+		const __m128i zero = _mm_setzero_si128();
+
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_unpacklo_epi8(b, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 8),
+				 _mm_unpackhi_epi8(b, zero));
+#endif
+	}
+
+	binarize_scalar(src + i, dst + i, len - i, threshold);
+}
+#endif
+
+#ifdef QUIRC_HAVE_AVX2
+__attribute__((target("avx2")))
+static void binarize_avx2(const uint8_t *src, quirc_pixel_t *dst,
+			  int len, uint8_t threshold)
+{
+	const __m256i bias = _mm256_set1_epi8((char)0x80);
+	const __m256i t = _mm256_set1_epi8((char)(threshold ^ 0x80));
+	const __m256i one = _mm256_set1_epi8(QUIRC_PIXEL_BLACK);
+	int i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_and_si256(
+			_mm256_cmpgt_epi8(t, _mm256_xor_si256(v, bias)), one);
+
+#if !QUIRC_PIXEL_WIDE
+		_mm256_storeu_si256((__m256i *)(dst + i), b);
+#else
+		_mm256_storeu_si256((__m256i *)(dst + i),
+			_mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)));
+		_mm256_storeu_si256((__m256i *)(dst + i + 16),
+			_mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)));
+#endif
+	}
+
+	binarize_scalar(src + i, dst + i, len - i, threshold);
+}
+#endif
+
+#ifdef QUIRC_HAVE_NEON
+static void binarize_neon(const uint8_t *src, quirc_pixel_t *dst,
+			  int len, uint8_t threshold)
+{
+	const uint8x16_t t = vdupq_n_u8(threshold);
+	const uint8x16_t one = vdupq_n_u8(QUIRC_PIXEL_BLACK);
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		uint8x16_t b = vandq_u8(vcltq_u8(vld1q_u8(src + i), t), one);
+
+#if !QUIRC_PIXEL_WIDE
+		vst1q_u8(dst + i, b);
+#else
+		vst1q_u16(dst + i, vmovl_u8(vget_low_u8(b)));
+		vst1q_u16(dst + i + 8, vmovl_u8(vget_high_u8(b)));
+#endif
+	}
+
+	binarize_scalar(src + i, dst + i, len - i, threshold);
+}
+#endif
+
+static binarize_func_t binarize_kernel(void)
+{
+#ifdef QUIRC_HAVE_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return binarize_avx2;
+#endif
+#if defined(QUIRC_HAVE_SSE2)
+	return binarize_sse2;
+#elif defined(QUIRC_HAVE_NEON)
+	return binarize_neon;
+#else
+	return binarize_scalar;
+#endif
+}
+
+/* As above, but with a separate threshold for each pixel. */
+static void binarize_line(const uint8_t *src, quirc_pixel_t *dst,
+			  const uint8_t *threshold, int len)
+{
+	int i = 0;
+
+#if defined(QUIRC_HAVE_SSE2)
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	const __m128i one = _mm_set1_epi8(QUIRC_PIXEL_BLACK);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i t = _mm_loadu_si128((const __m128i *)(threshold + i));
+		__m128i b = _mm_and_si128(
+			_mm_cmplt_epi8(_mm_xor_si128(v, bias),
+				       _mm_xor_si128(t, bias)), one);
+
+#if !QUIRC_PIXEL_WIDE
+		_mm_storeu_si128((__m128i *)(dst + i), b);
+#else
+		const __m128i zero = _mm_setzero_si128();
+
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_unpacklo_epi8(b, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 8),
+				 _mm_unpackhi_epi8(b, zero));
+#endif
+	}
+#elif defined(QUIRC_HAVE_NEON)
+	const uint8x16_t one = vdupq_n_u8(QUIRC_PIXEL_BLACK);
+
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t b = vandq_u8(vcltq_u8(vld1q_u8(src + i),
+						 vld1q_u8(threshold + i)), one);
+
+#if !QUIRC_PIXEL_WIDE
+		vst1q_u8(dst + i, b);
+#else
+		vst1q_u16(dst + i, vmovl_u8(vget_low_u8(b)));
+		vst1q_u16(dst + i + 8, vmovl_u8(vget_high_u8(b)));
+#endif
+	}
+#endif
+
+	for (; i < len; i++)
+		dst[i] = (src[i] < threshold[i]) ?
+			QUIRC_PIXEL_BLACK : QUIRC_PIXEL_WHITE;
+}
+
+static void pixels_setup(struct quirc *q, uint8_t threshold)
+{
+	const binarize_func_t binarize = binarize_kernel();
+	int y;
+
+#ifndef QUIRC_BITPLANE
+	if (!q->source) {
+		binarize(q->image, q->pixels, q->w * q->h, threshold);
+		return;
+	}
+#endif
+
+	for (y = 0; y < q->h; y++) {
+		binarize(image_row(q, y), pixels_row(q, y), q->w, threshold);
+		pixels_done(q, y, 0, q->w);
+	}
+}
+
+/* Threshold the image with the level computed for the previous frame,
+ * while gathering the histogram which gives the level for the next one.
+ * The image is processed in blocks small enough to stay in L1 cache, so
+ * it is only read from memory once.
+ */
+#define FUSED_BLOCK_SIZE	4096
+
+static void otsu_fused(struct quirc *q)
+{
+	const binarize_func_t binarize = binarize_kernel();
+	unsigned int numPixels = q->w * q->h;
+	unsigned int histogram[UINT8_MAX + 1];
+	histogram_banks_t banks;
+	int x, y;
+
+	(void)memset(banks, 0, sizeof(banks));
+	for (y = 0; y < q->h; y++) {
+		const uint8_t *src = image_row(q, y);
+		quirc_pixel_t *dst = pixels_row(q, y);
+
+		for (x = 0; x < q->w; x += FUSED_BLOCK_SIZE) {
+			int len = q->w - x;
+
+			if (len > FUSED_BLOCK_SIZE)
+				len = FUSED_BLOCK_SIZE;
+
+			histogram_add(banks, src + x, len);
+			binarize(src + x, dst + x, len, q->threshold);
+		}
+
+		pixels_done(q, y, 0, q->w);
+	}
+
+	histogram_merge(histogram, banks);
+	q->threshold = otsu_threshold(histogram, numPixels, NULL);
+}
+
+/* Tiled Otsu: the image is divided into a grid of tiles, each of which
+ * gets its own Otsu threshold. Each pixel is then compared against a
+ * bilinear blend of the thresholds of the four nearest tile centres.
+ * Tiles with too little contrast to threshold meaningfully borrow from
+ * their neighbours, or fall back to the global threshold.
+ */
+#define TILE_GRID		8
+#define TILE_MIN_SIZE		16
+#define TILE_MIN_CONTRAST	24
+
+static void fill_flat_tiles(int *thresholds, int tw, int th, int global)
+{
+	int changed = 1;
+	int i;
+
+	while (changed) {
+		int x, y;
+
+		changed = 0;
+		for (y = 0; y < th; y++)
+			for (x = 0; x < tw; x++) {
+				int *t = &thresholds[y * tw + x];
+				int sum = 0;
+				int n = 0;
+
+				if (*t >= 0)
+					continue;
+
+				if (x > 0 && t[-1] >= 0) {
+					sum += t[-1];
+					n++;
+				}
+				if (x + 1 < tw && t[1] >= 0) {
+					sum += t[1];
+					n++;
+				}
+				if (y > 0 && t[-tw] >= 0) {
+					sum += t[-tw];
+					n++;
+				}
+				if (y + 1 < th && t[tw] >= 0) {
+					sum += t[tw];
+					n++;
+				}
+
+				if (n) {
+					/* Mark as filled in this pass only,
+					 * so that fills spread evenly.
+					 */
+					*t = -2 - (sum + n / 2) / n;
+					changed = 1;
+				}
+			}
+
+		for (i = 0; i < tw * th; i++)
+			if (thresholds[i] < -1)
+				thresholds[i] = -2 - thresholds[i];
+	}
+
+	for (i = 0; i < tw * th; i++)
+		if (thresholds[i] < 0)
+			thresholds[i] = global;
+}
+
+static void threshold_tiled_otsu(struct quirc *q)
+{
+	int thresholds[TILE_GRID * TILE_GRID];
+	unsigned int global_hist[UINT8_MAX + 1];
+	uint8_t *line = q->threshold_rows;
+	int tile_w = (q->w + TILE_GRID - 1) / TILE_GRID;
+	int tile_h = (q->h + TILE_GRID - 1) / TILE_GRID;
+	int tw, th;
+	int tx, ty;
+	int x, y;
+
+	if (tile_w < TILE_MIN_SIZE)
+		tile_w = TILE_MIN_SIZE;
+	if (tile_h < TILE_MIN_SIZE)
+		tile_h = TILE_MIN_SIZE;
+	tw = (q->w + tile_w - 1) / tile_w;
+	th = (q->h + tile_h - 1) / tile_h;
+
+	/* Threshold each tile, and accumulate the global histogram */
+	(void)memset(global_hist, 0, sizeof(global_hist));
+	for (ty = 0; ty < th; ty++)
+		for (tx = 0; tx < tw; tx++) {
+			const int x0 = tx * tile_w;
+			const int y0 = ty * tile_h;
+			const int w = (x0 + tile_w > q->w) ? q->w - x0 : tile_w;
+			const int h = (y0 + tile_h > q->h) ? q->h - y0 : tile_h;
+			unsigned int histogram[UINT8_MAX + 1];
+			histogram_banks_t banks;
+			quirc_float_t separation;
+			uint8_t t;
+			int i;
+
+			(void)memset(banks, 0, sizeof(banks));
+			for (y = y0; y < y0 + h; y++)
+				histogram_add(banks, image_row(q, y) + x0, w);
+			histogram_merge(histogram, banks);
+
+			for (i = 0; i <= UINT8_MAX; i++)
+				global_hist[i] += histogram[i];
+
+			t = otsu_threshold(histogram, w * h, &separation);
+			thresholds[ty * tw + tx] =
+				(separation < TILE_MIN_CONTRAST) ? -1 : t;
+		}
+
+	fill_flat_tiles(thresholds, tw, th,
+			otsu_threshold(global_hist, q->w * q->h, NULL));
+
+	/* Blend the tile thresholds between tile centres and binarize a
+	 * row at a time. Vertical weights are in 8.8 fixed point, and the
+	 * horizontal ramps in 16.16.
+	 */
+	for (y = 0; y < q->h; y++) {
+		int fy = (y - tile_h / 2) * 256 / tile_h;
+		int column[TILE_GRID];
+		int ty0, ty1, wy;
+
+		if (fy < 0)
+			fy = 0;
+		ty0 = fy >> 8;
+		wy = fy & 0xff;
+		if (ty0 >= th - 1) {
+			ty0 = th - 1;
+			wy = 0;
+		}
+		ty1 = (ty0 + 1 < th) ? ty0 + 1 : ty0;
+
+		for (tx = 0; tx < tw; tx++)
+			column[tx] = (thresholds[ty0 * tw + tx] * (256 - wy) +
+				      thresholds[ty1 * tw + tx] * wy) << 8;
+
+		/* Constant before the first centre and after the last,
+		 * linear in between.
+		 */
+		x = 0;
+		for (tx = 0; tx < tw; tx++) {
+			const int centre = tx * tile_w + tile_w / 2;
+			const int end = (centre < q->w) ? centre : q->w;
+			const int step = (tx + 1 < tw) ?
+				(column[tx + 1] - column[tx]) / tile_w : 0;
+			int acc = column[tx];
+
+			for (; x < end; x++)
+				line[x] = (column[tx] + (1 << 15)) >> 16;
+
+			if (tx + 1 == tw)
+				break;
+
+			for (; x < centre + tile_w && x < q->w; x++) {
+				line[x] = (acc + (1 << 15)) >> 16;
+				acc += step;
+			}
+		}
+		for (; x < q->w; x++)
+			line[x] = (column[tw - 1] + (1 << 15)) >> 16;
+
+		binarize_line(image_row(q, y), pixels_row(q, y), line, q->w);
+		pixels_done(q, y, 0, q->w);
+	}
+}
+
+/* Local mean: each pixel is compared against the mean of a square
+ * window around it, and is black if it is more than 1/8 darker. Window
+ * sums come from a running sum of each column over the rows of the
+ * window, and a prefix sum along the row, so the cost per pixel doesn't
+ * depend on the window size.
+ *
+ * The pixels may alias the image, so the original contents of rows which
+ * have already been binarized are kept in a ring of cached rows until
+ * they leave the window.
+ */
+static void threshold_local_mean(struct quirc *q)
+{
+	const int r = q->threshold_radius;
+	uint32_t *col_sums = q->threshold_sums;
+	uint32_t *prefix = q->threshold_sums + q->w;
+	int x, y;
+
+	(void)memset(col_sums, 0, sizeof(col_sums[0]) * q->w);
+	for (y = 0; y < r && y < q->h; y++) {
+		const uint8_t *row = image_row(q, y);
+
+		for (x = 0; x < q->w; x++)
+			col_sums[x] += row[x];
+	}
+
+	for (y = 0; y < q->h; y++) {
+		const uint8_t *row = image_row(q, y);
+		uint8_t *cached = q->threshold_rows + (y % (r + 1)) * q->w;
+		quirc_pixel_t *dest = pixels_row(q, y);
+		const int y0 = (y > r) ? y - r : 0;
+		const int y1 = (y + r < q->h) ? y + r : q->h - 1;
+		const int rows = y1 - y0 + 1;
+
+		/* Slide the window down: add the new bottom row, and drop
+		 * the row which has just left the top, which is in the slot
+		 * this row's copy will replace.
+		 */
+		if (y + r < q->h && y > r) {
+			const uint8_t *add = image_row(q, y + r);
+
+			for (x = 0; x < q->w; x++)
+				col_sums[x] += add[x] - cached[x];
+		} else if (y + r < q->h) {
+			const uint8_t *add = image_row(q, y + r);
+
+			for (x = 0; x < q->w; x++)
+				col_sums[x] += add[x];
+		} else if (y > r) {
+			for (x = 0; x < q->w; x++)
+				col_sums[x] -= cached[x];
+		}
+
+		memcpy(cached, row, q->w);
+
+		prefix[0] = 0;
+		for (x = 0; x < q->w; x++)
+			prefix[x + 1] = prefix[x] + col_sums[x];
+
+		/* With the radius limited to 128, these products fit in 32
+		 * bits. The window is clipped at the left and right edges,
+		 * and full width in between.
+		 */
+		for (x = 0; x < q->w; x++) {
+			const int x0 = (x > r) ? x - r : 0;
+			const int x1 = (x + r < q->w) ? x + r : q->w - 1;
+			const uint32_t n = rows * (x1 - x0 + 1);
+			const uint32_t sum = prefix[x1 + 1] - prefix[x0];
+
+			if (x > r && x + r < q->w)
+				break;
+
+			dest[x] = (cached[x] * n * 8 < sum * 7) ?
+				QUIRC_PIXEL_BLACK : QUIRC_PIXEL_WHITE;
+		}
+
+		if (x < q->w) {
+			const uint32_t n8 = rows * (2 * r + 1) * 8;
+			const int end = q->w - r;
+
+			for (; x < end; x++) {
+				const uint32_t sum =
+					prefix[x + r + 1] - prefix[x - r];
+
+				dest[x] = (cached[x] * n8 < sum * 7) ?
+					QUIRC_PIXEL_BLACK : QUIRC_PIXEL_WHITE;
+			}
+
+			for (; x < q->w; x++) {
+				const uint32_t n = rows * (q->w - x + r);
+				const uint32_t sum =
+					prefix[q->w] - prefix[x - r];
+
+				dest[x] = (cached[x] * n * 8 < sum * 7) ?
+					QUIRC_PIXEL_BLACK : QUIRC_PIXEL_WHITE;
+			}
+		}
+
+		pixels_done(q, y, 0, q->w);
+	}
+}
+
+/* Whether threshold_image() would use a single threshold found from
+ * the histogram of the whole image.
+ */
+static int threshold_is_global(const struct quirc *q)
+{
+	switch (q->threshold_method) {
+	case QUIRC_THRESHOLD_OTSU_FUSED:
+		return !q->threshold_valid;
+
+	case QUIRC_THRESHOLD_TILED_OTSU:
+	case QUIRC_THRESHOLD_LOCAL_MEAN:
+		return 0;
+
+	default:
+		return 1;
+	}
+}
+
+static void threshold_image(struct quirc *q)
+{
+#ifdef QUIRC_STATS
+	uint64_t start;
+#endif
+
+	pixels_begin(q);
+
+	switch (q->threshold_method) {
+	case QUIRC_THRESHOLD_OTSU_FUSED:
+		if (!q->threshold_valid)
+			break;
+		otsu_fused(q);
+		return;
+
+	case QUIRC_THRESHOLD_TILED_OTSU:
+		threshold_tiled_otsu(q);
+		return;
+
+	case QUIRC_THRESHOLD_LOCAL_MEAN:
+		threshold_local_mean(q);
+		return;
+
+	default:
+		break;
+	}
+
+#ifdef QUIRC_STATS
+	start = quirc_stats_clock();
+#endif
+	q->threshold = otsu(q);
+	q->threshold_valid = 1;
+#ifdef QUIRC_STATS
+	q->stats->otsu_ns += quirc_stats_clock() - start;
+#endif
+	pixels_setup(q, q->threshold);
+}
+
+/************************************************************************
+ * Threaded finder scan
+ *
+ * Each band is searched for 1:1:3:1:1 runs on its own thread. Testing
+ * the candidates involves flood fills which may cross band boundaries,
+ * so that is done afterwards on the calling thread, in the same order
+ * as the serial scan would have done it.
+ */
+
+#ifdef QUIRC_USE_PTHREAD
+static int band_record(void *user_data, unsigned int x, unsigned int y,
+		       unsigned int *pb)
+{
+	struct quirc_scan_band *band = (struct quirc_scan_band *)user_data;
+	struct quirc_finder_candidate *c;
+
+	if (band->count >= QUIRC_BAND_CANDIDATES)
+		return -1;
+
+	c = &band->candidates[band->count++];
+	c->x = x;
+	c->y = y;
+	memcpy(c->pb, pb, sizeof(c->pb));
+
+	return 0;
+}
+
+static void *band_scan(void *arg)
+{
+	struct quirc_scan_band *band = (struct quirc_scan_band *)arg;
+	unsigned int y;
+
+	for (y = band->y_start; y < band->y_end; y++) {
+		const int count = band->count;
+
+		/* Drop this row's partial results and leave it, and the
+		 * rest of the band, for the serial pass.
+		 */
+		if (finder_scan_row(band->q, y, 0, band->q->w,
+				    band_record, band) < 0) {
+			band->count = count;
+			break;
+		}
+	}
+
+	band->resume_y = y;
+	return NULL;
+}
+
+static void finder_scan_threaded(struct quirc *q)
+{
+	pthread_t threads[QUIRC_MAX_THREADS];
+	int started[QUIRC_MAX_THREADS];
+	int num_bands = q->num_threads;
+	int i;
+
+	if (num_bands > q->h)
+		num_bands = q->h;
+
+	for (i = 0; i < num_bands; i++) {
+		struct quirc_scan_band *band = &q->scan_bands[i];
+
+		band->q = q;
+		band->y_start = (unsigned int)((long)q->h * i / num_bands);
+		band->y_end = (unsigned int)((long)q->h * (i + 1) / num_bands);
+		band->count = 0;
+		band->candidates = q->scan_candidates +
+			(size_t)i * QUIRC_BAND_CANDIDATES;
+	}
+
+	/* Band 0 is scanned on this thread, as is any band whose thread
+	 * couldn't be started.
+	 */
+	for (i = 1; i < num_bands; i++)
+		started[i] = !pthread_create(&threads[i], NULL, band_scan,
+					     &q->scan_bands[i]);
+
+	band_scan(&q->scan_bands[0]);
+
+	for (i = 1; i < num_bands; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			band_scan(&q->scan_bands[i]);
+	}
+
+	for (i = 0; i < num_bands; i++) {
+		struct quirc_scan_band *band = &q->scan_bands[i];
+		unsigned int y;
+		int j;
 
-	/* Left and ring of ring should be connected */
-	if (ring_left != ring_right)
-		return;
+		budget_spend(q, (long)(band->resume_y - band->y_start) * q->w);
 
-	/* Ring should be disconnected from stone */
-	if (ring_left == stone)
-		return;
+		for (j = 0; j < band->count; j++) {
+			struct quirc_finder_candidate *c = &band->candidates[j];
 
-	stone_reg = &q->regions[stone];
-	ring_reg = &q->regions[ring_left];
+			test_capstone(q, c->x, c->y, c->pb);
+		}
 
-	/* Already detected */
-	if (stone_reg->capstone >= 0 || ring_reg->capstone >= 0)
-		return;
+		for (y = band->resume_y; y < band->y_end; y++)
+			finder_scan(q, y);
+	}
+}
+#endif
 
-	/* Ratio should ideally be 37.5 */
-	ratio = stone_reg->count * 100 / ring_reg->count;
-	if (ratio < 10 || ratio > 70)
-		return;
+/* Read every module of a grid into a cell bitmap. Each row of modules
+ * is mapped in one go.
+ */
+static void sample_grid(const struct quirc *q, const struct quirc_grid *qr,
+			uint8_t *bitmap)
+{
+	const map_points_func_t map_points = map_points_kernel();
+	quirc_float_t u[QUIRC_MAX_GRID_SIZE];
+	quirc_float_t v[QUIRC_MAX_GRID_SIZE];
+	int px[QUIRC_MAX_GRID_SIZE];
+	int py[QUIRC_MAX_GRID_SIZE];
+	int size = qr->grid_size;
+	int i = 0;
+	int x, y;
 
-	record_capstone(q, ring_left, stone);
+	for (x = 0; x < size; x++)
+		u[x] = x + (quirc_float_t)0.5;
+
+	for (y = 0; y < size; y++) {
+		for (x = 0; x < size; x++)
+			v[x] = y + (quirc_float_t)0.5;
+
+		map_points(qr->c, u, v, 0, size, px, py);
+
+		for (x = 0; x < size; x++, i++) {
+			if (py[x] < 0 || py[x] >= q->h ||
+			    px[x] < 0 || px[x] >= q->w)
+				continue;
+
+			if (pixel_at(q, px[x], py[x]))
+				bitmap[i >> 3] |= 1 << (i & 7);
+		}
+	}
 }
 
-static void finder_scan(struct quirc *q, unsigned int y)
+/************************************************************************
+ * Regions of interest
+ *
+ * Only the windows are thresholded and scanned, each with its own Otsu
+ * level. Everything outside them is set to white, so that flood fills
+ * and cell sampling which stray outside see background.
+ */
+
+static int rects_overlap(const struct quirc_rect *a,
+			 const struct quirc_rect *b)
 {
-	quirc_pixel_t *row = q->pixels + y * q->w;
-	unsigned int x;
-	int last_color = 0;
-	unsigned int run_length = 0;
-	unsigned int run_count = 0;
-	unsigned int pb[5];
+	/* Windows which touch are merged too, so that the pixels either
+	 * side of a window are always white.
+	 */
+	return a->x <= b->x + b->w && b->x <= a->x + a->w &&
+	       a->y <= b->y + b->h && b->y <= a->y + a->h;
+}
 
-	memset(pb, 0, sizeof(pb));
-	for (x = 0; x < q->w; x++) {
-		int color = row[x] ? 1 : 0;
+/* Merge the first pair of overlapping windows found. Returns 1 if a
+ * pair was merged, or 0 if the windows are disjoint.
+ */
+static int merge_windows(struct quirc_rect *windows, int *num_windows)
+{
+	int i, j;
 
-		if (x && color != last_color) {
-			memmove(pb, pb + 1, sizeof(pb[0]) * 4);
-			pb[4] = run_length;
-			run_length = 0;
-			run_count++;
+	for (i = 0; i < *num_windows; i++)
+		for (j = i + 1; j < *num_windows; j++) {
+			struct quirc_rect *a = &windows[i];
+			const struct quirc_rect *b = &windows[j];
+			int x1, y1;
+
+			if (!rects_overlap(a, b))
+				continue;
+
+			x1 = (a->x + a->w > b->x + b->w) ?
+				a->x + a->w : b->x + b->w;
+			y1 = (a->y + a->h > b->y + b->h) ?
+				a->y + a->h : b->y + b->h;
+			if (b->x < a->x)
+				a->x = b->x;
+			if (b->y < a->y)
+				a->y = b->y;
+			a->w = x1 - a->x;
+			a->h = y1 - a->y;
+
+			windows[j] = windows[--*num_windows];
+			return 1;
+		}
 
-			if (!color && run_count >= 5) {
-				const int scale = 16;
-				static const unsigned int check[5] = {1, 1, 3, 1, 1};
-				unsigned int avg, err;
-				unsigned int i;
-				int ok = 1;
+	return 0;
+}
 
-				avg = (pb[0] + pb[1] + pb[3] + pb[4]) * scale / 4;
-				err = avg * 3 / 4;
+/* Clip the rectangles to the image, and merge any which overlap, so
+ * that each pixel belongs to at most one window. Returns the number of
+ * windows.
+ */
+static int windows_setup(const struct quirc *q,
+			 const struct quirc_rect *rects, int count,
+			 struct quirc_rect *windows)
+{
+	int num_windows = 0;
+	int i;
 
-				for (i = 0; i < 5; i++)
-					if (pb[i] * scale < check[i] * avg - err ||
-					    pb[i] * scale > check[i] * avg + err)
-						ok = 0;
+	for (i = 0; i < count; i++) {
+		struct quirc_rect r = rects[i];
 
-				if (ok)
-					test_capstone(q, x, y, pb);
-			}
+		if (r.x < 0) {
+			r.w += r.x;
+			r.x = 0;
 		}
+		if (r.y < 0) {
+			r.h += r.y;
+			r.y = 0;
+		}
+		if (r.x + r.w > q->w)
+			r.w = q->w - r.x;
+		if (r.y + r.h > q->h)
+			r.h = q->h - r.y;
 
-		run_length++;
-		last_color = color;
+		if (r.w > 0 && r.h > 0)
+			windows[num_windows++] = r;
 	}
+
+	while (merge_windows(windows, &num_windows))
+		;
+
+	return num_windows;
 }
 
-static void find_alignment_pattern(struct quirc *q, int index)
+static void threshold_window(struct quirc *q, const struct quirc_rect *r)
 {
-	struct quirc_grid *qr = &q->grids[index];
-	struct quirc_capstone *c0 = &q->capstones[qr->caps[0]];
-	struct quirc_capstone *c2 = &q->capstones[qr->caps[2]];
-	struct quirc_point a;
-	struct quirc_point b;
-	struct quirc_point c;
-	int size_estimate;
-	int step_size = 1;
-	int dir = 0;
-	quirc_float_t u, v;
+	const binarize_func_t binarize = binarize_kernel();
+	unsigned int histogram[UINT8_MAX + 1];
+	histogram_banks_t banks;
+	uint8_t threshold;
+	int y;
 
-	/* Grab our previous estimate of the alignment pattern corner */
-	memcpy(&b, &qr->align, sizeof(b));
+	(void)memset(banks, 0, sizeof(banks));
+	for (y = r->y; y < r->y + r->h; y++)
+		histogram_add(banks, image_row(q, y) + r->x, r->w);
+	histogram_merge(histogram, banks);
 
-	/* Guess another two corners of the alignment pattern so that we
-	 * can estimate its size.
-	 */
-	perspective_unmap(c0->c, &b, &u, &v);
-	perspective_map(c0->c, u, v + (quirc_float_t)1.0, &a);
-	perspective_unmap(c2->c, &b, &u, &v);
-	perspective_map(c2->c, u + (quirc_float_t)1.0, v, &c);
+	threshold = otsu_threshold(histogram, r->w * r->h, NULL);
 
-	size_estimate = abs((a.x - b.x) * -(c.y - b.y) +
-			    (a.y - b.y) * (c.x - b.x));
+	for (y = r->y; y < r->y + r->h; y++) {
+		binarize(image_row(q, y) + r->x, pixels_row(q, y) + r->x,
+			 r->w, threshold);
+		pixels_done(q, y, r->x, r->w);
+	}
+}
 
-	/* Spiral outwards from the estimate point until we find something
-	 * roughly the right size. Don't look too far from the estimate
-	 * point.
-	 */
-	while (step_size * step_size < size_estimate * 100) {
-		static const int dx_map[] = {1, 0, -1, 0};
-		static const int dy_map[] = {0, -1, 0, 1};
-		int i;
+static void threshold_windows(struct quirc *q,
+			      const struct quirc_rect *windows,
+			      int num_windows)
+{
+	int i;
+#ifndef QUIRC_BITPLANE
+	int y;
+#endif
 
-		for (i = 0; i < step_size; i++) {
-			int code = region_code(q, b.x, b.y);
+	pixels_begin(q);
+	for (i = 0; i < num_windows; i++)
+		threshold_window(q, &windows[i]);
 
-			if (code >= 0) {
-				struct quirc_region *reg = &q->regions[code];
+#ifndef QUIRC_BITPLANE
+	/* Clear the gaps between windows, one row at a time */
+	for (y = 0; y < q->h; y++) {
+		quirc_pixel_t *row = q->pixels + y * q->w;
+		int x = 0;
 
-				if (reg->count >= size_estimate / 2 &&
-				    reg->count <= size_estimate * 2) {
-					qr->align_region = code;
-					return;
+		for (;;) {
+			int next = q->w;
+			int end = q->w;
+
+			for (i = 0; i < num_windows; i++) {
+				const struct quirc_rect *r = &windows[i];
+
+				if (y >= r->y && y < r->y + r->h &&
+				    r->x >= x && r->x < next) {
+					next = r->x;
+					end = r->x + r->w;
 				}
 			}
 
-			b.x += dx_map[dir];
-			b.y += dy_map[dir];
-		}
+			memset(row + x, 0, sizeof(row[0]) * (next - x));
+			if (next >= q->w)
+				break;
 
-		dir = (dir + 1) % 4;
-		if (!(dir & 1))
-			step_size++;
+			x = end;
+		}
 	}
+#endif
 }
 
-static void find_leftmost_to_line(void *user_data, int y, int left, int right)
+/* Scan the parts of a row within the windows, from left to right */
+static void finder_scan_windows(struct quirc *q, int y,
+				const struct quirc_rect *windows,
+				int num_windows)
 {
-	struct polygon_score_data *psd =
-		(struct polygon_score_data *)user_data;
-	int xs[2] = {left, right};
-	int i;
+	int x = 0;
 
-	for (i = 0; i < 2; i++) {
-		int d = -psd->ref.y * xs[i] + psd->ref.x * y;
+	for (;;) {
+		const struct quirc_rect *next = NULL;
+		int i;
 
-		if (d < psd->scores[0]) {
-			psd->scores[0] = d;
-			psd->corners[0].x = xs[i];
-			psd->corners[0].y = y;
+		for (i = 0; i < num_windows; i++) {
+			const struct quirc_rect *r = &windows[i];
+
+			if (y >= r->y && y < r->y + r->h &&
+			    r->x >= x && (!next || r->x < next->x))
+				next = r;
 		}
+
+		if (!next)
+			break;
+
+		runs_need(q, y);
+		finder_scan_row(q, y, next->x, next->x + next->w,
+				finder_test, q);
+		budget_spend(q, next->w);
+		x = next->x + next->w;
 	}
 }
 
-static quirc_float_t length(struct quirc_point a, struct quirc_point b)
-{
-	quirc_float_t x = abs(a.x - b.x) + 1;
-	quirc_float_t y = abs(a.y - b.y) + 1;
-	return sqrt(x * x +  y * y);
-}
-/* Estimate grid size by determing distance between capstones
+/* Find the bounding box of a code, scaled up by 2^level, and expanded
+ * by its size divided by spread in each direction.
  */
-static void measure_grid_size(struct quirc *q, int index)
+static void grid_window(const struct quirc_grid *qr, int level, int spread,
+			struct quirc_rect *r)
 {
-	struct quirc_grid *qr = &q->grids[index];
+	struct quirc_point p[4];
+	int x0, y0, x1, y1;
+	int margin;
+	int j;
 
-	struct quirc_capstone *a = &(q->capstones[qr->caps[0]]);
-	struct quirc_capstone *b = &(q->capstones[qr->caps[1]]);
-	struct quirc_capstone *c = &(q->capstones[qr->caps[2]]);
+	perspective_map(qr->c, 0.0, 0.0, &p[0]);
+	perspective_map(qr->c, qr->grid_size, 0.0, &p[1]);
+	perspective_map(qr->c, qr->grid_size, qr->grid_size, &p[2]);
+	perspective_map(qr->c, 0.0, qr->grid_size, &p[3]);
+
+	x0 = x1 = p[0].x;
+	y0 = y1 = p[0].y;
+	for (j = 1; j < 4; j++) {
+		if (p[j].x < x0)
+			x0 = p[j].x;
+		if (p[j].x > x1)
+			x1 = p[j].x;
+		if (p[j].y < y0)
+			y0 = p[j].y;
+		if (p[j].y > y1)
+			y1 = p[j].y;
+	}
 
-	quirc_float_t ab = length(b->corners[0], a->corners[3]);
-	quirc_float_t capstone_ab_size = (length(b->corners[0], b->corners[3]) + length(a->corners[0], a->corners[3]))/2.0;
-	quirc_float_t ver_grid = (quirc_float_t)7.0 * ab / capstone_ab_size;
+	x0 *= 1 << level;
+	y0 *= 1 << level;
+	x1 = (x1 + 1) * (1 << level) - 1;
+	y1 = (y1 + 1) * (1 << level) - 1;
 
-	quirc_float_t bc = length(b->corners[0], c->corners[1]);
-	quirc_float_t capstone_bc_size = (length(b->corners[0], b->corners[1]) + length(c->corners[0], c->corners[1]))/2.0;
-	quirc_float_t hor_grid = (quirc_float_t)7.0 * bc / capstone_bc_size;
+	margin = ((x1 - x0 > y1 - y0) ? x1 - x0 : y1 - y0) / spread;
+	r->x = x0 - margin;
+	r->y = y0 - margin;
+	r->w = x1 - x0 + 1 + margin * 2;
+	r->h = y1 - y0 + 1 + margin * 2;
+}
 
-	quirc_float_t grid_size_estimate = (ver_grid + hor_grid) * (quirc_float_t)(0.5);
+/* Remember a window around each code found, expanded by half its size
+ * in each direction to allow for movement.
+ */
+static void track_grids(struct quirc *q)
+{
+	int i;
 
-	int ver = (int)((grid_size_estimate - (quirc_float_t)(17.0 - 2.0)) * (quirc_float_t)(1./4));
+	q->num_track_windows = 0;
+	if (q->num_grids > QUIRC_MAX_ROI)
+		return;
 
-	qr->grid_size =  4*ver + 17;
+	for (i = 0; i < q->num_grids; i++)
+		grid_window(&q->grids[i], 0, 2, &q->track_windows[i]);
+
+	q->num_track_windows = q->num_grids;
 }
 
-/* Read a cell from a grid using the currently set perspective
- * transform. Returns +/- 1 for black/white, 0 for cells which are
- * out of image bounds.
+/************************************************************************
+ * Image pyramid
+ *
+ * Each level of the pyramid is held by a decoder of its own, with an
+ * image half the width and height of the one above it. Codes are first
+ * searched for at the chosen level, and the full image is then only
+ * processed within windows around the codes found there.
  */
-static int read_cell(const struct quirc *q, int index, int x, int y)
-{
-	const struct quirc_grid *qr = &q->grids[index];
-	struct quirc_point p;
 
-	perspective_map(qr->c, x + (quirc_float_t)0.5, y + (quirc_float_t)0.5, &p);
-	if (p.y < 0 || p.y >= q->h || p.x < 0 || p.x >= q->w)
-		return 0;
+typedef void (*reduce_func_t)(const uint8_t *row0, const uint8_t *row1,
+			      uint8_t *dst, int len);
+
+/* Average each 2x2 block of a pair of rows, rounding to nearest */
+static void reduce_scalar(const uint8_t *row0, const uint8_t *row1,
+			  uint8_t *dst, int len)
+{
+	int i;
 
-	return q->pixels[p.y * q->w + p.x] ? 1 : -1;
+	for (i = 0; i < len; i++)
+		dst[i] = (row0[i * 2] + row0[i * 2 + 1] +
+			  row1[i * 2] + row1[i * 2 + 1] + 2) >> 2;
 }
 
-static int fitness_cell(const struct quirc *q, int index, int x, int y)
+#ifdef QUIRC_HAVE_SSE2
+static inline __m128i reduce_sum_sse2(const uint8_t *row0,
+				      const uint8_t *row1)
 {
-	const struct quirc_grid *qr = &q->grids[index];
-	int score = 0;
-	int u, v;
+	const __m128i even = _mm_set1_epi16(0xff);
+	__m128i a = _mm_loadu_si128((const __m128i *)row0);
+	__m128i b = _mm_loadu_si128((const __m128i *)row1);
 
-	for (v = 0; v < 3; v++)
-		for (u = 0; u < 3; u++) {
-			static const quirc_float_t offsets[] = {0.3, 0.5, 0.7};
-			struct quirc_point p;
+	return _mm_add_epi16(
+		_mm_add_epi16(_mm_and_si128(a, even), _mm_srli_epi16(a, 8)),
+		_mm_add_epi16(_mm_and_si128(b, even), _mm_srli_epi16(b, 8)));
+}
 
-			perspective_map(qr->c, x + offsets[u],
-					       y + offsets[v], &p);
-			if (p.y < 0 || p.y >= q->h || p.x < 0 || p.x >= q->w)
-				continue;
+static void reduce_sse2(const uint8_t *row0, const uint8_t *row1,
+			uint8_t *dst, int len)
+{
+	const __m128i two = _mm_set1_epi16(2);
+	int i;
 
-			if (q->pixels[p.y * q->w + p.x])
-				score++;
-			else
-				score--;
-		}
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i lo = reduce_sum_sse2(row0 + i * 2, row1 + i * 2);
+		__m128i hi = reduce_sum_sse2(row0 + i * 2 + 16,
+					     row1 + i * 2 + 16);
 
-	return score;
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_packus_epi16(lo, hi));
+	}
+
+	reduce_scalar(row0 + i * 2, row1 + i * 2, dst + i, len - i);
 }
+#endif
 
-static int fitness_ring(const struct quirc *q, int index, int cx, int cy,
-			int radius)
+#ifdef QUIRC_HAVE_NEON
+static void reduce_neon(const uint8_t *row0, const uint8_t *row1,
+			uint8_t *dst, int len)
 {
 	int i;
-	int score = 0;
 
-	for (i = 0; i < radius * 2; i++) {
-		score += fitness_cell(q, index, cx - radius + i, cy - radius);
-		score += fitness_cell(q, index, cx - radius, cy + radius - i);
-		score += fitness_cell(q, index, cx + radius, cy - radius + i);
-		score += fitness_cell(q, index, cx + radius - i, cy + radius);
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint16x8_t sum = vpaddlq_u8(vld1q_u8(row0 + i * 2));
+
+		sum = vpadalq_u8(sum, vld1q_u8(row1 + i * 2));
+		vst1_u8(dst + i, vrshrn_n_u16(sum, 2));
 	}
 
-	return score;
+	reduce_scalar(row0 + i * 2, row1 + i * 2, dst + i, len - i);
 }
+#endif
 
-static int fitness_apat(const struct quirc *q, int index, int cx, int cy)
+static reduce_func_t reduce_kernel(void)
 {
-	return fitness_cell(q, index, cx, cy) -
-		fitness_ring(q, index, cx, cy, 1) +
-		fitness_ring(q, index, cx, cy, 2);
+#if defined(QUIRC_HAVE_SSE2)
+	return reduce_sse2;
+#elif defined(QUIRC_HAVE_NEON)
+	return reduce_neon;
+#else
+	return reduce_scalar;
+#endif
 }
 
-static int fitness_capstone(const struct quirc *q, int index, int x, int y)
+/* Fill the image of one level from the one above it. The last row and
+ * column of images with an odd size are dropped.
+ */
+static void pyramid_reduce(const struct quirc *src, struct quirc *dst)
 {
-	x += 3;
-	y += 3;
+	const reduce_func_t reduce = reduce_kernel();
+	uint8_t *image = quirc_begin(dst, NULL, NULL);
+	int y;
 
-	return fitness_cell(q, index, x, y) +
-		fitness_ring(q, index, x, y, 1) -
-		fitness_ring(q, index, x, y, 2) +
-		fitness_ring(q, index, x, y, 3);
+	for (y = 0; y < dst->h; y++)
+		reduce(image_row(src, y * 2), image_row(src, y * 2 + 1),
+		       image + (size_t)y * dst->w, dst->w);
 }
 
-/* Compute a fitness score for the currently configured perspective
- * transform, using the features we expect to find by scanning the
- * grid.
+/* Reduce the image for each level of the pyramid down to the one
+ * chosen. Returns the decoder of that level, or NULL if the pyramid
+ * isn't in use.
  */
-static int fitness_all(const struct quirc *q, int index)
+static struct quirc *pyramid_begin(struct quirc *q)
 {
-	const struct quirc_grid *qr = &q->grids[index];
-	int version = (qr->grid_size - 17) / 4;
-	const struct quirc_version_info *info = &quirc_version_db[version];
-	int score = 0;
-	int i, j;
-	int ap_count;
+	const struct quirc *src = q;
+	struct quirc *coarse = NULL;
+	int i;
 
-	/* Check the timing pattern */
-	for (i = 0; i < qr->grid_size - 14; i++) {
-		int expect = (i & 1) ? 1 : -1;
+	for (i = 0; i < q->pyramid_level; i++) {
+		coarse = q->pyramid[i];
+		if (!coarse->w || !coarse->h ||
+		    coarse->w != src->w / 2 || coarse->h != src->h / 2)
+			return NULL;
 
-		score += fitness_cell(q, index, i + 7, 6) * expect;
-		score += fitness_cell(q, index, 6, i + 7) * expect;
+		pyramid_reduce(src, coarse);
+		src = coarse;
 	}
 
-	/* Check capstones */
-	score += fitness_capstone(q, index, 0, 0);
-	score += fitness_capstone(q, index, qr->grid_size - 7, 0);
-	score += fitness_capstone(q, index, 0, qr->grid_size - 7);
+	return coarse;
+}
 
-	if (version < 0 || version > QUIRC_MAX_VERSION)
-		return score;
+/* After the coarse level has been searched, set up windows around the
+ * codes found there in the full image. Returns the number of windows,
+ * or -1 if the whole image should be processed instead.
+ */
+static int pyramid_windows(struct quirc *q, const struct quirc *coarse,
+			   struct quirc_rect *windows)
+{
+	struct quirc_rect rects[QUIRC_MAX_ROI];
+	int i;
 
-	/* Check alignment patterns */
-	ap_count = 0;
-	while ((ap_count < QUIRC_MAX_ALIGNMENT) && info->apat[ap_count])
-		ap_count++;
+	if (!coarse->num_grids || coarse->num_grids > QUIRC_MAX_ROI)
+		return -1;
 
-	for (i = 1; i + 1 < ap_count; i++) {
-		score += fitness_apat(q, index, 6, info->apat[i]);
-		score += fitness_apat(q, index, info->apat[i], 6);
+	/* Codes are found fairly precisely at the coarse level, so the
+	 * windows only need to allow for their quiet zones.
+	 */
+	for (i = 0; i < coarse->num_grids; i++)
+		grid_window(&coarse->grids[i], q->pyramid_level, 4, &rects[i]);
+
+	return windows_setup(q, rects, coarse->num_grids, windows);
+}
+
+/* Choose the pyramid level for the next image: the highest at which
+ * the modules of every code found in this one would still be at least
+ * QUIRC_PYRAMID_MODULE pixels across. If no codes were found, the
+ * level is left as it is.
+ */
+static void pyramid_update(struct quirc *q)
+{
+	quirc_float_t module = 0;
+	int level;
+	int i;
+
+	for (i = 0; i < q->num_grids; i++) {
+		const struct quirc_grid *qr = &q->grids[i];
+		struct quirc_point p[3];
+		quirc_float_t m;
+
+		perspective_map(qr->c, 0.0, 0.0, &p[0]);
+		perspective_map(qr->c, qr->grid_size, 0.0, &p[1]);
+		perspective_map(qr->c, 0.0, qr->grid_size, &p[2]);
+
+		m = length(p[0], p[1]);
+		if (length(p[0], p[2]) < m)
+			m = length(p[0], p[2]);
+		m /= qr->grid_size;
+
+		if (!i || m < module)
+			module = m;
 	}
 
-	for (i = 1; i < ap_count; i++)
-		for (j = 1; j < ap_count; j++)
-			score += fitness_apat(q, index,
-					info->apat[i], info->apat[j]);
+	if (!q->num_grids)
+		return;
+
+	for (level = q->pyramid_levels; level > 0; level--)
+		if (module >= QUIRC_PYRAMID_MODULE * (1 << level))
+			break;
+
+	q->pyramid_level = level;
+}
+
+uint8_t *quirc_begin(struct quirc *q, int *w, int *h)
+{
+	q->source = NULL;
+	q->num_regions = QUIRC_PIXEL_REGION;
+	q->num_capstones = 0;
+	q->num_grids = 0;
+	q->limits_reached = 0;
+	q->step = QUIRC_STEP_START;
+	q->work_done = 0;
+#ifdef QUIRC_STATS
+	memset(q->stats, 0, sizeof(*q->stats));
+#endif
+
+	if (w)
+		*w = q->w;
+	if (h)
+		*h = q->h;
+
+	return q->image;
+}
+
+int quirc_set_image(struct quirc *q, const uint8_t *image,
+		    int w, int h, int stride)
+{
+	if (!image || stride < w)
+		return -1;
+
+	if ((q->w != w || q->h != h) && quirc_resize(q, w, h) < 0)
+		return -1;
+
+	quirc_begin(q, NULL, NULL);
+	q->source = image;
+	q->source_stride = stride;
+
+	return 0;
+}
+
+/************************************************************************
+ * Detection stages
+ *
+ * quirc_step() works through the stages of detection in order, doing
+ * one band of rows of thresholding, one row of the finder scan or one
+ * grid at a time, so that it can stop between them once its budget has
+ * run out and carry on from there when next called.
+ */
 
-	return score;
+#ifdef QUIRC_STATS
+/* Grids may be refined and extracted, and a threshold chosen, within
+ * other stages, and that time is counted separately.
+ */
+static uint64_t stats_nested(const struct quirc *q)
+{
+	return q->stats->otsu_ns + q->stats->jiggle_ns + q->stats->extract_ns;
 }
 
-static void jiggle_perspective(struct quirc *q, int index)
+static void stats_step(struct quirc *q, quirc_step_t step, uint64_t start)
 {
-	struct quirc_grid *qr = &q->grids[index];
-	int best = fitness_all(q, index);
-	int pass;
-	quirc_float_t adjustments[8];
-	int i;
+	const uint64_t t = quirc_stats_clock() - stats_nested(q) - start;
 
-	for (i = 0; i < 8; i++)
-		adjustments[i] = qr->c[i] * (quirc_float_t)0.02;
-
-	for (pass = 0; pass < 5; pass++) {
-		for (i = 0; i < 16; i++) {
-			int j = i >> 1;
-			int test;
-			quirc_float_t old = qr->c[j];
-			quirc_float_t step = adjustments[j];
-			quirc_float_t new;
+	switch (step) {
+	case QUIRC_STEP_HISTOGRAM:
+		q->stats->otsu_ns += t;
+		break;
 
-			if (i & 1)
-				new = old + step;
-			else
-				new = old - step;
+	case QUIRC_STEP_THRESHOLD:
+	case QUIRC_STEP_BINARIZE:
+		q->stats->binarize_ns += t;
+		break;
 
-			qr->c[j] = new;
-			test = fitness_all(q, index);
+	case QUIRC_STEP_SCAN:
+		q->stats->finder_scan_ns += t;
+		break;
 
-			if (test > best)
-				best = test;
-			else
-				qr->c[j] = old;
-		}
+	case QUIRC_STEP_GROUP:
+	case QUIRC_STEP_RECORD:
+		q->stats->grouping_ns += t;
+		break;
 
-		for (i = 0; i < 8; i++)
-			adjustments[i] *= 0.5;
+	default:
+		break;
 	}
 }
 
-/* Once the capstones are in place and an alignment point has been
- * chosen, we call this function to set up a grid-reading perspective
- * transform.
- */
-static void setup_qr_perspective(struct quirc *q, int index)
+static void stats_merge(struct quirc_stats *dst, const struct quirc_stats *src)
 {
-	struct quirc_grid *qr = &q->grids[index];
-	struct quirc_point rect[4];
-
-	/* Set up the perspective map for reading the grid */
-	memcpy(&rect[0], &q->capstones[qr->caps[1]].corners[0],
-	       sizeof(rect[0]));
-	memcpy(&rect[1], &q->capstones[qr->caps[2]].corners[0],
-	       sizeof(rect[0]));
-	memcpy(&rect[2], &qr->align, sizeof(rect[0]));
-	memcpy(&rect[3], &q->capstones[qr->caps[0]].corners[0],
-	       sizeof(rect[0]));
-	perspective_setup(qr->c, rect, qr->grid_size - 7, qr->grid_size - 7);
-
-	jiggle_perspective(q, index);
+	dst->otsu_ns += src->otsu_ns;
+	dst->binarize_ns += src->binarize_ns;
+	dst->finder_scan_ns += src->finder_scan_ns;
+	dst->grouping_ns += src->grouping_ns;
+	dst->jiggle_ns += src->jiggle_ns;
+	dst->extract_ns += src->extract_ns;
+	dst->regions += src->regions;
+	dst->region_exhaustions += src->region_exhaustions;
+	dst->flood_fill_spans += src->flood_fill_spans;
+	if (src->flood_fill_max_depth > dst->flood_fill_max_depth)
+		dst->flood_fill_max_depth = src->flood_fill_max_depth;
+	dst->flood_fill_overflows += src->flood_fill_overflows;
+	dst->capstones += src->capstones;
+	dst->grids += src->grids;
+	dst->fitness_evaluations += src->fitness_evaluations;
 }
+#endif
 
-/* Rotate the capstone with so that corner 0 is the leftmost with respect
- * to the given reference line.
+/* Choose the windows of the image to process, if any, and reduce the
+ * image for a coarse pass first if the pyramid is in use.
  */
-static void rotate_capstone(struct quirc_capstone *cap,
-			    const struct quirc_point *h0,
-			    const struct quirc_point *hd)
+static void step_start(struct quirc *q)
 {
-	struct quirc_point copy[4];
-	int j;
-	int best = 0;
-	int best_score = INT_MAX;
+	q->step = QUIRC_STEP_THRESHOLD;
+	q->step_num_windows = -1;
+
+	if (q->num_roi) {
+		q->step_num_windows = windows_setup(q, q->roi, q->num_roi,
+						    q->step_windows);
+	} else if (q->track_interval && q->num_track_windows &&
+		   q->track_frames < q->track_interval) {
+		q->step_num_windows = windows_setup(q, q->track_windows,
+						    q->num_track_windows,
+						    q->step_windows);
+		q->track_frames++;
+	} else {
+		q->track_frames = 0;
+		if (pyramid_begin(q))
+			q->step = QUIRC_STEP_COARSE;
+	}
+}
 
-	for (j = 0; j < 4; j++) {
-		struct quirc_point *p = &cap->corners[j];
-		int score = (p->x - h0->x) * -hd->y +
-			(p->y - h0->y) * hd->x;
+/* Step the coarse pass, whose work counts towards this one's budget */
+static void step_coarse(struct quirc *q)
+{
+	struct quirc *coarse = q->pyramid[q->pyramid_level - 1];
+	const long work_done = coarse->work_done;
+	int finished;
+
+	finished = quirc_step(coarse, q->work_budget ?
+			      q->work_budget - q->work_done : 0);
+	budget_spend(q, coarse->work_done - work_done);
+
+	if (finished) {
+#ifdef QUIRC_STATS
+		stats_merge(q->stats, coarse->stats);
+#endif
+		q->step_num_windows = pyramid_windows(q, coarse,
+						      q->step_windows);
+		q->step = QUIRC_STEP_THRESHOLD;
+	}
+}
 
-		if (!j || score < best_score) {
-			best = j;
-			best_score = score;
-		}
+/* Once the pixels have been thresholded, find runs if they're used,
+ * and start the finder scan.
+ */
+static void step_thresholded(struct quirc *q)
+{
+	q->runs_valid = 0;
+	if (q->region_method == QUIRC_REGIONS_RUNS) {
+		q->runs_valid = !runs_setup(q);
+		if (!q->runs_valid)
+			q->limits_reached |= QUIRC_LIMIT_RUNS;
+		budget_spend(q, (long)q->w * q->h);
 	}
 
-	/* Rotate the capstone */
-	for (j = 0; j < 4; j++)
-		memcpy(&copy[j], &cap->corners[(j + best) % 4],
-		       sizeof(copy[j]));
-	memcpy(cap->corners, copy, sizeof(cap->corners));
-	perspective_setup(cap->c, cap->corners, 7.0, 7.0);
+	q->step_row = 0;
+	q->step = QUIRC_STEP_SCAN;
 }
 
-static void record_qr_grid(struct quirc *q, int a, int b, int c)
+/* Threshold the image. With a budget, a single threshold for the whole
+ * image is found and applied a band of rows at a time; otherwise, and
+ * for other methods, the image is thresholded in one go.
+ */
+static void step_threshold(struct quirc *q)
 {
-	struct quirc_point h0, hd;
 	int i;
-	int qr_index;
-	struct quirc_grid *qr;
 
-	if (q->num_grids >= QUIRC_MAX_GRIDS)
+	if (q->work_budget && q->step_num_windows < 0 &&
+	    threshold_is_global(q)) {
+		pixels_begin(q);
+		memset(q->step_histogram, 0, sizeof(q->step_histogram));
+		q->step_row = 0;
+		q->step = QUIRC_STEP_HISTOGRAM;
 		return;
+	}
 
-	/* Construct the hypotenuse line from A to C. B should be to
-	 * the left of this line.
-	 */
-	memcpy(&h0, &q->capstones[a].center, sizeof(h0));
-	hd.x = q->capstones[c].center.x - q->capstones[a].center.x;
-	hd.y = q->capstones[c].center.y - q->capstones[a].center.y;
-
-	/* Make sure A-B-C is clockwise */
-	if ((q->capstones[b].center.x - h0.x) * -hd.y +
-	    (q->capstones[b].center.y - h0.y) * hd.x > 0) {
-		int swap = a;
-
-		a = c;
-		c = swap;
-		hd.x = -hd.x;
-		hd.y = -hd.y;
+	if (q->step_num_windows >= 0) {
+		threshold_windows(q, q->step_windows, q->step_num_windows);
+		for (i = 0; i < q->step_num_windows; i++)
+			budget_spend(q, (long)q->step_windows[i].w *
+				     q->step_windows[i].h);
+	} else {
+		threshold_image(q);
+		budget_spend(q, (long)q->w * q->h);
 	}
 
-	/* Record the grid and its components */
-	qr_index = q->num_grids;
-	qr = &q->grids[q->num_grids++];
+	step_thresholded(q);
+}
 
-	memset(qr, 0, sizeof(*qr));
-	qr->caps[0] = a;
-	qr->caps[1] = b;
-	qr->caps[2] = c;
-	qr->align_region = -1;
+/* Rows are binarized, and added to the histogram, this many pixels at
+ * a time.
+ */
+#define STEP_BAND_PIXELS	65536
 
-	/* Rotate each capstone so that corner 0 is top-left with respect
-	 * to the grid.
-	 */
-	for (i = 0; i < 3; i++) {
-		struct quirc_capstone *cap = &q->capstones[qr->caps[i]];
+static int step_band_end(const struct quirc *q)
+{
+	int end = q->w ? q->step_row + STEP_BAND_PIXELS / q->w : q->h;
 
-		rotate_capstone(cap, &h0, &hd);
-		cap->qr_grid = qr_index;
-	}
+	if (end <= q->step_row)
+		end = q->step_row + 1;
+	if (end > q->h)
+		end = q->h;
 
-	/* Check the timing pattern by measuring grid size. This doesn't require a perspective
-	 * transform.
-	 */
-	measure_grid_size(q, qr_index);
-	/* Make an estimate based for the alignment pattern based on extending
-	 * lines from capstones A and C.
-	 */
-	if (!line_intersect(&q->capstones[a].corners[0],
-			    &q->capstones[a].corners[1],
-			    &q->capstones[c].corners[0],
-			    &q->capstones[c].corners[3],
-			    &qr->align))
-		goto fail;
+	return end;
+}
 
-	/* On V2+ grids, we should use the alignment pattern. */
-	if (qr->grid_size > 21) {
-		/* Try to find the actual location of the alignment pattern. */
-		find_alignment_pattern(q, qr_index);
+static void step_histogram(struct quirc *q)
+{
+	const int end = step_band_end(q);
+	histogram_banks_t banks;
+	unsigned int histogram[UINT8_MAX + 1];
+	int i;
 
-		/* Find the point of the alignment pattern closest to the
-		 * top-left of the QR grid.
-		 */
-		if (qr->align_region >= 0) {
-			struct polygon_score_data psd;
-			struct quirc_region *reg =
-				&q->regions[qr->align_region];
+	budget_spend(q, (long)(end - q->step_row) * q->w);
+	(void)memset(banks, 0, sizeof(banks));
+	for (; q->step_row < end; q->step_row++)
+		histogram_add(banks, image_row(q, q->step_row), q->w);
+	histogram_merge(histogram, banks);
+
+	for (i = 0; i <= UINT8_MAX; i++)
+		q->step_histogram[i] += histogram[i];
+
+	if (q->step_row >= q->h) {
+		q->threshold = otsu_threshold(q->step_histogram,
+					      q->w * q->h, NULL);
+		q->threshold_valid = 1;
+		q->step_row = 0;
+		q->step = QUIRC_STEP_BINARIZE;
+	}
+}
 
-			/* Start from some point inside the alignment pattern */
-			memcpy(&qr->align, &reg->seed, sizeof(qr->align));
+static void step_binarize(struct quirc *q)
+{
+	const binarize_func_t binarize = binarize_kernel();
+	const int end = step_band_end(q);
+
+	budget_spend(q, (long)(end - q->step_row) * q->w);
+	for (; q->step_row < end; q->step_row++) {
+		binarize(image_row(q, q->step_row),
+			 pixels_row(q, q->step_row), q->w, q->threshold);
+		pixels_done(q, q->step_row, 0, q->w);
+	}
 
-			memcpy(&psd.ref, &hd, sizeof(psd.ref));
-			psd.corners = &qr->align;
-			psd.scores[0] = -hd.y * qr->align.x +
-				hd.x * qr->align.y;
+	if (q->step_row >= q->h)
+		step_thresholded(q);
+}
 
-			flood_fill_seed(q, reg->seed.x, reg->seed.y,
-					qr->align_region, QUIRC_PIXEL_BLACK,
-					NULL, NULL);
-			flood_fill_seed(q, reg->seed.x, reg->seed.y,
-					QUIRC_PIXEL_BLACK, qr->align_region,
-					find_leftmost_to_line, &psd);
-		}
+/* Scan the next row, or with threads, the whole image at once */
+static void step_scan(struct quirc *q)
+{
+#ifdef QUIRC_USE_PTHREAD
+	if (q->num_threads > 1 && q->step_num_windows < 0 && !q->step_row &&
+	    runs_complete(q)) {
+		finder_scan_threaded(q);
+		q->step_row = q->h;
 	}
+#endif
 
-	setup_qr_perspective(q, qr_index);
-	return;
+	if (q->step_row < q->h) {
+		if (q->step_num_windows >= 0)
+			finder_scan_windows(q, q->step_row, q->step_windows,
+					    q->step_num_windows);
+		else
+			finder_scan(q, q->step_row);
 
-fail:
-	/* We've been unable to complete setup for this grid. Undo what we've
-	 * recorded and pretend it never happened.
-	 */
-	for (i = 0; i < 3; i++)
-		q->capstones[qr->caps[i]].qr_grid = -1;
-	q->num_grids--;
+		q->step_row++;
+	}
+
+	if (q->step_row >= q->h)
+		q->step = QUIRC_STEP_GROUP;
 }
 
-struct neighbour {
-	int		index;
-	quirc_float_t		distance;
-};
+/* Remember where the codes found were, for the next image */
+static void step_finish(struct quirc *q)
+{
+	if (q->track_interval)
+		track_grids(q);
+	if (q->pyramid_levels)
+		pyramid_update(q);
 
-struct neighbour_list {
-	struct neighbour	n[QUIRC_MAX_CAPSTONES];
-	int			count;
-};
+	q->step = QUIRC_STEP_DONE;
+}
 
-static void test_neighbours(struct quirc *q, int i,
-			    const struct neighbour_list *hlist,
-			    const struct neighbour_list *vlist)
+/* Record the next grid. When there are none left, if the pixels ran
+ * out of labels for flood filled regions, scan again from runs (once).
+ * Runs are found from the labelled pixels, which are still non-zero
+ * where they are dark.
+ */
+static void step_record(struct quirc *q)
 {
-	/* Test each possible grouping */
-	for (int j = 0; j < hlist->count; j++) {
-		const struct neighbour *hn = &hlist->n[j];
-		for (int k = 0; k < vlist->count; k++) {
-			const struct neighbour *vn = &vlist->n[k];
-			quirc_float_t squareness = fabs((quirc_float_t)1.0 - hn->distance / vn->distance);
-			if (squareness < (quirc_float_t)0.2)
-				record_qr_grid(q, hn->index, i, vn->index);
+	if (!group_record_next(q))
+		return;
+
+	if ((q->limits_reached & QUIRC_LIMIT_LABELS) && !q->runs_valid &&
+	    !(q->limits_reached & QUIRC_LIMIT_RUNS) && q->run_capacity) {
+		if (runs_setup(q) < 0) {
+			q->limits_reached |= QUIRC_LIMIT_RUNS;
+		} else {
+			q->runs_valid = 1;
+			q->num_regions = QUIRC_PIXEL_REGION;
+			q->num_capstones = 0;
+			q->num_grids = 0;
+			q->limits_reached = QUIRC_LIMIT_LABELS;
+			budget_spend(q, (long)q->w * q->h);
+
+			q->step_row = 0;
+			q->step = QUIRC_STEP_SCAN;
+			return;
 		}
 	}
+
+	step_finish(q);
 }
 
-static void test_grouping(struct quirc *q, unsigned int i)
+int quirc_step(struct quirc *q, long work)
 {
-	struct quirc_capstone *c1 = &q->capstones[i];
-	int j;
-	struct neighbour_list hlist;
-	struct neighbour_list vlist;
+	q->work_budget = work > 0 ? q->work_done + work : 0;
 
-	hlist.count = 0;
-	vlist.count = 0;
+	while (q->step != QUIRC_STEP_DONE) {
+#ifdef QUIRC_STATS
+		const quirc_step_t step = q->step;
+		const uint64_t start = quirc_stats_clock() - stats_nested(q);
+#endif
 
-	/* Look for potential neighbours by examining the relative gradients
-	 * from this capstone to others.
-	 */
-	for (j = 0; j < q->num_capstones; j++) {
-		struct quirc_capstone *c2 = &q->capstones[j];
-		quirc_float_t u, v;
-
-		if (i == j)
-			continue;
+		switch (q->step) {
+		case QUIRC_STEP_START:
+			step_start(q);
+			break;
 
-		perspective_unmap(c1->c, &c2->center, &u, &v);
+		case QUIRC_STEP_COARSE:
+			step_coarse(q);
+			break;
 
-		u = fabs(u - (quirc_float_t)3.5);
-		v = fabs(v - (quirc_float_t)3.5);
+		case QUIRC_STEP_THRESHOLD:
+			step_threshold(q);
+			break;
 
-		if (u < (quirc_float_t)0.2 * v) {
-			struct neighbour *n = &hlist.n[hlist.count++];
+		case QUIRC_STEP_HISTOGRAM:
+			step_histogram(q);
+			break;
 
-			n->index = j;
-			n->distance = v;
-		}
+		case QUIRC_STEP_BINARIZE:
+			step_binarize(q);
+			break;
 
-		if (v < (quirc_float_t)0.2 * u) {
-			struct neighbour *n = &vlist.n[vlist.count++];
+		case QUIRC_STEP_SCAN:
+			step_scan(q);
+			break;
 
-			n->index = j;
-			n->distance = u;
-		}
-	}
+		case QUIRC_STEP_GROUP:
+			group_capstones(q);
+			q->step = QUIRC_STEP_RECORD;
+			break;
 
-	if (!(hlist.count && vlist.count))
-		return;
+		case QUIRC_STEP_RECORD:
+			step_record(q);
+			break;
 
-	test_neighbours(q, i, &hlist, &vlist);
-}
+		default:
+			q->step = QUIRC_STEP_DONE;
+			break;
+		}
 
-static void pixels_setup(struct quirc *q, uint8_t threshold)
-{
-	if (QUIRC_PIXEL_ALIAS_IMAGE) {
-		q->pixels = (quirc_pixel_t *)q->image;
+#ifdef QUIRC_STATS
+		stats_step(q, step, start);
+#endif
+		if (budget_out(q))
+			break;
 	}
 
-	uint8_t* source = q->image;
-	quirc_pixel_t* dest = q->pixels;
-	int length = q->w * q->h;
-	while (length--) {
-		uint8_t value = *source++;
-		*dest++ = (value < threshold) ? QUIRC_PIXEL_BLACK : QUIRC_PIXEL_WHITE;
-	}
+	return q->step == QUIRC_STEP_DONE;
 }
 
-uint8_t *quirc_begin(struct quirc *q, int *w, int *h)
+int quirc_end_with_budget(struct quirc *q, long budget)
 {
-	q->num_regions = QUIRC_PIXEL_REGION;
-	q->num_capstones = 0;
-	q->num_grids = 0;
+	if (quirc_step(q, budget))
+		return 0;
 
-	if (w)
-		*w = q->w;
-	if (h)
-		*h = q->h;
+	/* Keep the grids recorded so far, and give back the capstones
+	 * chosen for the rest.
+	 */
+	if (q->step == QUIRC_STEP_RECORD)
+		while (q->step_grouping < q->num_groupings) {
+			const struct quirc_grouping *g =
+				&q->groupings[q->step_grouping++];
 
-	return q->image;
+			if (g->taken && !g->done)
+				group_release(q, g);
+		}
+
+	q->limits_reached |= QUIRC_LIMIT_BUDGET;
+	step_finish(q);
+	return 1;
 }
 
 void quirc_end(struct quirc *q)
 {
-	int i;
-
-	uint8_t threshold = otsu(q);
-	pixels_setup(q, threshold);
+	quirc_step(q, 0);
+}
 
-	for (i = 0; i < q->h; i++)
-		finder_scan(q, i);
+int quirc_refine(struct quirc *q, int index)
+{
+	if (index < 0 || index >= q->num_grids)
+		return -1;
 
-	for (i = 0; i < q->num_capstones; i++)
-		test_grouping(q, i);
+	refine_grid(q, index);
+	return 0;
 }
 
 void quirc_extract(const struct quirc *q, int index,
 		   struct quirc_code *code)
 {
-	const struct quirc_grid *qr = &q->grids[index];
-	int y;
-	int i = 0;
+	const struct quirc_grid *qr;
+	struct quirc_grid refined;
+#ifdef QUIRC_STATS
+	uint64_t start;
+#endif
+
+	if (index < 0 || index >= q->num_grids) {
+		memset(code, 0, sizeof(*code));
+		return;
+	}
 
-	memset(code, 0, sizeof(*code));
+#ifdef QUIRC_STATS
+	start = quirc_stats_clock();
+#endif
 
-	if (index < 0 || index > q->num_grids)
-		return;
+	/* A grid whose refinement was deferred is refined here into a
+	 * copy, leaving the decoder as it is. quirc_refine() keeps it.
+	 */
+	qr = &q->grids[index];
+	if (!qr->refined) {
+		int tests;
+
+		refined = *qr;
+		jiggle_perspective(q, &refined, &tests);
+		qr = &refined;
+	}
 
 	perspective_map(qr->c, 0.0, 0.0, &code->corners[0]);
 	perspective_map(qr->c, qr->grid_size, 0.0, &code->corners[1]);
@@ -1141,13 +4574,11 @@ void quirc_extract(const struct quirc *q, int index,
 	if (code->size > QUIRC_MAX_GRID_SIZE)
 		return;
 
-	for (y = 0; y < qr->grid_size; y++) {
-		int x;
-		for (x = 0; x < qr->grid_size; x++) {
-			if (read_cell(q, index, x, y) > 0) {
-				code->cell_bitmap[i >> 3] |= (1 << (i & 7));
-			}
-			i++;
-		}
-	}
+	/* Only the cells of this code are cleared */
+	memset(code->cell_bitmap, 0, (code->size * code->size + 7) >> 3);
+	sample_grid(q, qr, code->cell_bitmap);
+
+#ifdef QUIRC_STATS
+	QUIRC_STATS_ADD(q, extract_ns, quirc_stats_clock() - start);
+#endif
 }
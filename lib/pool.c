@@ -0,0 +1,277 @@
+/* quirc -- QR-code recognition library
+ * Copyright (C) 2010-2012 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include "quirc_internal.h"
+
+#ifdef QUIRC_USE_PTHREAD
+#include <pthread.h>
+#endif
+
+/************************************************************************
+ * Decoder pool
+ *
+ * Each worker owns a decoder, which keeps its buffers from one job to
+ * the next. Jobs wait in a single queue, and whichever worker becomes
+ * free first takes the next one, so a large image only holds up the
+ * worker processing it.
+ *
+ * Without QUIRC_USE_PTHREAD, jobs are processed by the first worker
+ * on the submitting thread.
+ */
+
+struct quirc_pool_job {
+	const uint8_t		*image;
+	int			w;
+	int			h;
+	void			*job_data;
+};
+
+struct quirc_pool_worker {
+	struct quirc_pool	*pool;
+	struct quirc		*q;
+#ifdef QUIRC_USE_PTHREAD
+	pthread_t		thread;
+	int			started;
+#endif
+};
+
+struct quirc_pool {
+	quirc_pool_func_t	func;
+	void			*user_data;
+
+	int			num_workers;
+	struct quirc_pool_worker *workers;
+
+	/* Circular queue of jobs not yet taken by a worker */
+	struct quirc_pool_job	*queue;
+	int			queue_size;
+	int			queue_head;
+	int			queue_count;
+
+	/* Jobs submitted and not yet completed */
+	int			pending;
+	int			shutdown;
+
+#ifdef QUIRC_USE_PTHREAD
+	pthread_mutex_t		lock;
+	pthread_cond_t		job_ready;
+	pthread_cond_t		job_space;
+	pthread_cond_t		job_done;
+#endif
+};
+
+static void pool_run(struct quirc_pool *pool, struct quirc *q,
+		     const struct quirc_pool_job *job)
+{
+	if (quirc_set_image(q, job->image, job->w, job->h, job->w) < 0) {
+		pool->func(pool->user_data, job->job_data, NULL);
+		return;
+	}
+
+	quirc_end(q);
+
+	pool->func(pool->user_data, job->job_data, q);
+}
+
+#ifdef QUIRC_USE_PTHREAD
+static void *pool_worker(void *arg)
+{
+	struct quirc_pool_worker *worker = (struct quirc_pool_worker *)arg;
+	struct quirc_pool *pool = worker->pool;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		struct quirc_pool_job job;
+
+		while (!pool->queue_count && !pool->shutdown)
+			pthread_cond_wait(&pool->job_ready, &pool->lock);
+
+		if (!pool->queue_count)
+			break;
+
+		job = pool->queue[pool->queue_head];
+		pool->queue_head = (pool->queue_head + 1) % pool->queue_size;
+		pool->queue_count--;
+		pthread_cond_signal(&pool->job_space);
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_run(pool, worker->q, &job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->pending)
+			pthread_cond_broadcast(&pool->job_done);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+#endif
+
+struct quirc_pool *quirc_pool_new(int workers, int queue_size,
+				  quirc_pool_func_t func, void *user_data)
+{
+	struct quirc_pool *pool;
+	int i;
+
+	if (workers < 1 || queue_size < 1 || !func)
+		return NULL;
+
+#ifndef QUIRC_USE_PTHREAD
+	workers = 1;
+#endif
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->func = func;
+	pool->user_data = user_data;
+	pool->queue_size = queue_size;
+
+	pool->workers = calloc(workers, sizeof(*pool->workers));
+	pool->queue = calloc(queue_size, sizeof(*pool->queue));
+	if (!pool->workers || !pool->queue)
+		goto fail;
+
+	for (pool->num_workers = 0; pool->num_workers < workers;
+	     pool->num_workers++) {
+		struct quirc_pool_worker *worker =
+			&pool->workers[pool->num_workers];
+
+		worker->pool = pool;
+		worker->q = quirc_new();
+		if (!worker->q)
+			goto fail;
+	}
+
+#ifdef QUIRC_USE_PTHREAD
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_ready, NULL);
+	pthread_cond_init(&pool->job_space, NULL);
+	pthread_cond_init(&pool->job_done, NULL);
+
+	for (i = 0; i < pool->num_workers; i++) {
+		struct quirc_pool_worker *worker = &pool->workers[i];
+
+		worker->started = !pthread_create(&worker->thread, NULL,
+						  pool_worker, worker);
+		if (!worker->started) {
+			quirc_pool_destroy(pool);
+			return NULL;
+		}
+	}
+#endif
+
+	return pool;
+
+fail:
+	for (i = 0; i < pool->num_workers; i++)
+		quirc_destroy(pool->workers[i].q);
+	free(pool->workers);
+	free(pool->queue);
+	free(pool);
+	return NULL;
+}
+
+void quirc_pool_destroy(struct quirc_pool *pool)
+{
+	int i;
+
+#ifdef QUIRC_USE_PTHREAD
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->job_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_workers; i++)
+		if (pool->workers[i].started)
+			pthread_join(pool->workers[i].thread, NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->job_ready);
+	pthread_cond_destroy(&pool->job_space);
+	pthread_cond_destroy(&pool->job_done);
+#endif
+
+	for (i = 0; i < pool->num_workers; i++)
+		quirc_destroy(pool->workers[i].q);
+
+	free(pool->workers);
+	free(pool->queue);
+	free(pool);
+}
+
+int quirc_pool_count(const struct quirc_pool *pool)
+{
+	return pool->num_workers;
+}
+
+struct quirc *quirc_pool_decoder(struct quirc_pool *pool, int index)
+{
+	if (index < 0 || index >= pool->num_workers)
+		return NULL;
+
+	return pool->workers[index].q;
+}
+
+int quirc_pool_submit(struct quirc_pool *pool, const uint8_t *image,
+		      int w, int h, void *job_data)
+{
+	struct quirc_pool_job job;
+
+	if (w < 0 || h < 0)
+		return -1;
+
+	job.image = image;
+	job.w = w;
+	job.h = h;
+	job.job_data = job_data;
+
+#ifdef QUIRC_USE_PTHREAD
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->queue_count >= pool->queue_size)
+		pthread_cond_wait(&pool->job_space, &pool->lock);
+
+	pool->queue[(pool->queue_head + pool->queue_count) %
+		    pool->queue_size] = job;
+	pool->queue_count++;
+	pool->pending++;
+	pthread_cond_signal(&pool->job_ready);
+
+	pthread_mutex_unlock(&pool->lock);
+#else
+	pool_run(pool, pool->workers[0].q, &job);
+#endif
+
+	return 0;
+}
+
+void quirc_pool_wait(struct quirc_pool *pool)
+{
+#ifdef QUIRC_USE_PTHREAD
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->pending)
+		pthread_cond_wait(&pool->job_done, &pool->lock);
+
+	pthread_mutex_unlock(&pool->lock);
+#else
+	(void)pool;
+#endif
+}
@@ -16,6 +16,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#ifdef QUIRC_STATS
+#include <time.h>
+#endif
 #include "quirc_internal.h"
 
 const char *quirc_version(void)
@@ -23,28 +26,521 @@ const char *quirc_version(void)
 	return "1.0";
 }
 
+/* Tables of regions, capstones and grids, allocated for new limits
+ * before they are given to a decoder. Limits which are unchanged keep
+ * their tables, and leave these NULL.
+ */
+struct tables {
+	int			max_regions;
+	int			max_capstones;
+	int			max_grids;
+	struct quirc_region	*regions;
+	struct quirc_capstone	*capstones;
+	int			*order;
+	struct quirc_grouping	*groupings;
+	struct quirc_grid	*grids;
+};
+
+static void tables_free(struct tables *t)
+{
+	free(t->regions);
+	free(t->capstones);
+	free(t->order);
+	free(t->groupings);
+	free(t->grids);
+}
+
+static int tables_alloc(const struct quirc *q, int max_regions,
+			int max_capstones, int max_grids, struct tables *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->max_regions = max_regions;
+	t->max_capstones = max_capstones;
+	t->max_grids = max_grids;
+
+	if (max_regions != q->max_regions) {
+		t->regions = calloc(max_regions, sizeof(*t->regions));
+		if (!t->regions)
+			goto fail;
+	}
+
+	if (max_capstones != q->max_capstones) {
+		t->capstones = calloc(max_capstones, sizeof(*t->capstones));
+		t->order = calloc(max_capstones, sizeof(*t->order));
+		t->groupings = calloc((size_t)max_capstones * QUIRC_GROUPINGS,
+				      sizeof(*t->groupings));
+		if (!t->capstones || !t->order || !t->groupings)
+			goto fail;
+	}
+
+	if (max_grids != q->max_grids) {
+		t->grids = calloc(max_grids, sizeof(*t->grids));
+		if (!t->grids)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	tables_free(t);
+	return -1;
+}
+
+static void tables_set(struct quirc *q, const struct tables *t)
+{
+	if (t->regions) {
+		free(q->regions);
+		q->regions = t->regions;
+		q->max_regions = t->max_regions;
+	}
+	if (t->capstones) {
+		free(q->capstones);
+		free(q->capstone_order);
+		free(q->groupings);
+		q->capstones = t->capstones;
+		q->capstone_order = t->order;
+		q->groupings = t->groupings;
+		q->max_capstones = t->max_capstones;
+	}
+	if (t->grids) {
+		free(q->grids);
+		q->grids = t->grids;
+		q->max_grids = t->max_grids;
+	}
+}
+
 struct quirc *quirc_new(void)
 {
 	struct quirc *q = malloc(sizeof(*q));
+	struct tables tables;
 
 	if (!q)
 		return NULL;
 
 	memset(q, 0, sizeof(*q));
+#ifdef QUIRC_BITPLANE
+	q->region_method = QUIRC_REGIONS_RUNS;
+#endif
+
+#ifdef QUIRC_STATS
+	q->stats = calloc(1, sizeof(*q->stats));
+	if (!q->stats) {
+		free(q);
+		return NULL;
+	}
+#endif
+
+	if (tables_alloc(q, QUIRC_MAX_REGIONS, QUIRC_MAX_CAPSTONES,
+			 QUIRC_MAX_GRIDS, &tables) < 0) {
+#ifdef QUIRC_STATS
+		free(q->stats);
+#endif
+		free(q);
+		return NULL;
+	}
+	tables_set(q, &tables);
+
 	return q;
 }
 
 void quirc_destroy(struct quirc *q)
 {
+	int i;
+
+	for (i = 0; i < q->pyramid_levels; i++)
+		quirc_destroy(q->pyramid[i]);
+
 	free(q->image);
 	/* q->pixels may alias q->image when their type representation is of the
 	   same size, so we need to be careful here to avoid a double free */
 	if (!QUIRC_PIXEL_ALIAS_IMAGE)
 		free(q->pixels);
+	free(q->bits);
 	free(q->flood_fill_vars);
+	free(q->threshold_sums);
+	free(q->threshold_rows);
+	free(q->runs);
+	free(q->components);
+	free(q->row_runs);
+	free(q->scan_bands);
+	free(q->scan_candidates);
+	free(q->regions);
+	free(q->capstones);
+	free(q->capstone_order);
+	free(q->groupings);
+	free(q->grids);
+#ifdef QUIRC_STATS
+	free(q->stats);
+#endif
 	free(q);
 }
 
+/* Window radius used by QUIRC_THRESHOLD_LOCAL_MEAN */
+static int threshold_radius(int w, int h)
+{
+	int r = (w > h ? w : h) / 32;
+
+	if (r < 8)
+		return 8;
+	if (r > 128)
+		return 128;
+	return r;
+}
+
+/* Allocate the working buffers needed by a thresholding method for an
+ * image of the given size. Buffers which aren't needed are left NULL.
+ */
+static int threshold_buffers_alloc(quirc_threshold_method_t method,
+				   int w, int h, int *radius,
+				   uint32_t **sums, uint8_t **rows)
+{
+	*radius = threshold_radius(w, h);
+	*sums = NULL;
+	*rows = NULL;
+
+	switch (method) {
+	case QUIRC_THRESHOLD_TILED_OTSU:
+		*rows = malloc(w ? w : 1);
+		if (!*rows)
+			return -1;
+		break;
+
+	case QUIRC_THRESHOLD_LOCAL_MEAN:
+		*sums = calloc((size_t)w * 2 + 1, sizeof(**sums));
+		*rows = calloc((size_t)*radius + 1, w ? w : 1);
+		if (!*sums || !*rows) {
+			free(*sums);
+			free(*rows);
+			return -1;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+int quirc_set_threshold_method(struct quirc *q,
+			       quirc_threshold_method_t method)
+{
+	uint32_t *sums;
+	uint8_t *rows;
+	int radius;
+	int i;
+
+	switch (method) {
+	case QUIRC_THRESHOLD_OTSU:
+	case QUIRC_THRESHOLD_OTSU_FUSED:
+	case QUIRC_THRESHOLD_TILED_OTSU:
+	case QUIRC_THRESHOLD_LOCAL_MEAN:
+		break;
+
+	default:
+		return -1;
+	}
+
+	if (threshold_buffers_alloc(method, q->w, q->h,
+				    &radius, &sums, &rows) < 0)
+		return -1;
+
+	/* The pyramid's decoders are updated once nothing else can fail.
+	 * If one of them fails, those before it keep the new method, which
+	 * only affects the coarse search.
+	 */
+	for (i = 0; i < q->pyramid_levels; i++)
+		if (quirc_set_threshold_method(q->pyramid[i], method) < 0) {
+			free(sums);
+			free(rows);
+			return -1;
+		}
+
+	free(q->threshold_sums);
+	free(q->threshold_rows);
+	q->threshold_method = method;
+	q->threshold_radius = radius;
+	q->threshold_sums = sums;
+	q->threshold_rows = rows;
+
+	return 0;
+}
+
+/* Allocate the run buffers needed by a region method for an image of
+ * the given size. They are also needed to label more regions than the
+ * pixels can hold. Buffers which aren't needed are left NULL.
+ */
+static int region_buffers_alloc(quirc_region_method_t method,
+				int max_regions, int w, int h, int *capacity,
+				struct quirc_run **runs,
+				struct quirc_component **components,
+				int **row_runs)
+{
+	*capacity = 0;
+	*runs = NULL;
+	*components = NULL;
+	*row_runs = NULL;
+
+	if (method != QUIRC_REGIONS_RUNS && max_regions <= QUIRC_MAX_LABELS)
+		return 0;
+
+	*capacity = (int)((size_t)w * h / QUIRC_RUN_DENSITY) + 1;
+	*runs = malloc(sizeof(**runs) * *capacity);
+	*components = malloc(sizeof(**components) * *capacity);
+	*row_runs = malloc(sizeof(**row_runs) * ((size_t)h + 1));
+	if (!*runs || !*components || !*row_runs) {
+		free(*runs);
+		free(*components);
+		free(*row_runs);
+		return -1;
+	}
+
+	return 0;
+}
+
+int quirc_set_region_method(struct quirc *q, quirc_region_method_t method)
+{
+	struct quirc_run *runs;
+	struct quirc_component *components;
+	int *row_runs;
+	int capacity;
+	int i;
+
+	switch (method) {
+#ifndef QUIRC_BITPLANE
+	case QUIRC_REGIONS_FLOOD_FILL:
+#endif
+	case QUIRC_REGIONS_RUNS:
+		break;
+
+	default:
+		return -1;
+	}
+
+	if (region_buffers_alloc(method, q->max_regions, q->w, q->h,
+				 &capacity, &runs, &components,
+				 &row_runs) < 0)
+		return -1;
+
+	for (i = 0; i < q->pyramid_levels; i++)
+		if (quirc_set_region_method(q->pyramid[i], method) < 0) {
+			free(runs);
+			free(components);
+			free(row_runs);
+			return -1;
+		}
+
+	free(q->runs);
+	free(q->components);
+	free(q->row_runs);
+	q->region_method = method;
+	q->runs_valid = 0;
+	q->run_capacity = capacity;
+	q->runs = runs;
+	q->components = components;
+	q->row_runs = row_runs;
+
+	return 0;
+}
+
+int quirc_set_threads(struct quirc *q, int threads)
+{
+	struct quirc_scan_band *bands = NULL;
+	struct quirc_finder_candidate *candidates = NULL;
+
+	if (threads < 1 || threads > QUIRC_MAX_THREADS)
+		return -1;
+
+#ifndef QUIRC_USE_PTHREAD
+	if (threads > 1)
+		return -1;
+#endif
+
+	if (threads > 1) {
+		bands = calloc(threads, sizeof(*bands));
+		candidates = calloc((size_t)threads * QUIRC_BAND_CANDIDATES,
+				    sizeof(*candidates));
+		if (!bands || !candidates) {
+			free(bands);
+			free(candidates);
+			return -1;
+		}
+	}
+
+	free(q->scan_bands);
+	free(q->scan_candidates);
+	q->num_threads = threads;
+	q->scan_bands = bands;
+	q->scan_candidates = candidates;
+
+	return 0;
+}
+
+/* The tables and run buffers of one decoder, for quirc_set_limits() */
+struct limits {
+	struct tables		tables;
+	int			capacity;
+	struct quirc_run	*runs;
+	struct quirc_component	*components;
+	int			*row_runs;
+};
+
+static int limits_alloc(const struct quirc *q, int regions, int capstones,
+			int grids, struct limits *l)
+{
+	if (region_buffers_alloc(q->region_method,
+				 regions + QUIRC_PIXEL_REGION, q->w, q->h,
+				 &l->capacity, &l->runs, &l->components,
+				 &l->row_runs) < 0)
+		return -1;
+
+	if (tables_alloc(q, regions + QUIRC_PIXEL_REGION, capstones, grids,
+			 &l->tables) < 0) {
+		free(l->runs);
+		free(l->components);
+		free(l->row_runs);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void limits_free(struct limits *l)
+{
+	tables_free(&l->tables);
+	free(l->runs);
+	free(l->components);
+	free(l->row_runs);
+}
+
+static void limits_set(struct quirc *q, const struct limits *l)
+{
+	tables_set(q, &l->tables);
+	free(q->runs);
+	free(q->components);
+	free(q->row_runs);
+	q->runs_valid = 0;
+	q->run_capacity = l->capacity;
+	q->runs = l->runs;
+	q->components = l->components;
+	q->row_runs = l->row_runs;
+	q->num_regions = QUIRC_PIXEL_REGION;
+	q->num_capstones = 0;
+	q->num_grids = 0;
+}
+
+int quirc_set_limits(struct quirc *q, int regions, int capstones,
+		     int grids)
+{
+	struct limits limits[1 + QUIRC_MAX_PYRAMID];
+	int i;
+
+	if (regions < 1 || regions > INT_MAX - QUIRC_PIXEL_REGION ||
+	    capstones < 1 || capstones > INT_MAX / QUIRC_GROUPINGS ||
+	    grids < 1)
+		return -1;
+
+	/* Everything is allocated for the decoder and each level of its
+	 * pyramid before any of them is changed, so that a failure leaves
+	 * them all with their old limits.
+	 */
+	for (i = 0; i <= q->pyramid_levels; i++)
+		if (limits_alloc(i ? q->pyramid[i - 1] : q, regions,
+				 capstones, grids, &limits[i]) < 0) {
+			while (i--)
+				limits_free(&limits[i]);
+			return -1;
+		}
+
+	for (i = 0; i <= q->pyramid_levels; i++)
+		limits_set(i ? q->pyramid[i - 1] : q, &limits[i]);
+
+	return 0;
+}
+
+int quirc_set_roi(struct quirc *q, const struct quirc_rect *rects,
+		  int count)
+{
+	if (count < 0 || count > QUIRC_MAX_ROI)
+		return -1;
+
+	if (count)
+		memcpy(q->roi, rects, sizeof(q->roi[0]) * count);
+	q->num_roi = count;
+
+	return 0;
+}
+
+int quirc_set_tracking(struct quirc *q, int interval)
+{
+	if (interval < 0)
+		return -1;
+
+	q->track_interval = interval;
+	q->track_frames = 0;
+	q->num_track_windows = 0;
+
+	return 0;
+}
+
+int quirc_set_lazy_refinement(struct quirc *q, int lazy)
+{
+	if (lazy < 0 || lazy > 1)
+		return -1;
+
+	q->lazy_refinement = lazy;
+	return 0;
+}
+
+int quirc_set_max_codes(struct quirc *q, int max_codes)
+{
+	if (max_codes < 0)
+		return -1;
+
+	q->max_codes = max_codes;
+	return 0;
+}
+
+int quirc_set_pyramid(struct quirc *q, int levels)
+{
+	struct quirc *pyramid[QUIRC_MAX_PYRAMID] = { NULL };
+	int i;
+
+	if (levels < 0 || levels > QUIRC_MAX_PYRAMID)
+		return -1;
+
+	for (i = 0; i < levels; i++) {
+		pyramid[i] = quirc_new();
+		if (!pyramid[i] ||
+		    quirc_set_limits(pyramid[i],
+				     q->max_regions - QUIRC_PIXEL_REGION,
+				     q->max_capstones, q->max_grids) < 0 ||
+		    quirc_set_threshold_method(pyramid[i],
+					       q->threshold_method) < 0 ||
+		    quirc_set_region_method(pyramid[i],
+					    q->region_method) < 0 ||
+		    quirc_resize(pyramid[i], q->w >> (i + 1),
+				 q->h >> (i + 1)) < 0)
+			goto fail;
+	}
+
+	for (i = 0; i < q->pyramid_levels; i++)
+		quirc_destroy(q->pyramid[i]);
+
+	memcpy(q->pyramid, pyramid, sizeof(q->pyramid));
+	q->pyramid_levels = levels;
+	q->pyramid_level = levels;
+
+	return 0;
+
+fail:
+	for (i = 0; i < levels; i++)
+		if (pyramid[i])
+			quirc_destroy(pyramid[i]);
+
+	return -1;
+}
+
 int quirc_resize(struct quirc *q, int w, int h)
 {
 	uint8_t		*image  = NULL;
@@ -52,6 +548,15 @@ int quirc_resize(struct quirc *q, int w, int h)
 	size_t num_vars;
 	size_t vars_byte_size;
 	struct quirc_flood_fill_vars *vars = NULL;
+	uint32_t	*threshold_sums = NULL;
+	uint8_t		*threshold_rows = NULL;
+	int		threshold_radius;
+	struct quirc_run *runs = NULL;
+	struct quirc_component *components = NULL;
+	int		*row_runs = NULL;
+	int		run_capacity;
+	uint64_t	*bits = NULL;
+	int		i;
 
 	/*
 	 * XXX: w and h should be size_t (or at least unsigned) as negatives
@@ -62,14 +567,6 @@ int quirc_resize(struct quirc *q, int w, int h)
 	if (w < 0 || h < 0)
 		goto fail;
 
-	/*
-	 * alloc a new buffer for q->image. We avoid realloc(3) because we want
-	 * on failure to be leave `q` in a consistant, unmodified state.
-	 */
-	image = calloc(w, h);
-	if (!image)
-		goto fail;
-
 	/* compute the "old" (i.e. currently allocated) and the "new"
 	   (i.e. requested) image dimensions */
 	size_t olddim = q->w * q->h;
@@ -77,19 +574,48 @@ int quirc_resize(struct quirc *q, int w, int h)
 	size_t min = (olddim < newdim ? olddim : newdim);
 
 	/*
-	 * copy the data into the new buffer, avoiding (a) to read beyond the
-	 * old buffer when the new size is greater and (b) to write beyond the
-	 * new buffer when the new size is smaller, hence the min computation.
+	 * buffers which are already large enough, but no more than twice
+	 * the size needed, are kept. This saves allocating for every image
+	 * when processing a series of images of similar sizes.
 	 */
-	(void)memcpy(image, q->image, min);
+	int keep_image = q->image && newdim <= q->image_capacity &&
+		newdim * 2 >= q->image_capacity;
 
-	/* alloc a new buffer for q->pixels if needed */
-	if (!QUIRC_PIXEL_ALIAS_IMAGE) {
-		pixels = calloc(newdim, sizeof(quirc_pixel_t));
-		if (!pixels)
+	/*
+	 * alloc a new buffer for q->image. We avoid realloc(3) because we want
+	 * on failure to be leave `q` in a consistant, unmodified state.
+	 */
+	if (!keep_image) {
+		image = calloc(w, h);
+		if (!image)
 			goto fail;
+
+		/*
+		 * copy the data into the new buffer, avoiding (a) to read
+		 * beyond the old buffer when the new size is greater and (b)
+		 * to write beyond the new buffer when the new size is
+		 * smaller, hence the min computation.
+		 */
+		(void)memcpy(image, q->image, min);
+
+#ifndef QUIRC_BITPLANE
+		/* alloc a new buffer for q->pixels if needed */
+		if (!QUIRC_PIXEL_ALIAS_IMAGE) {
+			pixels = calloc(newdim, sizeof(quirc_pixel_t));
+			if (!pixels)
+				goto fail;
+		}
+#endif
 	}
 
+#ifdef QUIRC_BITPLANE
+	/* alloc the bitplane, and a single row of pixels to threshold into */
+	bits = calloc((size_t)(w + 63) / 64 * h + 1, sizeof(*bits));
+	pixels = calloc((size_t)w + 1, sizeof(*pixels));
+	if (!bits || !pixels)
+		goto fail;
+#endif
+
 	/*
 	 * alloc the work area for the flood filling logic.
 	 *
@@ -109,32 +635,97 @@ int quirc_resize(struct quirc *q, int w, int h)
 		num_vars = 1;
 	}
 
-	vars_byte_size = sizeof(*vars) * num_vars;
-	if (vars_byte_size / sizeof(*vars) != num_vars) {
-		goto fail; /* size_t overflow */
+	if (num_vars > q->num_flood_fill_vars ||
+	    num_vars * 2 < q->num_flood_fill_vars) {
+		vars_byte_size = sizeof(*vars) * num_vars;
+		if (vars_byte_size / sizeof(*vars) != num_vars) {
+			goto fail; /* size_t overflow */
+		}
+		vars = malloc(vars_byte_size);
+		if (!vars)
+			goto fail;
 	}
-	vars = malloc(vars_byte_size);
-	if (!vars)
+
+	/* alloc the working buffers for the selected thresholding method */
+	if (threshold_buffers_alloc(q->threshold_method, w, h,
+				    &threshold_radius,
+				    &threshold_sums, &threshold_rows) < 0)
+		goto fail;
+
+	/* alloc the run buffers for the selected region method */
+	if (region_buffers_alloc(q->region_method, q->max_regions, w, h,
+				 &run_capacity, &runs, &components,
+				 &row_runs) < 0) {
+		free(threshold_sums);
+		free(threshold_rows);
 		goto fail;
+	}
+
+	/*
+	 * resize the reduced copies of the image, if any. If one of them
+	 * fails, `q` is left as it was, and the copies already resized no
+	 * longer match it, so the coarse search skips them until the next
+	 * resize.
+	 */
+	for (i = 0; i < q->pyramid_levels; i++)
+		if (quirc_resize(q->pyramid[i], w >> (i + 1),
+				 h >> (i + 1)) < 0) {
+			free(threshold_sums);
+			free(threshold_rows);
+			free(runs);
+			free(components);
+			free(row_runs);
+			goto fail;
+		}
 
 	/* alloc succeeded, update `q` with the new size and buffers */
 	q->w = w;
 	q->h = h;
-	free(q->image);
-	q->image = image;
-	if (!QUIRC_PIXEL_ALIAS_IMAGE) {
-		free(q->pixels);
-		q->pixels = pixels;
+	if (image) {
+		free(q->image);
+		q->image = image;
+		q->image_capacity = newdim;
+#ifndef QUIRC_BITPLANE
+		if (!QUIRC_PIXEL_ALIAS_IMAGE) {
+			free(q->pixels);
+			q->pixels = pixels;
+		}
+#endif
 	}
-	free(q->flood_fill_vars);
-	q->flood_fill_vars = vars;
-	q->num_flood_fill_vars = num_vars;
+#ifdef QUIRC_BITPLANE
+	free(q->pixels);
+	free(q->bits);
+	q->pixels = pixels;
+	q->bits = bits;
+	q->bits_stride = (w + 63) / 64;
+#endif
+	if (vars) {
+		free(q->flood_fill_vars);
+		q->flood_fill_vars = vars;
+		q->num_flood_fill_vars = num_vars;
+	}
+	q->threshold_valid = 0;
+	q->num_track_windows = 0;
+	free(q->threshold_sums);
+	free(q->threshold_rows);
+	q->threshold_radius = threshold_radius;
+	q->threshold_sums = threshold_sums;
+	q->threshold_rows = threshold_rows;
+	free(q->runs);
+	free(q->components);
+	free(q->row_runs);
+	q->runs_valid = 0;
+	q->run_capacity = run_capacity;
+	q->runs = runs;
+	q->components = components;
+	q->row_runs = row_runs;
 
 	return 0;
 	/* NOTREACHED */
 fail:
 	free(image);
 	free(pixels);
+	free(bits);
 	free(vars);
 
 	return -1;
@@ -145,6 +736,51 @@ int quirc_count(const struct quirc *q)
 	return q->num_grids;
 }
 
+unsigned int quirc_limits_reached(const struct quirc *q)
+{
+	return q->limits_reached;
+}
+
+int quirc_get_stats(const struct quirc *q, struct quirc_stats *stats)
+{
+#ifdef QUIRC_STATS
+	memcpy(stats, q->stats, sizeof(*stats));
+	return 0;
+#else
+	(void)q;
+	memset(stats, 0, sizeof(*stats));
+	return -1;
+#endif
+}
+
+int quirc_get_grid_stats(const struct quirc *q, int index,
+			 struct quirc_grid_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+#ifdef QUIRC_STATS
+	if (index < 0 || index >= q->num_grids)
+		return -1;
+
+	stats->refine_ns = q->grids[index].refine_ns;
+	stats->fitness_evaluations = q->grids[index].refine_tests;
+	return 0;
+#else
+	(void)q;
+	(void)index;
+	return -1;
+#endif
+}
+
+#ifdef QUIRC_STATS
+uint64_t quirc_stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
 static const char *const error_table[] = {
 	[QUIRC_SUCCESS] = "Success",
 	[QUIRC_ERROR_INVALID_GRID_SIZE] = "Invalid grid size",
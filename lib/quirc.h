@@ -17,6 +17,7 @@
 #ifndef QUIRC_H_
 #define QUIRC_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -56,12 +57,320 @@ int quirc_resize(struct quirc *q, int w, int h);
 uint8_t *quirc_begin(struct quirc *q, int *w, int *h);
 void quirc_end(struct quirc *q);
 
+/* As quirc_end(), but giving up once about budget units of work have
+ * been done, where a unit is roughly one pixel examined. The budget is
+ * checked between bands of rows and between grids, so it may be
+ * overrun by one step that can't be divided: a flood fill, one grid's
+ * refinement, thresholding by methods other than QUIRC_THRESHOLD_OTSU,
+ * thresholding regions of interest, or with threads, the finder scan.
+ * The codes completed by then are kept, and QUIRC_LIMIT_BUDGET is
+ * reported by quirc_limits_reached(). A budget of 0 is unlimited.
+ *
+ * Returns 0 if the image was processed completely, or 1 if the budget
+ * ran out.
+ */
+int quirc_end_with_budget(struct quirc *q, long budget);
+
+/* As an alternative to quirc_end(), the image may be processed a slice
+ * at a time, for example in the idle time of an event loop. Each call
+ * does about the given units of work, as for quirc_end_with_budget(),
+ * and then stops where it is; the next call carries on from there.
+ * Each call makes some progress, however small the amount of work. A
+ * work amount of 0 finishes processing the image.
+ *
+ * Returns 1 once the image has been processed completely, after which
+ * the codes may be extracted, or 0 if there is more to do. The image
+ * must not be changed until then.
+ */
+int quirc_step(struct quirc *q, long work);
+
+/* As an alternative to quirc_begin(), the image may be read directly
+ * from a buffer owned by the caller, whose rows are stride bytes apart.
+ * The recognizer is resized first if the image size differs from the
+ * current one. The buffer isn't modified, and must remain valid until
+ * quirc_end() returns.
+ *
+ * Returns 0 on success, or -1 if the arguments are invalid or sufficient
+ * memory could not be allocated.
+ */
+int quirc_set_image(struct quirc *q, const uint8_t *image,
+		    int w, int h, int stride);
+
+/* Methods for separating dark and light pixels in quirc_end(). */
+typedef enum {
+	/* A single threshold for the whole image, chosen by Otsu's
+	 * method. This is the default.
+	 */
+	QUIRC_THRESHOLD_OTSU = 0,
+
+	/* As above, but each image is thresholded with the level chosen
+	 * for the previous one, while the histogram for the next level is
+	 * gathered in the same pass. The image is then only read once,
+	 * which suits video streams where the lighting changes slowly.
+	 * The first image after quirc_resize() uses plain Otsu.
+	 */
+	QUIRC_THRESHOLD_OTSU_FUSED,
+
+	/* The image is divided into an 8x8 grid of tiles, each with its
+	 * own Otsu threshold, and the thresholds are blended bilinearly
+	 * between tile centres. Suited to gradual changes in lighting.
+	 */
+	QUIRC_THRESHOLD_TILED_OTSU,
+
+	/* Each pixel is compared against the mean of a window around it
+	 * (1/16 of the image size, clamped to 17..257 pixels across).
+	 * Suited to strong shadows and uneven lighting.
+	 */
+	QUIRC_THRESHOLD_LOCAL_MEAN
+} quirc_threshold_method_t;
+
+/* Select the thresholding method used by subsequent calls to
+ * quirc_end(). Some methods need working buffers, which are sized here
+ * and by quirc_resize().
+ *
+ * Returns 0 on success, or -1 if the method is not known or sufficient
+ * memory could not be allocated.
+ */
+int quirc_set_threshold_method(struct quirc *q,
+			       quirc_threshold_method_t method);
+
+/* Methods for finding the connected regions of dark pixels which make
+ * up finder and alignment patterns.
+ */
+typedef enum {
+	/* Each region is flood filled when the finder pattern search
+	 * first touches it. This is the default.
+	 */
+	QUIRC_REGIONS_FLOOD_FILL = 0,
+
+	/* After thresholding, each row is converted once to a list of
+	 * dark runs, and all regions are labelled by joining overlapping
+	 * runs. The finder pattern search then walks the runs rather than
+	 * the pixels, which is much faster on large images with few dark
+	 * areas. This needs about 2 bytes of extra memory per pixel.
+	 * Images with too many runs to fit are processed as with
+	 * QUIRC_REGIONS_FLOOD_FILL.
+	 */
+	QUIRC_REGIONS_RUNS
+} quirc_region_method_t;
+
+/* Select the method used by subsequent calls to quirc_end() to find
+ * regions. The working buffers are sized here and by quirc_resize().
+ *
+ * Returns 0 on success, or -1 if the method is not known or sufficient
+ * memory could not be allocated.
+ */
+int quirc_set_region_method(struct quirc *q, quirc_region_method_t method);
+
+/* Set the number of threads used to search for finder patterns in
+ * quirc_end(). The image is split into horizontal bands which are
+ * scanned in parallel, and the results are then merged in row order,
+ * so the codes found are exactly the same as with a single thread.
+ *
+ * Threads are only available if quirc was built with QUIRC_USE_PTHREAD.
+ * The default is 1.
+ *
+ * Returns 0 on success, or -1 if the count is out of range, threads are
+ * not supported, or sufficient memory could not be allocated.
+ */
+int quirc_set_threads(struct quirc *q, int threads);
+
+/* Set the greatest number of regions (connected areas of dark pixels),
+ * capstones (finder patterns) and grids (candidate codes) which are
+ * recorded for each image. The defaults are 252 (QUIRC_MAX_REGIONS - 2),
+ * 32 and 64. Anything beyond these limits is ignored, and reported by
+ * quirc_limits_reached().
+ *
+ * Flood filled regions are labelled in the thresholded pixels, which
+ * can only hold 253 labels (65533 if quirc was built with
+ * QUIRC_MAX_REGIONS=65534). If more regions than that are allowed,
+ * the buffers for QUIRC_REGIONS_RUNS are allocated as well, and images
+ * which run out of labels are searched again from runs.
+ *
+ * Returns 0 on success, or -1 if a limit is less than 1 or sufficient
+ * memory could not be allocated.
+ */
+int quirc_set_limits(struct quirc *q, int regions, int capstones,
+		     int grids);
+
+/* Limits which may be reached while processing an image. */
+typedef enum {
+	/* There were more regions than allowed by quirc_set_limits(),
+	 * so some finder patterns may have been missed.
+	 */
+	QUIRC_LIMIT_REGIONS	= 0x01,
+
+	/* There were more capstones than allowed */
+	QUIRC_LIMIT_CAPSTONES	= 0x02,
+
+	/* There were more candidate grids than allowed */
+	QUIRC_LIMIT_GRIDS	= 0x04,
+
+	/* The pixels ran out of region labels while flood filling, and
+	 * the image was searched again from runs of dark pixels.
+	 */
+	QUIRC_LIMIT_LABELS	= 0x08,
+
+	/* There were too many runs of dark pixels to hold, so regions
+	 * were flood filled instead (or with QUIRC_BITPLANE, the
+	 * remaining rows were treated as blank).
+	 */
+	QUIRC_LIMIT_RUNS	= 0x10,
+
+	/* The budget given to quirc_end_with_budget() ran out, so only
+	 * part of the image may have been searched.
+	 */
+	QUIRC_LIMIT_BUDGET	= 0x20
+} quirc_limit_t;
+
+/* Return the quirc_limit_t flags for limits reached while processing
+ * the last image, or 0 if there were none.
+ */
+unsigned int quirc_limits_reached(const struct quirc *q);
+
+/* Performance counters for the last processed image, gathered only if
+ * quirc was built with QUIRC_STATS. Counts include every pass over the
+ * image, and the pyramid's coarse pass.
+ */
+struct quirc_stats {
+	/* Time spent in each stage, in nanoseconds. otsu_ns is the time
+	 * spent choosing a threshold for QUIRC_THRESHOLD_OTSU. The other
+	 * methods choose and apply thresholds together, and all of their
+	 * time is counted in binarize_ns. Refinement of grids is counted
+	 * in jiggle_ns rather than grouping_ns, and extract_ns counts
+	 * calls to quirc_extract(), including any refinement they do
+	 * for quirc_set_lazy_refinement(). Because of extract_ns, codes
+	 * shouldn't be extracted from one decoder by several threads at
+	 * once in builds with QUIRC_STATS.
+	 */
+	uint64_t		otsu_ns;
+	uint64_t		binarize_ns;
+	uint64_t		finder_scan_ns;
+	uint64_t		grouping_ns;
+	uint64_t		jiggle_ns;
+	uint64_t		extract_ns;
+
+	/* Regions labelled, and the number of times no more could be */
+	unsigned int		regions;
+	unsigned int		region_exhaustions;
+
+	/* Spans filled by flood fills, the greatest depth of their stack,
+	 * and the number of fills stopped early because it was full.
+	 */
+	uint64_t		flood_fill_spans;
+	unsigned int		flood_fill_max_depth;
+	unsigned int		flood_fill_overflows;
+
+	/* Capstones and grids recorded, and transforms evaluated while
+	 * refining grids.
+	 */
+	unsigned int		capstones;
+	unsigned int		grids;
+	uint64_t		fitness_evaluations;
+};
+
+/* Copy the performance counters for the last processed image. Returns
+ * 0 on success, or -1 (with the counters zeroed) if quirc was built
+ * without QUIRC_STATS.
+ */
+int quirc_get_stats(const struct quirc *q, struct quirc_stats *stats);
+
+/* Counters for the refinement of one QR-code, with QUIRC_STATS. Both are
+ * 0 if refinement was deferred by quirc_set_lazy_refinement() and the
+ * code hasn't been refined by quirc_refine().
+ */
+struct quirc_grid_stats {
+	/* Time spent refining the code's position, in nanoseconds, and
+	 * the transforms evaluated.
+	 */
+	uint64_t		refine_ns;
+	unsigned int		fitness_evaluations;
+};
+
+/* Copy the refinement counters for the QR-code specified by the given
+ * index. Returns 0 on success, or -1 (with the counters zeroed) if the
+ * index is out of range or quirc was built without QUIRC_STATS.
+ */
+int quirc_get_grid_stats(const struct quirc *q, int index,
+			 struct quirc_grid_stats *stats);
+
 /* This structure describes a location in the input image buffer. */
 struct quirc_point {
 	int	x;
 	int	y;
 };
 
+/* This structure describes a rectangle in the input image buffer. */
+struct quirc_rect {
+	int	x;
+	int	y;
+	int	w;
+	int	h;
+};
+
+/* Restrict subsequent calls to quirc_end() to up to 8 regions of
+ * interest. Only pixels inside these are thresholded and searched, and
+ * each region is thresholded with its own level, whichever method is
+ * selected. Regions are clipped to the image, and overlapping regions
+ * are merged. Passing a count of 0 restores processing of the whole
+ * image.
+ *
+ * Returns 0 on success, or -1 if there are too many regions.
+ */
+int quirc_set_roi(struct quirc *q, const struct quirc_rect *rects,
+		  int count);
+
+/* Enable tracking. After an image in which codes were found, the next
+ * ones are only processed within windows around those codes, as for
+ * regions of interest. The whole image is processed again when no codes
+ * are found, and after every interval tracked images. An interval of 0
+ * disables tracking. Regions set by quirc_set_roi() take precedence.
+ *
+ * Returns 0 on success, or -1 if the interval is negative.
+ */
+int quirc_set_tracking(struct quirc *q, int interval);
+
+/* Enable coarse-to-fine detection, for large images with large codes.
+ * Codes are first searched for in a copy of the image reduced by 2 or
+ * by 4 in each direction, and the full image is then only processed
+ * within windows around the codes found there, as for regions of
+ * interest. If none are found, the whole image is processed as usual.
+ * If some are, codes which could not be found in the reduced copy are
+ * missed, so this suits images whose codes are of a similar size.
+ *
+ * levels is the greatest number of times the image may be halved (up
+ * to 2), or 0 to disable this. The level used for each image is chosen
+ * from the module size of the codes found in previous ones, starting
+ * from the greatest. Tracked images and regions of interest take
+ * precedence. The reduced copies are sized here and by quirc_resize().
+ *
+ * Returns 0 on success, or -1 if levels is out of range or sufficient
+ * memory could not be allocated.
+ */
+int quirc_set_pyramid(struct quirc *q, int levels);
+
+/* Defer refining the position of each code until it is extracted.
+ * quirc_end() then only estimates the position of each code, which
+ * is enough for quirc_count(). quirc_extract() refines the position
+ * each time it is called, without keeping it, and quirc_refine() keeps
+ * it for later calls.
+ *
+ * Returns 0 on success, or -1 if lazy is neither 0 nor 1.
+ */
+int quirc_set_lazy_refinement(struct quirc *q, int lazy);
+
+/* Make quirc_end() stop looking for codes once max_codes of them have
+ * been decoded successfully. Codes which can't be decoded are still
+ * counted by quirc_count(). A limit of 0 finds all codes.
+ *
+ * quirc_end() decodes each code to check it, and the results are not
+ * kept, so codes the caller then decodes are decoded twice. The limit
+ * saves time only when it lets quirc_end() skip searching for others.
+ *
+ * Returns 0 on success, or -1 if the limit is negative.
+ */
+int quirc_set_max_codes(struct quirc *q, int max_codes);
+
 /* This enum describes the various decoder errors which may occur. */
 typedef enum {
 	QUIRC_SUCCESS = 0,
@@ -160,6 +469,15 @@ struct quirc_data {
  */
 int quirc_count(const struct quirc *q);
 
+/* Refine the position of the QR-code specified by the given index, if
+ * that was deferred by quirc_set_lazy_refinement(), and keep it so that
+ * quirc_extract() doesn't refine it again. Codes which have already been
+ * refined are left as they are.
+ *
+ * Returns 0 on success, or -1 if the index is out of range.
+ */
+int quirc_refine(struct quirc *q, int index);
+
 /* Extract the QR-code specified by the given index. */
 void quirc_extract(const struct quirc *q, int index,
 		   struct quirc_code *code);
@@ -171,6 +489,89 @@ quirc_decode_error_t quirc_decode(const struct quirc_code *code,
 /* Flip a QR-code according to optional mirror feature of ISO 18004:2015 */
 void quirc_flip(struct quirc_code *code);
 
+/* This structure describes one of the codes decoded by
+ * quirc_decode_all().
+ */
+struct quirc_result {
+	/* The four corners of the QR-code, from top left, clockwise */
+	struct quirc_point	corners[4];
+
+	/* QUIRC_SUCCESS, or the reason the code could not be decoded.
+	 * If decoding failed, only the corners are valid.
+	 */
+	quirc_decode_error_t	err;
+
+	/* As in struct quirc_data */
+	int			version;
+	int			ecc_level;
+	int			mask;
+	int			data_type;
+	uint32_t		eci;
+
+	/* Nul-terminated payload, stored in the arena */
+	const uint8_t		*payload;
+	int			payload_len;
+};
+
+/* Extract and decode all of the QR-codes identified in the last
+ * processed image, storing the results in a caller-supplied arena. The
+ * arena, which must be aligned as memory returned by malloc(), starts
+ * with an array of quirc_count() results, and the payloads are packed
+ * after it. Mirrored codes are decoded as by quirc_flip().
+ *
+ * Returns the number of results, or -1 if the arena can't hold the
+ * array. A code whose payload doesn't fit in the rest of the arena
+ * fails with QUIRC_ERROR_DATA_OVERFLOW.
+ */
+int quirc_decode_all(const struct quirc *q, void *arena, size_t size);
+
+/* A pool of decoders, for processing many images concurrently. Each
+ * worker owns a decoder whose buffers are kept from one image to the
+ * next.
+ *
+ * When a job has been processed, the pool's function is called on the
+ * worker's thread with the job's data pointer and the worker's decoder,
+ * which can be queried with quirc_count() and quirc_extract() until the
+ * function returns. If the decoder could not be resized for the image,
+ * the decoder passed is NULL.
+ */
+struct quirc_pool;
+
+typedef void (*quirc_pool_func_t)(void *user_data, void *job_data,
+				  const struct quirc *q);
+
+/* Construct a pool with the given number of workers, and room for
+ * queue_size jobs waiting to be processed. Returns NULL if the
+ * arguments are invalid or the pool could not be created.
+ *
+ * Workers run on their own threads only if quirc was built with
+ * QUIRC_USE_PTHREAD. Otherwise the pool has a single worker, and jobs
+ * are processed on the submitting thread.
+ */
+struct quirc_pool *quirc_pool_new(int workers, int queue_size,
+				  quirc_pool_func_t func, void *user_data);
+
+/* Process any jobs still queued, then destroy the pool. */
+void quirc_pool_destroy(struct quirc_pool *pool);
+
+/* Return the number of workers, and the decoder owned by a worker. The
+ * decoders may be configured (for example with
+ * quirc_set_threshold_method()) before any jobs are submitted.
+ */
+int quirc_pool_count(const struct quirc_pool *pool);
+struct quirc *quirc_pool_decoder(struct quirc_pool *pool, int index);
+
+/* Queue a w*h grayscale image for processing, blocking while the queue
+ * is full. The image must remain valid until the pool's function has
+ * been called for the job. Returns 0 on success, or -1 if the size is
+ * invalid.
+ */
+int quirc_pool_submit(struct quirc_pool *pool, const uint8_t *image,
+		      int w, int h, void *job_data);
+
+/* Wait for all submitted jobs to be processed. */
+void quirc_pool_wait(struct quirc_pool *pool);
+
 #ifdef __cplusplus
 }
 #endif
@@ -18,6 +18,7 @@
 #define QUIRC_INTERNAL_H_
 
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 
 #include "quirc.h"
@@ -28,6 +29,9 @@
 #define QUIRC_PIXEL_BLACK	1
 #define QUIRC_PIXEL_REGION	2
 
+/* Default limits, which can be changed with quirc_set_limits(). Region
+ * counts include the reserved pixel values below QUIRC_PIXEL_REGION.
+ */
 #ifndef QUIRC_MAX_REGIONS
 #define QUIRC_MAX_REGIONS	254
 #endif
@@ -35,17 +39,67 @@
 #define QUIRC_MAX_GRIDS		(QUIRC_MAX_CAPSTONES * 2)
 
 #define QUIRC_PERSPECTIVE_PARAMS	8
+#define QUIRC_MAX_ROI			8
+
+/* Limits for the threaded finder scan. Each band can hold this many
+ * finder pattern candidates before its worker gives up, leaving the
+ * rest of the band to be scanned serially.
+ */
+#define QUIRC_MAX_THREADS		64
+#define QUIRC_BAND_CANDIDATES		2048
+
+/* Limits for coarse-to-fine detection. A pyramid level is only used if
+ * the modules of the codes last found would be at least this many
+ * pixels across at that level.
+ */
+#define QUIRC_MAX_PYRAMID		2
+#define QUIRC_PYRAMID_MODULE		3
 
-#if QUIRC_MAX_REGIONS < UINT8_MAX
+/* With QUIRC_BITPLANE, thresholded pixels are packed into a bitplane,
+ * one row at a time, and regions are always found from runs. Pixels
+ * are then never labelled, so there is only a single row of them.
+ *
+ * Otherwise, flood filled regions are labelled in the pixels, so there
+ * can be no more than QUIRC_MAX_LABELS of them.
+ */
+#if defined(QUIRC_BITPLANE)
+#define QUIRC_PIXEL_ALIAS_IMAGE	0
+#define QUIRC_PIXEL_WIDE	0
+#define QUIRC_MAX_LABELS	INT_MAX
+typedef uint8_t quirc_pixel_t;
+#elif QUIRC_MAX_REGIONS < UINT8_MAX
 #define QUIRC_PIXEL_ALIAS_IMAGE	1
+#define QUIRC_PIXEL_WIDE	0
+#define QUIRC_MAX_LABELS	UINT8_MAX
 typedef uint8_t quirc_pixel_t;
 #elif QUIRC_MAX_REGIONS < UINT16_MAX
 #define QUIRC_PIXEL_ALIAS_IMAGE	0
+#define QUIRC_PIXEL_WIDE	1
+#define QUIRC_MAX_LABELS	UINT16_MAX
 typedef uint16_t quirc_pixel_t;
 #else
 #error "QUIRC_MAX_REGIONS > 65534 is not supported"
 #endif
 
+/* SIMD kernels are chosen at compile time from what the target always
+ * provides (SSE2 on x86-64, NEON on AArch64). With GCC and Clang on x86,
+ * SSSE3 and AVX2 kernels are built as well and selected at runtime if
+ * the CPU supports them. Defining QUIRC_NO_SIMD restricts quirc to portable C.
+ */
+#ifndef QUIRC_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64)
+#define QUIRC_HAVE_SSE2
+#endif
+#if defined(QUIRC_HAVE_SSE2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define QUIRC_HAVE_SSSE3
+#define QUIRC_HAVE_AVX2
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define QUIRC_HAVE_NEON
+#endif
+#endif
+
 #ifdef QUIRC_FLOAT_TYPE
 /* Quirc uses double precision floating point internally by default.
  * On platforms with a single precision FPU but no double precision FPU,
@@ -60,10 +114,22 @@ typedef QUIRC_FLOAT_TYPE quirc_float_t;
 typedef double quirc_float_t;
 #endif
 
+/* Each region keeps its extreme points in this many directions around
+ * the compass: (1, 0), (2, 1), (1, 1), (1, 2), (0, 1) and so on, in
+ * order of angle from +x.
+ */
+#define QUIRC_REGION_EXTREMES	16
+
 struct quirc_region {
 	struct quirc_point	seed;
 	int			count;
 	int			capstone;
+
+	/* Extreme points, found when the region is labelled if it is
+	 * likely to need them.
+	 */
+	int			has_extremes;
+	struct quirc_point	extremes[QUIRC_REGION_EXTREMES];
 };
 
 struct quirc_capstone {
@@ -91,6 +157,39 @@ struct quirc_grid {
 	/* Grid size and perspective transform */
 	int			grid_size;
 	quirc_float_t		c[QUIRC_PERSPECTIVE_PARAMS];
+
+	/* Whether the transform has been refined to fit the image */
+	int			refined;
+
+#ifdef QUIRC_STATS
+	/* Time spent refining the transform, and transforms tested */
+	uint64_t		refine_ns;
+	unsigned int		refine_tests;
+#endif
+};
+
+/* Capstone grouping keeps this many of the capstones aligned with each
+ * one in each of four directions, so each can be the corner of up to
+ * QUIRC_GROUPINGS possible grids.
+ */
+#define QUIRC_GROUP_NEAREST	2
+#define QUIRC_GROUPINGS		(4 * QUIRC_GROUP_NEAREST * QUIRC_GROUP_NEAREST)
+
+/* A possible grid, with capstone B at its corner. Groupings are ranked
+ * by how well their timing patterns match (out of 20), how near A and
+ * C are to B compared to the other capstones in their directions, and
+ * how square they are. A grouping is taken when its capstones are given
+ * to it, and done once its grid has been recorded or given up.
+ */
+struct quirc_grouping {
+	int			caps[3];
+	int			order;
+	int			rank;
+	int			timing;
+	int			nearness;
+	int			taken;
+	int			done;
+	quirc_float_t		squareness;
 };
 
 struct quirc_flood_fill_vars {
@@ -100,23 +199,215 @@ struct quirc_flood_fill_vars {
 	int left_down;
 };
 
+/* Runs of dark pixels, for QUIRC_REGIONS_RUNS. There is room for one
+ * run per this many pixels; images with more are flood filled instead,
+ * or with QUIRC_BITPLANE, have them found for a window of rows at a
+ * time.
+ */
+#ifndef QUIRC_RUN_DENSITY
+#define QUIRC_RUN_DENSITY		16
+#endif
+
+/* A run of dark pixels from x0 to x1 inclusive. While runs are being
+ * joined, label is the index of an earlier run in the same region (or
+ * of the run itself, for the first); afterwards it is the index of the
+ * run's component.
+ */
+struct quirc_run {
+	int			x0;
+	int			x1;
+	int			label;
+};
+
+/* A connected set of runs. Its region is only recorded when the finder
+ * pattern search first touches it.
+ */
+struct quirc_component {
+	int			area;
+	int			region;
+	int			y0;
+	int			y1;
+};
+
+/* A run of 1:1:3:1:1 found by a worker thread, to be tested later */
+struct quirc_finder_candidate {
+	unsigned int		x;
+	unsigned int		y;
+	unsigned int		pb[5];
+};
+
+/* A horizontal band of the image, scanned by one thread. Rows from
+ * resume_y onwards were not scanned because the band ran out of room.
+ */
+struct quirc_scan_band {
+	const struct quirc	*q;
+	unsigned int		y_start;
+	unsigned int		y_end;
+	unsigned int		resume_y;
+	int			count;
+	struct quirc_finder_candidate *candidates;
+};
+
+/* Performance counters, with QUIRC_STATS */
+#ifdef QUIRC_STATS
+#define QUIRC_STATS_ADD(q, field, n)	((q)->stats->field += (n))
+#define QUIRC_STATS_MAX(q, field, n) \
+	do { \
+		struct quirc_stats *s_ = (q)->stats; \
+		if ((unsigned int)(n) > s_->field) \
+			s_->field = (n); \
+	} while (0)
+
+/* Return a monotonic time in nanoseconds */
+uint64_t quirc_stats_clock(void);
+#else
+#define QUIRC_STATS_ADD(q, field, n)	((void)0)
+#define QUIRC_STATS_MAX(q, field, n)	((void)0)
+#endif
+
+/* Stages of detection, in the order quirc_step() works through them */
+typedef enum {
+	QUIRC_STEP_START,
+	QUIRC_STEP_COARSE,
+	QUIRC_STEP_THRESHOLD,
+	QUIRC_STEP_HISTOGRAM,
+	QUIRC_STEP_BINARIZE,
+	QUIRC_STEP_SCAN,
+	QUIRC_STEP_GROUP,
+	QUIRC_STEP_RECORD,
+	QUIRC_STEP_DONE
+} quirc_step_t;
+
 struct quirc {
 	uint8_t			*image;
 	quirc_pixel_t		*pixels;
+	size_t			image_capacity;
 	int			w;
 	int			h;
 
+	/* Packed pixels (only with QUIRC_BITPLANE), one bit each, in rows
+	 * of bits_stride words.
+	 */
+	uint64_t		*bits;
+	int			bits_stride;
+
+	/* Caller's image, if one was given to quirc_set_image() */
+	const uint8_t		*source;
+	int			source_stride;
+
+	quirc_threshold_method_t threshold_method;
+	int			threshold_valid;
+	uint8_t			threshold;
+
+	/* Working buffers for the adaptive thresholding methods */
+	int			threshold_radius;
+	uint32_t		*threshold_sums;
+	uint8_t			*threshold_rows;
+
+	/* Dark runs of each row, if the region method uses them. Row y
+	 * has runs row_runs[y] up to row_runs[y + 1]. If runs_valid is
+	 * zero, regions are flood filled for this frame.
+	 */
+	quirc_region_method_t	region_method;
+	int			runs_valid;
+	int			run_capacity;
+	struct quirc_run	*runs;
+	struct quirc_component	*components;
+	int			*row_runs;
+#ifdef QUIRC_BITPLANE
+	/* Rows from run_y0 to run_y1 have runs, and run_moves counts the
+	 * times they were found again for another window of rows.
+	 */
+	int			run_y0;
+	int			run_y1;
+	int			run_moves;
+#endif
+
+	/* Tables of the regions, capstones and grids found, sized by
+	 * quirc_set_limits(), and of the possible groupings of capstones
+	 * into grids. Capstones are indexed by position in capstone_order.
+	 */
+	int			max_regions;
+	int			max_capstones;
+	int			max_grids;
+
 	int			num_regions;
-	struct quirc_region	regions[QUIRC_MAX_REGIONS];
+	struct quirc_region	*regions;
 
 	int			num_capstones;
-	struct quirc_capstone	capstones[QUIRC_MAX_CAPSTONES];
+	struct quirc_capstone	*capstones;
+	int			*capstone_order;
+
+	int			num_groupings;
+	struct quirc_grouping	*groupings;
 
 	int			num_grids;
-	struct quirc_grid	grids[QUIRC_MAX_GRIDS];
+	struct quirc_grid	*grids;
+
+	/* quirc_limit_t flags for the current image */
+	unsigned int		limits_reached;
 
 	size_t      		num_flood_fill_vars;
 	struct quirc_flood_fill_vars *flood_fill_vars;
+
+	/* Regions of interest set by the caller */
+	int			num_roi;
+	struct quirc_rect	roi[QUIRC_MAX_ROI];
+
+	/* Windows around the codes found in the last frame, used by
+	 * the next until the next full frame scan.
+	 */
+	int			track_interval;
+	int			track_frames;
+	int			num_track_windows;
+	struct quirc_rect	track_windows[QUIRC_MAX_ROI];
+
+	/* Reduced copies of the image, each held by a decoder of its own
+	 * with half the width and height of the one before. Codes are first
+	 * searched for at pyramid_level, if it is non-zero.
+	 */
+	int			pyramid_levels;
+	int			pyramid_level;
+	struct quirc		*pyramid[QUIRC_MAX_PYRAMID];
+
+	/* Grids are refined when extracted rather than when found, and
+	 * grouping stops once max_codes grids have been decoded, if it is
+	 * non-zero.
+	 */
+	int			lazy_refinement;
+	int			max_codes;
+
+	/* Progress of quirc_step() through the image: the stage reached,
+	 * the windows being processed (or -1 for the whole image), the
+	 * next row to threshold or scan, the histogram of the rows so far
+	 * and the next grouping to record.
+	 */
+	quirc_step_t		step;
+	int			step_num_windows;
+	struct quirc_rect	step_windows[QUIRC_MAX_ROI];
+	int			step_row;
+	unsigned int		step_histogram[UINT8_MAX + 1];
+	int			step_grouping;
+	int			step_decoded;
+
+	/* Work done on the image so far, and the amount at which the
+	 * current call to quirc_step() should stop (0 if unlimited).
+	 */
+	long			work_done;
+	long			work_budget;
+
+#ifdef QUIRC_STATS
+	/* Performance counters for the current image. They are kept apart
+	 * so that quirc_extract() can count its time through a const
+	 * decoder.
+	 */
+	struct quirc_stats	*stats;
+#endif
+
+	/* Threaded finder scan (only with QUIRC_USE_PTHREAD) */
+	int			num_threads;
+	struct quirc_scan_band	*scan_bands;
+	struct quirc_finder_candidate *scan_candidates;
 };
 
 /************************************************************************
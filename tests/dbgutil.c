@@ -75,6 +75,44 @@ void dump_cells(const struct quirc_code *code)
 	}
 }
 
+void dump_stats(const struct quirc *q)
+{
+	struct quirc_stats s;
+	int i;
+
+	if (quirc_get_stats(q, &s) < 0)
+		return;
+
+	printf("    Time (us): otsu %llu, binarize %llu, finder scan %llu, "
+	       "grouping %llu, jiggle %llu, extract %llu\n",
+	       (unsigned long long)s.otsu_ns / 1000,
+	       (unsigned long long)s.binarize_ns / 1000,
+	       (unsigned long long)s.finder_scan_ns / 1000,
+	       (unsigned long long)s.grouping_ns / 1000,
+	       (unsigned long long)s.jiggle_ns / 1000,
+	       (unsigned long long)s.extract_ns / 1000);
+	printf("    Regions: %u (%u exhausted), flood fill spans: %llu, "
+	       "depth: %u, overflows: %u\n",
+	       s.regions, s.region_exhaustions,
+	       (unsigned long long)s.flood_fill_spans,
+	       s.flood_fill_max_depth, s.flood_fill_overflows);
+	printf("    Capstones: %u, grids: %u, fitness evaluations: %llu\n",
+	       s.capstones, s.grids,
+	       (unsigned long long)s.fitness_evaluations);
+
+	for (i = 0; i < quirc_count(q); i++) {
+		struct quirc_grid_stats g;
+
+		if (quirc_get_grid_stats(q, i, &g) < 0)
+			break;
+
+		printf("    Grid %d: refine %llu us, "
+		       "fitness evaluations: %u\n",
+		       i, (unsigned long long)g.refine_ns / 1000,
+		       g.fitness_evaluations);
+	}
+}
+
 struct my_jpeg_error {
 	struct jpeg_error_mgr   base;
 	jmp_buf                 env;
@@ -29,6 +29,11 @@ void dump_data(const struct quirc_data *data);
 /* Dump a grid cell map on stdout. */
 void dump_cells(const struct quirc_code *code);
 
+/* Dump the performance counters for the last image on stdout, if the
+ * library was built with QUIRC_STATS.
+ */
+void dump_stats(const struct quirc *q);
+
 /* Read a JPEG image into the decoder.
  *
  * Note that you must call quirc_end() if the function returns
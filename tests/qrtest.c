@@ -15,6 +15,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
@@ -30,10 +31,49 @@
 
 static int want_verbose = 0;
 static int want_cell_dump = 0;
+static int want_stats = 0;
+static int want_decode_all = 0;
+static int pool_workers = 0;
+static int check_failures = 0;
+
+/* Options selecting the decoder's modes. Other than the tiled and local
+ * mean thresholds and max_codes, they should decode the same codes as
+ * the defaults.
+ */
+static quirc_threshold_method_t threshold_method = QUIRC_THRESHOLD_OTSU;
+static quirc_region_method_t region_method = QUIRC_REGIONS_FLOOD_FILL;
+static int num_threads = 1;
+static int pyramid_levels = 0;
+static int lazy_refinement = 0;
+static int max_codes = 0;
+static int whole_roi = 0;
+static long step_work = 0;
+static int stride_pad = 0;
 
 #define MS(ts) (unsigned int)((ts.tv_sec * 1000) + (ts.tv_nsec / 1000000))
 
 static struct quirc *decoder;
+static struct quirc_pool *pool;
+
+/* An image decoded again by the pool, with the results of decoding it
+ * with the main decoder. The pool's function sets mismatch on a worker's
+ * thread, and it is only read after quirc_pool_wait().
+ */
+struct pool_job {
+	struct pool_job		*next;
+	char			*filename;
+	uint8_t			*image;
+	int			w;
+	int			h;
+	int			count;
+	struct quirc_point	(*corners)[4];
+	quirc_decode_error_t	*errs;
+	struct quirc_data	*data;
+	int			mismatch;
+};
+
+static struct pool_job *pool_jobs;
+static struct pool_job **pool_jobs_tail = &pool_jobs;
 
 struct result_info {
 	int		file_count;
@@ -79,12 +119,308 @@ static void add_result(struct result_info *sum, struct result_info *inf)
 	sum->total_time += inf->total_time;
 }
 
+static quirc_decode_error_t decode_code(const struct quirc *q, int index,
+				       struct quirc_code *code,
+				       struct quirc_data *data)
+{
+	quirc_decode_error_t err;
+
+	quirc_extract(q, index, code);
+
+	err = quirc_decode(code, data);
+	if (err == QUIRC_ERROR_DATA_ECC) {
+		quirc_flip(code);
+		err = quirc_decode(code, data);
+	}
+
+	return err;
+}
+
+/* Compare a result of quirc_decode_all() with the same code extracted
+ * and decoded by itself. If the payload was left out of the arena, an
+ * overflow must be reported instead.
+ */
+static int result_matches(const struct quirc_result *r,
+			  const struct quirc_code *code,
+			  quirc_decode_error_t err,
+			  const struct quirc_data *data, int left_out)
+{
+	if (memcmp(r->corners, code->corners, sizeof(r->corners)))
+		return 0;
+
+	if (left_out)
+		err = QUIRC_ERROR_DATA_OVERFLOW;
+
+	if (r->err != err)
+		return 0;
+
+	if (err)
+		return !r->payload && !r->payload_len;
+
+	return r->version == data->version &&
+	       r->ecc_level == data->ecc_level &&
+	       r->mask == data->mask &&
+	       r->data_type == data->data_type &&
+	       r->eci == data->eci &&
+	       r->payload_len == data->payload_len &&
+	       !memcmp(r->payload, data->payload, data->payload_len + 1);
+}
+
+static void check_failed(const char *filename, const char *what)
+{
+	printf("  %s: quirc_decode_all() %s\n", filename, what);
+	check_failures++;
+}
+
+/* Check that quirc_decode_all() gives the same results as quirc_extract()
+ * and quirc_decode(), with an arena just big enough, with one byte too
+ * few for the last payload, and with too little room for the results.
+ */
+static void check_decode_all(const char *filename)
+{
+	const int count = quirc_count(decoder);
+	const size_t results_size = count * sizeof(struct quirc_result);
+	struct quirc_code *codes = calloc(count + 1, sizeof(*codes));
+	struct quirc_data *data = calloc(count + 1, sizeof(*data));
+	quirc_decode_error_t *errs = calloc(count + 1, sizeof(*errs));
+	size_t size = results_size;
+	struct quirc_result *results = NULL;
+	int last = -1;
+	int i;
+
+	if (!codes || !data || !errs)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		errs[i] = decode_code(decoder, i, &codes[i], &data[i]);
+		if (!errs[i]) {
+			size += data[i].payload_len + 1;
+			last = i;
+		}
+	}
+
+	results = malloc(size + 1);
+	if (!results)
+		goto out;
+
+	if (quirc_decode_all(decoder, results, size) != count) {
+		check_failed(filename, "failed with a large enough arena");
+	} else {
+		for (i = 0; i < count; i++)
+			if (!result_matches(&results[i], &codes[i], errs[i],
+					    &data[i], 0))
+				check_failed(filename, "gave a different result");
+	}
+
+	if (last >= 0) {
+		if (quirc_decode_all(decoder, results, size - 1) != count) {
+			check_failed(filename, "failed with a short arena");
+		} else {
+			for (i = 0; i < count; i++)
+				if (!result_matches(&results[i], &codes[i],
+						    errs[i], &data[i],
+						    i == last))
+					check_failed(filename,
+						     "didn't report an overflow");
+		}
+	}
+
+	if (count && quirc_decode_all(decoder, results, results_size - 1) >= 0)
+		check_failed(filename, "didn't fail without room for results");
+
+out:
+	if (!codes || !data || !errs || !results)
+		check_failed(filename, "couldn't be checked (out of memory)");
+
+	free(results);
+	free(errs);
+	free(data);
+	free(codes);
+}
+
+static void pool_check(void *user_data, void *job_data,
+		       const struct quirc *q)
+{
+	struct pool_job *job = job_data;
+	int i;
+
+	(void)user_data;
+
+	free(job->image);
+	job->image = NULL;
+
+	if (!q || quirc_count(q) != job->count) {
+		job->mismatch = 1;
+		return;
+	}
+
+	for (i = 0; i < job->count; i++) {
+		struct quirc_code code;
+		struct quirc_data data;
+		quirc_decode_error_t err = decode_code(q, i, &code, &data);
+
+		if (memcmp(code.corners, job->corners[i],
+			   sizeof(code.corners)) ||
+		    err != job->errs[i] ||
+		    (!err && (data.payload_len != job->data[i].payload_len ||
+			      memcmp(data.payload, job->data[i].payload,
+				     data.payload_len))))
+			job->mismatch = 1;
+	}
+}
+
+static void pool_job_free(struct pool_job *job)
+{
+	free(job->filename);
+	free(job->image);
+	free(job->corners);
+	free(job->errs);
+	free(job->data);
+	free(job);
+}
+
+/* Queue the image loaded into the main decoder, which has not been
+ * processed yet, to be decoded again by the pool once the main decoder
+ * has found its codes.
+ */
+static struct pool_job *pool_job_new(const char *filename)
+{
+	struct pool_job *job = calloc(1, sizeof(*job));
+	const uint8_t *image;
+
+	if (!job)
+		return NULL;
+
+	image = quirc_begin(decoder, &job->w, &job->h);
+	job->filename = strdup(filename);
+	job->image = malloc((size_t)job->w * job->h);
+	if (!job->filename || !job->image) {
+		pool_job_free(job);
+		return NULL;
+	}
+
+	memcpy(job->image, image, (size_t)job->w * job->h);
+	return job;
+}
+
+static void pool_job_submit(struct pool_job *job)
+{
+	int i;
+
+	job->count = quirc_count(decoder);
+	job->corners = calloc(job->count + 1, sizeof(job->corners[0]));
+	job->errs = calloc(job->count + 1, sizeof(job->errs[0]));
+	job->data = calloc(job->count + 1, sizeof(job->data[0]));
+	if (!job->corners || !job->errs || !job->data) {
+		free(job->image);
+		job->image = NULL;
+		job->mismatch = 1;
+	} else {
+		for (i = 0; i < job->count; i++) {
+			struct quirc_code code;
+
+			job->errs[i] = decode_code(decoder, i, &code,
+						   &job->data[i]);
+			memcpy(job->corners[i], code.corners,
+			       sizeof(code.corners));
+		}
+
+		if (quirc_pool_submit(pool, job->image, job->w, job->h,
+				      job) < 0) {
+			free(job->image);
+			job->image = NULL;
+			job->mismatch = 1;
+		}
+	}
+
+	*pool_jobs_tail = job;
+	pool_jobs_tail = &job->next;
+}
+
+/* Wait for the pool, and report the images it decoded differently */
+static void pool_report(void)
+{
+	int files = 0;
+	int mismatches = 0;
+
+	quirc_pool_wait(pool);
+
+	while (pool_jobs) {
+		struct pool_job *job = pool_jobs;
+
+		if (job->mismatch) {
+			printf("  %s: the pool's result differs\n",
+			       job->filename);
+			mismatches++;
+		}
+
+		files++;
+		pool_jobs = job->next;
+		pool_job_free(job);
+	}
+
+	pool_jobs_tail = &pool_jobs;
+	printf("Pool of %d workers: %d files, %d differ\n",
+	       quirc_pool_count(pool), files, mismatches);
+	check_failures += mismatches;
+}
+
+/* Apply the modes selected on the command line to a decoder */
+static int configure(struct quirc *q)
+{
+	/* A region of interest bigger than any image, which is clipped */
+	static const struct quirc_rect roi = { 0, 0, 1 << 20, 1 << 20 };
+
+	if (quirc_set_threshold_method(q, threshold_method) < 0 ||
+	    quirc_set_region_method(q, region_method) < 0 ||
+	    quirc_set_threads(q, num_threads) < 0 ||
+	    quirc_set_pyramid(q, pyramid_levels) < 0 ||
+	    quirc_set_lazy_refinement(q, lazy_refinement) < 0 ||
+	    quirc_set_max_codes(q, max_codes) < 0 ||
+	    (whole_roi && quirc_set_roi(q, &roi, 1) < 0))
+		return -1;
+
+	return 0;
+}
+
+/* Copy the image loaded into the decoder to a buffer whose rows are
+ * stride_pad bytes longer, and have the decoder read it from there.
+ */
+static uint8_t *set_padded_image(void)
+{
+	const uint8_t *image;
+	uint8_t *padded;
+	int w, h;
+	int y;
+
+	image = quirc_begin(decoder, &w, &h);
+	padded = malloc((size_t)(w + stride_pad) * h);
+	if (!padded)
+		return NULL;
+
+	for (y = 0; y < h; y++) {
+		memcpy(padded + (size_t)y * (w + stride_pad),
+		       image + (size_t)y * w, w);
+		memset(padded + (size_t)y * (w + stride_pad) + w, 0xa5,
+		       stride_pad);
+	}
+
+	if (quirc_set_image(decoder, padded, w, h, w + stride_pad) < 0) {
+		free(padded);
+		return NULL;
+	}
+
+	return padded;
+}
+
 static int scan_file(const char *path, const char *filename,
 		     struct result_info *info)
 {
 	int (*loader)(struct quirc *, const char *);
 	int len = strlen(filename);
 	const char *ext;
+	struct pool_job *job = NULL;
+	uint8_t *padded = NULL;
 	struct timespec tp;
 	unsigned int start;
 	unsigned int total_start;
@@ -112,11 +448,36 @@ static int scan_file(const char *path, const char *filename,
 		return -1;
 	}
 
+	if (pool) {
+		job = pool_job_new(filename);
+		if (!job) {
+			fprintf(stderr, "%s: can't queue for the pool\n",
+				filename);
+			check_failures++;
+		}
+	}
+
+	if (stride_pad) {
+		padded = set_padded_image();
+		if (!padded) {
+			fprintf(stderr, "%s: quirc_set_image failed\n",
+				filename);
+			if (job)
+				pool_job_free(job);
+			return -1;
+		}
+	}
+
 	(void)clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tp);
 	start = MS(tp);
-	quirc_end(decoder);
+	if (step_work)
+		while (!quirc_step(decoder, step_work))
+			;
+	else
+		quirc_end(decoder);
 	(void)clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tp);
 	info->identify_time = MS(tp) - start;
+	free(padded);
 
 	info->id_count = quirc_count(decoder);
 	for (i = 0; i < info->id_count; i++) {
@@ -145,6 +506,15 @@ static int scan_file(const char *path, const char *filename,
 	       info->total_time,
 	       info->id_count, info->decode_count);
 
+	if (want_stats)
+		dump_stats(decoder);
+
+	if (want_decode_all)
+		check_decode_all(filename);
+
+	if (job)
+		pool_job_submit(job);
+
 	if (want_cell_dump || want_verbose) {
 		for (i = 0; i < info->id_count; i++) {
 			struct quirc_code code;
@@ -256,6 +626,31 @@ static int run_tests(int argc, char **argv)
 		return -1;
 	}
 
+	if (configure(decoder) < 0) {
+		fprintf(stderr, "can't select the decoder's modes\n");
+		quirc_destroy(decoder);
+		return -1;
+	}
+
+	if (pool_workers) {
+		pool = quirc_pool_new(pool_workers, pool_workers * 2,
+				      pool_check, NULL);
+		if (!pool) {
+			perror("quirc_pool_new");
+			quirc_destroy(decoder);
+			return -1;
+		}
+
+		for (i = 0; i < quirc_pool_count(pool); i++)
+			if (configure(quirc_pool_decoder(pool, i)) < 0) {
+				fprintf(stderr, "can't select the pool's "
+					"modes\n");
+				quirc_pool_destroy(pool);
+				quirc_destroy(decoder);
+				return -1;
+			}
+	}
+
 	printf("  %-30s  %17s %11s\n", "", "Time (ms)", "Count");
 	printf("  %-30s  %5s %5s %5s %5s %5s\n",
 	       "Filename", "Load", "ID", "Total", "ID", "Dec");
@@ -275,7 +670,18 @@ static int run_tests(int argc, char **argv)
 	if (count > 1)
 		print_result("TOTAL", &sum);
 
+	if (pool) {
+		pool_report();
+		quirc_pool_destroy(pool);
+	}
+
 	quirc_destroy(decoder);
+
+	if (check_failures) {
+		printf("%d checks failed\n", check_failures);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -288,16 +694,95 @@ int main(int argc, char **argv)
 	printf("Library version: %s\n", quirc_version());
 	printf("\n");
 
-	while ((opt = getopt(argc, argv, "vd")) >= 0)
+	while ((opt = getopt(argc, argv, "vdsaP:t:r:j:p:lm:Rw:i:")) >= 0)
 		switch (opt) {
 		case 'v':
 			want_verbose = 1;
 			break;
 
+		case 's':
+			want_stats = 1;
+			break;
+
 		case 'd':
 			want_cell_dump = 1;
 			break;
 
+		case 'a':
+			want_decode_all = 1;
+			break;
+
+		case 'P':
+			pool_workers = atoi(optarg);
+			if (pool_workers < 1) {
+				fprintf(stderr, "-P needs at least one worker\n");
+				return -1;
+			}
+			break;
+
+		case 't':
+			if (!strcmp(optarg, "otsu"))
+				threshold_method = QUIRC_THRESHOLD_OTSU;
+			else if (!strcmp(optarg, "fused"))
+				threshold_method = QUIRC_THRESHOLD_OTSU_FUSED;
+			else if (!strcmp(optarg, "tiled"))
+				threshold_method = QUIRC_THRESHOLD_TILED_OTSU;
+			else if (!strcmp(optarg, "mean"))
+				threshold_method = QUIRC_THRESHOLD_LOCAL_MEAN;
+			else {
+				fprintf(stderr, "-t takes otsu, fused, tiled "
+					"or mean\n");
+				return -1;
+			}
+			break;
+
+		case 'r':
+			if (!strcmp(optarg, "flood"))
+				region_method = QUIRC_REGIONS_FLOOD_FILL;
+			else if (!strcmp(optarg, "runs"))
+				region_method = QUIRC_REGIONS_RUNS;
+			else {
+				fprintf(stderr, "-r takes flood or runs\n");
+				return -1;
+			}
+			break;
+
+		case 'j':
+			num_threads = atoi(optarg);
+			break;
+
+		case 'p':
+			pyramid_levels = atoi(optarg);
+			break;
+
+		case 'l':
+			lazy_refinement = 1;
+			break;
+
+		case 'm':
+			max_codes = atoi(optarg);
+			break;
+
+		case 'R':
+			whole_roi = 1;
+			break;
+
+		case 'w':
+			step_work = atol(optarg);
+			if (step_work < 1) {
+				fprintf(stderr, "-w needs some work per step\n");
+				return -1;
+			}
+			break;
+
+		case 'i':
+			stride_pad = atoi(optarg);
+			if (stride_pad < 1) {
+				fprintf(stderr, "-i needs some padding\n");
+				return -1;
+			}
+			break;
+
 		case '?':
 			return -1;
 		}